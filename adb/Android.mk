@@ -62,6 +62,7 @@ LOCAL_SRC_FILES := \
 	sockets.c \
 	services.c \
 	file_sync_client.c \
+	lz4_block.c \
 	$(EXTRA_SRCS) \
 	$(USB_SRCS) \
 	usb_vendors.c
@@ -79,7 +80,7 @@ LOCAL_CFLAGS += -D_XOPEN_SOURCE -D_GNU_SOURCE
 LOCAL_MODULE := adb
 LOCAL_MODULE_TAGS := debug
 
-LOCAL_STATIC_LIBRARIES := libzipfile libunz libcrypto_static $(EXTRA_STATIC_LIBS)
+LOCAL_STATIC_LIBRARIES := libzipfile libunz libcrypto_static libmincrypt $(EXTRA_STATIC_LIBS)
 ifeq ($(USE_SYSDEPS_WIN32),)
 	LOCAL_STATIC_LIBRARIES += libcutils
 endif
@@ -111,6 +112,7 @@ LOCAL_SRC_FILES := \
 	sockets.c \
 	services.c \
 	file_sync_service.c \
+	lz4_block.c \
 	jdwp_service.c \
 	framebuffer_service.c \
 	remount_service.c \
@@ -158,6 +160,7 @@ LOCAL_SRC_FILES := \
 	sockets.c \
 	services.c \
 	file_sync_client.c \
+	lz4_block.c \
 	get_my_path_linux.c \
 	usb_linux.c \
 	usb_vendors.c \
@@ -177,7 +180,7 @@ LOCAL_C_INCLUDES += external/openssl/include
 
 LOCAL_MODULE := adb
 
-LOCAL_STATIC_LIBRARIES := libzipfile libunz libcutils
+LOCAL_STATIC_LIBRARIES := libzipfile libunz libcutils libmincrypt
 
 LOCAL_SHARED_LIBRARIES := libcrypto
 
@@ -197,16 +197,45 @@ void adb_qemu_trace(const char* fmt, ...)
 }
 #endif  /* !ADB_HOST */
 
+/* apackets are big enough that malloc hands them straight to mmap, so
+** recycle a bounded number of them instead of paying for a fresh mapping
+** on every OKAY/WRTE/CLSE.
+*/
+ADB_MUTEX_DEFINE( apacket_pool_lock );
+static apacket *apacket_pool = NULL;
+static int apacket_pool_count = 0;
+
 apacket *get_apacket(void)
 {
-    apacket *p = malloc(sizeof(apacket));
-    if(p == 0) fatal("failed to allocate an apacket");
+    apacket *p;
+
+    adb_mutex_lock(&apacket_pool_lock);
+    p = apacket_pool;
+    if (p) {
+        apacket_pool = p->next;
+        apacket_pool_count--;
+    }
+    adb_mutex_unlock(&apacket_pool_lock);
+
+    if (p == 0) {
+        p = malloc(sizeof(apacket));
+        if(p == 0) fatal("failed to allocate an apacket");
+    }
     memset(p, 0, sizeof(apacket) - MAX_PAYLOAD);
     return p;
 }
 
 void put_apacket(apacket *p)
 {
+    adb_mutex_lock(&apacket_pool_lock);
+    if (apacket_pool_count < APACKET_POOL_MAX) {
+        p->next = apacket_pool;
+        apacket_pool = p;
+        apacket_pool_count++;
+        p = NULL;
+    }
+    adb_mutex_unlock(&apacket_pool_lock);
+
     free(p);
 }
 
@@ -221,6 +250,8 @@ void handle_offline(atransport *t)
     D("adb: offline\n");
     //Close the associated usb
     t->online = 0;
+    t->max_payload = MAX_PAYLOAD_V1;
+    t->protocol_version = A_VERSION_MIN;
     run_transport_disconnects(t);
 }
 
@@ -323,7 +354,7 @@ static void send_connect(atransport *t)
     cp->msg.arg0 = A_VERSION;
     cp->msg.arg1 = MAX_PAYLOAD;
     cp->msg.data_length = fill_connect_data((char *)cp->data,
-                                            sizeof(cp->data));
+                                            MAX_PAYLOAD_V1);
     send_packet(cp, t);
 }
 
@@ -372,7 +403,7 @@ static void send_auth_publickey(atransport *t)
     apacket *p = get_apacket();
     int ret;
 
-    ret = adb_auth_get_userkey(p->data, sizeof(p->data));
+    ret = adb_auth_get_userkey(p->data, MAX_PAYLOAD_V1);
     if (!ret) {
         D("Failed to get user public key\n");
         put_apacket(p);
@@ -527,6 +558,22 @@ void handle_packet(apacket *p, atransport *t)
             handle_offline(t);
         }
 
+            /* only send what both sides can take; old peers
+            ** advertise MAX_PAYLOAD_V1 here and keep getting that
+            */
+        t->max_payload = p->msg.arg1;
+        if (t->max_payload > MAX_PAYLOAD) {
+            t->max_payload = MAX_PAYLOAD;
+        } else if (t->max_payload == 0) {
+            t->max_payload = MAX_PAYLOAD_V1;
+        }
+        D("adb: peer max payload %u, using %d\n", p->msg.arg1, (int)t->max_payload);
+
+        t->protocol_version = p->msg.arg0;
+        if (t->protocol_version > A_VERSION) {
+            t->protocol_version = A_VERSION;
+        }
+
         parse_banner((char*) p->data, t);
 
         if (HOST || !auth_enabled) {
@@ -551,9 +598,10 @@ void handle_packet(apacket *p, atransport *t)
             if (adb_auth_verify(t->token, p->data, p->msg.data_length)) {
                 adb_auth_verified(t);
                 t->failed_auth_attempts = 0;
+            } else if (t->failed_auth_attempts++ > 10) {
+                /* slow down guessing without stalling everyone else */
+                adb_auth_retry_later(t, 1000);
             } else {
-                if (t->failed_auth_attempts++ > 10)
-                    adb_sleep_ms(1000);
                 send_auth_request(t);
             }
         } else if (p->msg.arg0 == ADB_AUTH_RSAPUBLICKEY) {
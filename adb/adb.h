@@ -21,7 +21,14 @@
 
 #include "transport.h"  /* readx(), writex() */
 
-#define MAX_PAYLOAD 4096
+/* MAX_PAYLOAD_V1 is the largest payload every peer accepts; anything
+** bigger is only sent once the CNXN handshake says the peer takes it.
+*/
+#define MAX_PAYLOAD_V1  (4*1024)
+#define MAX_PAYLOAD     (256*1024)
+
+/* at most this many idle apackets are kept around for reuse */
+#define APACKET_POOL_MAX  32
 
 #define A_SYNC 0x434e5953
 #define A_CNXN 0x4e584e43
@@ -31,7 +38,9 @@
 #define A_WRTE 0x45545257
 #define A_AUTH 0x48545541
 
-#define A_VERSION 0x01000000        // ADB protocol version
+#define A_VERSION_MIN 0x01000000            // original protocol
+#define A_VERSION_SKIP_CHECKSUM 0x01000001  // data_check may be left at 0
+#define A_VERSION 0x01000001        // ADB protocol version
 
 #define ADB_VERSION_MAJOR 1         // Used for help/version information
 #define ADB_VERSION_MINOR 0         // Used for help/version information
@@ -67,6 +76,22 @@ struct apacket
     unsigned char data[MAX_PAYLOAD];
 };
 
+/* A single producer, single consumer ring of packets between a
+** transport thread and the fdevent loop.  The producer only signals
+** the wakeup fd when it fills an empty ring, so a busy consumer picks
+** up many packets per wakeup.
+*/
+#define APACKET_QUEUE_SIZE 256
+
+typedef struct apacket_queue
+{
+    apacket *ring[APACKET_QUEUE_SIZE];
+    volatile unsigned head;     /* next slot to take; the consumer's */
+    volatile unsigned tail;     /* next slot to fill; the producer's */
+    int wake_read;              /* the same fd when this is an eventfd */
+    int wake_write;
+} apacket_queue;
+
 /* An asocket represents one half of a connection between a local and
 ** remote entity.  A local asocket is bound to a file descriptor.  A
 ** remote asocket is bound to the protocol engine.
@@ -172,22 +197,53 @@ struct atransport
 
     int (*read_from_remote)(apacket *p, atransport *t);
     int (*write_to_remote)(apacket *p, atransport *t);
+        /* optional: write several packets at once, in order */
+    int (*write_batch_to_remote)(apacket **list, int count, atransport *t);
     void (*close)(atransport *t);
     void (*kick)(atransport *t);
 
-    int fd;
-    int transport_socket;
+        /* packets read from the remote side by the output thread,
+        ** on their way to the fdevent loop, and packets from the
+        ** fdevent loop for the input thread to write to the remote
+        ** side.  transport_fde watches incoming's wakeup fd.
+        */
+    apacket_queue incoming;
+    apacket_queue outgoing;
     fdevent transport_fde;
+
+        /* how many times the fdevent loop was woken for incoming
+        ** packets, and how many packets it found in all
+        */
+    unsigned long long wakeups;
+    unsigned long long wakeup_packets;
     int ref_count;
     unsigned sync_token;
     int connection_state;
     int online;
     transport_type type;
 
+        /* largest payload the remote side accepts, from its CNXN
+        ** message; MAX_PAYLOAD_V1 until the handshake completes
+        */
+    size_t max_payload;
+
+        /* protocol version both sides speak, from the peer's CNXN;
+        ** decides whether send_packet() fills in data_check.  The
+        ** input thread keeps its own copy of the peer's version in
+        ** recv_version so check_data() does not race with handle_packet()
+        */
+    unsigned protocol_version;
+    unsigned recv_version;
+
         /* usb handle or socket fd as needed */
     usb_handle *usb;
     int sfd;
 
+        /* bytes read from sfd but not yet parsed into packets */
+    unsigned char *sbuf;
+    unsigned sbuf_start;
+    unsigned sbuf_end;
+
         /* used to identify transports for clients */
     char *serial;
     char *product;
@@ -203,6 +259,7 @@ struct atransport
     void *key;
     unsigned char token[TOKEN_SIZE];
     fdevent auth_fde;
+    fdevent auth_retry_fde;
     unsigned failed_auth_attempts;
 };
 
@@ -237,6 +294,7 @@ asocket *find_local_socket(unsigned id);
 void install_local_socket(asocket *s);
 void remove_socket(asocket *s);
 void close_all_sockets(atransport *t);
+size_t get_max_payload(asocket *s);
 
 #define  LOCAL_CLIENT_PREFIX  "emulator-"
 
@@ -334,7 +392,7 @@ apacket *get_apacket(void);
 void put_apacket(apacket *p);
 
 int check_header(apacket *p);
-int check_data(apacket *p);
+int check_data(apacket *p, atransport *t);
 
 /* define ADB_TRACE to 1 to enable tracing support, or 0 to disable it */
 
@@ -53,7 +53,7 @@ static void read_keys(const char *file, struct listnode *list)
 {
     struct adb_public_key *key;
     FILE *f;
-    char buf[MAX_PAYLOAD];
+    char buf[MAX_PAYLOAD_V1];
     char *sep;
     int ret;
 
@@ -190,7 +190,7 @@ static void adb_auth_event(int fd, unsigned events, void *data)
 
 void adb_auth_confirm_key(unsigned char *key, size_t len, atransport *t)
 {
-    char msg[MAX_PAYLOAD];
+    char msg[MAX_PAYLOAD_V1];
     int ret;
 
     if (!usb_transport) {
@@ -226,6 +226,24 @@ void adb_auth_confirm_key(unsigned char *key, size_t len, atransport *t)
     fdevent_add(&t->auth_fde, FDE_READ);
 }
 
+static void adb_auth_retry_event(int fd, unsigned events, void *data)
+{
+    atransport *t = data;
+
+    if (events & FDE_TIMEOUT)
+        send_auth_request(t);
+}
+
+/* Send the next AUTH request after delay_ms, from the event loop rather
+** than by sleeping in it.  The transport removes the timer when it goes.
+*/
+void adb_auth_retry_later(atransport *t, int delay_ms)
+{
+    if (t->auth_retry_fde.func == NULL)
+        fdevent_install(&t->auth_retry_fde, FD_TIMER, adb_auth_retry_event, t);
+    fdevent_set_timeout(&t->auth_retry_fde, delay_ms);
+}
+
 static void adb_auth_listener(int fd, unsigned events, void *data)
 {
     struct sockaddr addr;
@@ -133,7 +133,7 @@ static int write_public_keyfile(RSA *private_key, const char *private_key_path)
 {
     RSAPublicKey pkey;
     BIO *bio, *b64, *bfile;
-    char path[PATH_MAX], info[MAX_PAYLOAD];
+    char path[PATH_MAX], info[MAX_PAYLOAD_V1];
     int ret;
 
     ret = snprintf(path, sizeof(path), "%s.pub", private_key_path);
@@ -320,7 +320,7 @@ static int get_user_key(struct listnode *list)
 static void get_vendor_keys(struct listnode *list)
 {
     const char *adb_keys_path;
-    char keys_path[MAX_PAYLOAD];
+    char keys_path[MAX_PAYLOAD_V1];
     char *path;
     char *save;
     struct stat buf;
@@ -203,6 +203,9 @@ void help()
         "                                 1 or all, adb, sockets, packets, rwx, usb, sync, sysdeps, transport, jdwp\n"
         "  ANDROID_SERIAL               - The serial number to connect to. -s takes priority over this if given.\n"
         "  ANDROID_LOG_TAGS             - When used with the logcat option, only these debug tags are printed.\n"
+        "  ADB_SYNC_JOBS                - Number of connections used to push or pull a directory (default 1, max 16).\n"
+        "  ADB_SYNC_COMPRESS            - Set to 0 to disable compression of push/pull data.\n"
+        "  ADB_SYNC_HASH                - Set to 0 to make sync compare timestamps only, not contents.\n"
         );
 }
 
@@ -28,6 +28,9 @@
 #include <stdarg.h>
 #include <stddef.h>
 
+#include <time.h>
+#include <sys/time.h>
+
 #include "fdevent.h"
 #include "transport.h"
 #include "sysdeps.h"
@@ -91,7 +94,7 @@ static void dump_fde(fdevent *fde, const char *info)
 
 static void fdevent_plist_enqueue(fdevent *node);
 static void fdevent_plist_remove(fdevent *node);
-static fdevent *fdevent_plist_dequeue(void);
+static fdevent *fdevent_plist_dequeue(fdevent *list);
 static void fdevent_subproc_event_func(int fd, unsigned events, void *userdata);
 
 static fdevent list_pending = {
@@ -102,13 +105,154 @@ static fdevent list_pending = {
 static fdevent **fd_table = 0;
 static int fd_table_max = 0;
 
-#ifdef CRAPTASTIC
-//HAVE_EPOLL
+static fdevent_stats stats;
+
+/* Timers live on a hashed wheel of FDE_WHEEL_SLOTS slots, FDE_TICK_MS
+** apart.  A timer further out than one revolution just sits in its slot
+** and is skipped (its deadline is in ticks) until its turn comes round.
+** fdevent_loop() fires the expired ones after each wait, and the wait
+** is bounded by the next occupied slot.
+*/
+#define FDE_TICK_MS      16
+#define FDE_WHEEL_SLOTS  256
+#define FDE_WHEEL_MASK   (FDE_WHEEL_SLOTS - 1)
+
+static fdevent wheel[FDE_WHEEL_SLOTS];
+static int64_t wheel_tick = 0;  /* last tick that has been expired */
+static int timer_count = 0;
+
+static int64_t fdevent_now_ms(void)
+{
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (int64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+#endif
+}
+
+static void fdevent_timer_cancel(fdevent *fde)
+{
+    if(fde->tnext == 0) return;
+
+    fde->tprev->tnext = fde->tnext;
+    fde->tnext->tprev = fde->tprev;
+    fde->tnext = 0;
+    fde->tprev = 0;
+    timer_count--;
+}
+
+void fdevent_set_timeout(fdevent *fde, int64_t timeout_ms)
+{
+    fdevent *slot;
+    int64_t now, tick;
+    int i;
+
+    fdevent_timer_cancel(fde);
+    if(timeout_ms < 0) return;
+
+    if(wheel[0].tnext == 0) {
+        for(i = 0; i < FDE_WHEEL_SLOTS; i++) {
+            wheel[i].tnext = wheel[i].tprev = &wheel[i];
+        }
+    }
+
+    now = fdevent_now_ms();
+    if(timer_count == 0) {
+            /* nothing was waiting, so nothing needs catching up */
+        wheel_tick = now / FDE_TICK_MS;
+    }
+
+        /* round up so a timer never fires early */
+    tick = (now + timeout_ms + FDE_TICK_MS - 1) / FDE_TICK_MS;
+    if(tick <= wheel_tick) tick = wheel_tick + 1;
+    fde->deadline = tick;
+
+    slot = &wheel[tick & FDE_WHEEL_MASK];
+    fde->tnext = slot;
+    fde->tprev = slot->tprev;
+    fde->tprev->tnext = fde;
+    slot->tprev = fde;
+    timer_count++;
+}
+
+/* Milliseconds until the next timer is due, or -1 if there are none.
+*/
+static int fdevent_timer_next(void)
+{
+    fdevent *fde, *slot;
+    int64_t tick, wait;
+    int i;
+
+    if(timer_count == 0) return -1;
+
+    for(i = 1; i <= FDE_WHEEL_SLOTS; i++) {
+        tick = wheel_tick + i;
+        slot = &wheel[tick & FDE_WHEEL_MASK];
+        for(fde = slot->tnext; fde != slot; fde = fde->tnext) {
+            if(fde->deadline <= tick) goto found;
+        }
+    }
+        /* everything is more than a revolution out; check back then */
+found:
+    wait = tick * FDE_TICK_MS - fdevent_now_ms();
+    return wait < 0 ? 0 : (int)wait;
+}
+
+static void fdevent_timer_expire(void)
+{
+    fdevent *fde, *next, *slot;
+    int64_t now_tick;
+    int n;
+
+    if(timer_count == 0) return;
+
+    now_tick = fdevent_now_ms() / FDE_TICK_MS;
+    for(n = 0; wheel_tick + n < now_tick && n < FDE_WHEEL_SLOTS; n++) {
+        slot = &wheel[(wheel_tick + 1 + n) & FDE_WHEEL_MASK];
+        for(fde = slot->tnext; fde != slot; fde = next) {
+            next = fde->tnext;
+            if(fde->deadline > now_tick) continue;
+
+            fdevent_timer_cancel(fde);
+            stats.timeouts++;
+            fde->events |= FDE_TIMEOUT;
+            if(fde->state & FDE_PENDING) continue;
+            fde->state |= FDE_PENDING;
+            fdevent_plist_enqueue(fde);
+        }
+    }
+    if(wheel_tick < now_tick) wheel_tick = now_tick;
+}
+
+#if defined(__linux__)
+#define HAVE_EPOLL 1
+#endif
+
+#if HAVE_EPOLL
 
 #include <sys/epoll.h>
 
+/* Interest is cached in fde->armed and only pushed to the kernel when an
+** fde wants an event that is not armed yet.  Dropping interest is lazy:
+** the wider mask stays armed until it actually reports something nobody
+** asked for, so the usual FDE_WRITE on/off toggling of a busy socket
+** costs no syscalls at all.  Registration stays level-triggered: the
+** callbacks only read what they can take and expect to be called again
+** for the rest, exactly as they were with select().
+*/
+
 static int epoll_fd = -1;
 
+    /* fds that epoll refuses (regular files); like select(), we treat
+    ** them as always ready for whatever they ask for */
+static int epoll_always = 0;
+
+#define FDE_ALWAYS     0x0800
+
 static void fdevent_init()
 {
         /* XXX: what's a good size for the passed in hint? */
@@ -123,91 +267,97 @@ static void fdevent_init()
     fcntl(epoll_fd, F_SETFD, FD_CLOEXEC);
 }
 
-static void fdevent_connect(fdevent *fde)
+static void fdevent_arm(fdevent *fde, unsigned armed)
 {
     struct epoll_event ev;
+    int op;
+
+    if(fde->state & FDE_ALWAYS) {
+        fde->armed = armed;
+        return;
+    }
+
+    if(fde->armed == 0) {
+        if(armed == 0) return;
+        op = EPOLL_CTL_ADD;
+    } else {
+        op = armed ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
+    }
 
     memset(&ev, 0, sizeof(ev));
-    ev.events = 0;
     ev.data.ptr = fde;
+    if(armed & FDE_READ) ev.events |= EPOLLIN;
+    if(armed & FDE_WRITE) ev.events |= EPOLLOUT;
+        /* EPOLLERR and EPOLLHUP are always reported */
 
-#if 0
-    if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fde->fd, &ev)) {
-        perror("epoll_ctl() failed\n");
-        exit(1);
+    stats.syscalls++;
+    if(epoll_ctl(epoll_fd, op, fde->fd, &ev) == 0) {
+        fde->armed = armed;
+        return;
     }
-#endif
+
+    switch(errno) {
+    case ENOENT:
+            /* the fd was closed and reopened behind our back, which
+            ** silently dropped it from the epoll set */
+        fde->armed = 0;
+        fdevent_arm(fde, armed);
+        return;
+    case EPERM:
+        if(op == EPOLL_CTL_ADD) {
+            fde->state |= FDE_ALWAYS;
+            fde->armed = armed;
+            epoll_always++;
+            return;
+        }
+        break;
+    case EBADF:
+        if(op == EPOLL_CTL_DEL) {
+            fde->armed = 0;
+            return;
+        }
+        break;
+    }
+    perror("epoll_ctl() failed\n");
+    exit(1);
 }
 
-static void fdevent_disconnect(fdevent *fde)
+static void fdevent_connect(fdevent *fde)
 {
-    struct epoll_event ev;
-
-    memset(&ev, 0, sizeof(ev));
-    ev.events = 0;
-    ev.data.ptr = fde;
+        /* nothing is registered until someone asks for an event */
+    fde->armed = 0;
+}
 
-        /* technically we only need to delete if we
-        ** were actively monitoring events, but let's
-        ** be aggressive and do it anyway, just in case
-        ** something's out of sync
-        */
-    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fde->fd, &ev);
+static void fdevent_disconnect(fdevent *fde)
+{
+    if(fde->state & FDE_ALWAYS) {
+        fde->state &= (~FDE_ALWAYS);
+        epoll_always--;
+    }
+    fdevent_arm(fde, 0);
 }
 
 static void fdevent_update(fdevent *fde, unsigned events)
 {
-    struct epoll_event ev;
-    int active;
-
-    active = (fde->state & FDE_EVENTMASK) != 0;
-
-    memset(&ev, 0, sizeof(ev));
-    ev.events = 0;
-    ev.data.ptr = fde;
-
-    if(events & FDE_READ) ev.events |= EPOLLIN;
-    if(events & FDE_WRITE) ev.events |= EPOLLOUT;
-    if(events & FDE_ERROR) ev.events |= (EPOLLERR | EPOLLHUP);
+    unsigned wanted = events & (FDE_READ | FDE_WRITE | FDE_ERROR);
 
     fde->state = (fde->state & FDE_STATEMASK) | events;
 
-    if(active) {
-            /* we're already active. if we're changing to *no*
-            ** events being monitored, we need to delete, otherwise
-            ** we need to just modify
-            */
-        if(ev.events) {
-            if(epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fde->fd, &ev)) {
-                perror("epoll_ctl() failed\n");
-                exit(1);
-            }
-        } else {
-            if(epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fde->fd, &ev)) {
-                perror("epoll_ctl() failed\n");
-                exit(1);
-            }
-        }
-    } else {
-            /* we're not active.  if we're watching events, we need
-            ** to add, otherwise we can just do nothing
-            */
-        if(ev.events) {
-            if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fde->fd, &ev)) {
-                perror("epoll_ctl() failed\n");
-                exit(1);
-            }
-        }
-    }
+        /* already covered by what is armed: no syscall */
+    if((wanted & ~fde->armed) == 0) return;
+
+    fdevent_arm(fde, wanted);
 }
 
 static void fdevent_process()
 {
     struct epoll_event events[256];
     fdevent *fde;
-    int i, n;
+    unsigned wanted, ready;
+    int i, n, timeout;
 
-    n = epoll_wait(epoll_fd, events, 256, -1);
+    timeout = epoll_always ? 0 : fdevent_timer_next();
+    n = epoll_wait(epoll_fd, events, 256, timeout);
 
     if(n < 0) {
         if(errno == EINTR) return;
@@ -218,17 +368,38 @@ static void fdevent_process()
     for(i = 0; i < n; i++) {
         struct epoll_event *ev = events + i;
         fde = ev->data.ptr;
+        wanted = fde->state & (FDE_READ | FDE_WRITE | FDE_ERROR);
 
-        if(ev->events & EPOLLIN) {
-            fde->events |= FDE_READ;
+        ready = 0;
+        if(ev->events & EPOLLIN) ready |= FDE_READ;
+        if(ev->events & EPOLLOUT) ready |= FDE_WRITE;
+        if(ev->events & (EPOLLERR | EPOLLHUP)) {
+                /* select() reports these as readable/writable, and the
+                ** callbacks find out about them from read()/write() */
+            ready |= FDE_ERROR | (wanted & (FDE_READ | FDE_WRITE));
         }
-        if(ev->events & EPOLLOUT) {
-            fde->events |= FDE_WRITE;
+
+        if(fde->armed & ~wanted) {
+                /* lazily dropped interest just fired; drop it for real */
+            fdevent_arm(fde, wanted);
         }
-        if(ev->events & (EPOLLERR | EPOLLHUP)) {
-            fde->events |= FDE_ERROR;
+
+        ready &= wanted;
+        if(ready) {
+            fde->events |= ready;
+            if(fde->state & FDE_PENDING) continue;
+            fde->state |= FDE_PENDING;
+            fdevent_plist_enqueue(fde);
         }
-        if(fde->events) {
+    }
+
+    for(i = 0; epoll_always && i < fd_table_max; i++) {
+        fde = fd_table[i];
+        if(fde == 0 || !(fde->state & FDE_ALWAYS)) continue;
+
+        ready = fde->state & (FDE_READ | FDE_WRITE);
+        if(ready) {
+            fde->events |= ready;
             if(fde->state & FDE_PENDING) continue;
             fde->state |= FDE_PENDING;
             fdevent_plist_enqueue(fde);
@@ -368,6 +539,14 @@ static void fdevent_process()
     fdevent *fde;
     unsigned events;
     fd_set rfd, wfd, efd;
+    struct timeval tv, *ptv = NULL;
+    int timeout = fdevent_timer_next();
+
+    if(timeout >= 0) {
+        tv.tv_sec = timeout / 1000;
+        tv.tv_usec = (timeout % 1000) * 1000;
+        ptv = &tv;
+    }
 
     memcpy(&rfd, &read_fds, sizeof(fd_set));
     memcpy(&wfd, &write_fds, sizeof(fd_set));
@@ -375,7 +554,7 @@ static void fdevent_process()
 
     dump_all_fds("pre select()");
 
-    n = select(select_n, &rfd, &wfd, &efd, NULL);
+    n = select(select_n, &rfd, &wfd, &efd, ptv);
     int saved_errno = errno;
     D("select() returned n=%d, errno=%d\n", n, n<0?saved_errno:0);
 
@@ -395,6 +574,10 @@ static void fdevent_process()
             return;
         }
     }
+    if(n == 0 && ptv != NULL) {
+        // A timer is due, not an error.
+        return;
+    }
     if(n <= 0) {
         // We fake a read, as the rest of the code assumes
         // that errors will be detected at that point.
@@ -447,7 +630,7 @@ static void fdevent_register(fdevent *fde)
         if(fd_table == 0) {
             FATAL("could not expand fd_table to %d entries\n", fd_table_max);
         }
-        memset(fd_table + oldmax, 0, sizeof(int) * (fd_table_max - oldmax));
+        memset(fd_table + oldmax, 0, sizeof(fdevent*) * (fd_table_max - oldmax));
     }
 
     fd_table[fde->fd] = fde;
@@ -489,9 +672,8 @@ static void fdevent_plist_remove(fdevent *node)
     node->prev = 0;
 }
 
-static fdevent *fdevent_plist_dequeue(void)
+static fdevent *fdevent_plist_dequeue(fdevent *list)
 {
-    fdevent *list = &list_pending;
     fdevent *node = list->next;
 
     if(node == list) return 0;
@@ -511,6 +693,7 @@ static void fdevent_call_fdfunc(fdevent* fde)
     if(!(fde->state & FDE_PENDING)) return;
     fde->state &= (~FDE_PENDING);
     dump_fde(fde, "callback");
+    stats.callbacks++;
     fde->func(fde->fd, events, fde->arg);
 }
 
@@ -599,6 +782,12 @@ void fdevent_install(fdevent *fde, int fd, fd_func func, void *arg)
     fde->func = func;
     fde->arg = arg;
 
+    if(fd == FD_TIMER) {
+            /* nothing to watch, it only ever sees FDE_TIMEOUT */
+        fde->state = 0;
+        return;
+    }
+
 #ifndef HAVE_WINSOCK
     fcntl(fd, F_SETFL, O_NONBLOCK);
 #endif
@@ -610,6 +799,8 @@ void fdevent_install(fdevent *fde, int fd, fd_func func, void *arg)
 
 void fdevent_remove(fdevent *fde)
 {
+    fdevent_timer_cancel(fde);
+
     if(fde->state & FDE_PENDING) {
         fdevent_plist_remove(fde);
     }
@@ -678,18 +869,44 @@ void fdevent_subproc_setup()
     fdevent_add(fde, FDE_READ);
 }
 
-void fdevent_loop()
+void fdevent_get_stats(fdevent_stats *st)
 {
+    *st = stats;
+}
+
+/* Run everything that is pending, a batch at a time: the list is taken
+** over whole, so whatever the callbacks make ready goes into the next
+** batch instead of being chased one entry at a time.  Callbacks may
+** still remove any fde, batched or not, through fdevent_plist_remove().
+*/
+static void fdevent_drain_pending(void)
+{
+    fdevent batch;
     fdevent *fde;
+
+    while(list_pending.next != &list_pending) {
+        batch.next = list_pending.next;
+        batch.prev = list_pending.prev;
+        batch.next->prev = &batch;
+        batch.prev->next = &batch;
+        list_pending.next = list_pending.prev = &list_pending;
+
+        while((fde = fdevent_plist_dequeue(&batch))) {
+            fdevent_call_fdfunc(fde);
+        }
+    }
+}
+
+void fdevent_loop()
+{
     fdevent_subproc_setup();
 
     for(;;) {
         D("--- ---- waiting for events\n");
 
         fdevent_process();
-
-        while((fde = fdevent_plist_dequeue())) {
-            fdevent_call_fdfunc(fde);
-        }
+        fdevent_timer_expire();
+        fdevent_drain_pending();
+        stats.loops++;
     }
 }
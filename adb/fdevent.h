@@ -28,6 +28,9 @@
 /* features that may be set (via the events set/add/del interface) */
 #define FDE_DONT_CLOSE        0x0080
 
+/* pass as 'fd' to fdevent_create()/fdevent_install() for a timer-only object */
+#define FD_TIMER              (-1)
+
 typedef struct fdevent fdevent;
 
 typedef void (*fd_func)(int fd, unsigned events, void *userdata);
@@ -58,8 +61,24 @@ void fdevent_set(fdevent *fde, unsigned events);
 void fdevent_add(fdevent *fde, unsigned events);
 void fdevent_del(fdevent *fde, unsigned events);
 
+/* Deliver FDE_TIMEOUT to the fde's callback once, timeout_ms from now
+** (rounded up to the timer tick). Re-arming replaces the pending timeout,
+** a negative timeout_ms cancels it. Like the rest of this interface,
+** only call this from the fdevent_loop() thread.
+*/
 void fdevent_set_timeout(fdevent *fde, int64_t  timeout_ms);
 
+/* counters kept by the event loop, for tests and tuning */
+typedef struct fdevent_stats
+{
+    uint64_t loops;         /* trips around fdevent_loop() */
+    uint64_t callbacks;     /* fd_func invocations */
+    uint64_t syscalls;      /* interest changes that reached the kernel */
+    uint64_t timeouts;      /* timers that fired */
+} fdevent_stats;
+
+void fdevent_get_stats(fdevent_stats *stats);
+
 /* loop forever, handling events.
 */
 void fdevent_loop();
@@ -77,6 +96,14 @@ struct fdevent
 
     fd_func func;
     void *arg;
+
+        /* interest currently registered with the kernel (epoll) */
+    unsigned short armed;
+
+        /* timer wheel slot links and expiry tick, see fdevent_set_timeout() */
+    fdevent *tnext;
+    fdevent *tprev;
+    int64_t deadline;
 };
 
 
@@ -30,11 +30,36 @@
 #include "adb.h"
 #include "adb_client.h"
 #include "file_sync_service.h"
+#include "lz4_block.h"
+#include "mincrypt/sha256.h"
 
 
-static unsigned long long total_bytes;
 static long long start_time;
 
+typedef struct syncsendbuf syncsendbuf;
+
+struct syncsendbuf {
+    unsigned id;
+    unsigned size;
+    char data[SYNC_DATA_MAX];
+};
+
+/* per-connection transfer state: the buffers a file moves through and
+** how much went by.  The serial paths all use sync_xfer, whose counters
+** END() reports; parallel workers fold theirs into it when done.
+*/
+typedef struct syncxfer syncxfer;
+
+struct syncxfer {
+    syncsendbuf send;
+    syncsendbuf compress;
+    unsigned long long bytes;
+    unsigned long long wire_bytes;
+    int closed;         /* a copy gave up and closed the connection */
+};
+
+static syncxfer sync_xfer;
+
 static long long NOW()
 {
     struct timeval tv;
@@ -45,13 +70,16 @@ static long long NOW()
 
 static void BEGIN()
 {
-    total_bytes = 0;
+    sync_xfer.bytes = 0;
+    sync_xfer.wire_bytes = 0;
     start_time = NOW();
 }
 
 static void END()
 {
     long long t = NOW() - start_time;
+    unsigned long long total_bytes = sync_xfer.bytes;
+    unsigned long long total_wire_bytes = sync_xfer.wire_bytes;
     if(total_bytes == 0) return;
 
     if (t == 0)  /* prevent division by 0 :-) */
@@ -60,6 +88,94 @@ static void END()
     fprintf(stderr,"%lld KB/s (%lld bytes in %lld.%03llds)\n",
             ((total_bytes * 1000000LL) / t) / 1024LL,
             total_bytes, (t / 1000000LL), (t % 1000000LL) / 1000LL);
+    if (total_wire_bytes != total_bytes) {
+        fprintf(stderr,"%lld bytes sent compressed (%lld%%)\n",
+                total_wire_bytes, (total_wire_bytes * 100LL) / total_bytes);
+    }
+}
+
+/* features agreed with the device's sync service; sync_features_known
+** stays 0 until the first sync_connect() has asked
+*/
+static unsigned sync_features;
+static int sync_features_known;
+
+static unsigned sync_wanted_features(void)
+{
+    const char *compress = getenv("ADB_SYNC_COMPRESS");
+    const char *hash = getenv("ADB_SYNC_HASH");
+    unsigned features = SYNC_FEATURE_LZ4 | SYNC_FEATURE_TREE | SYNC_FEATURE_HASH;
+
+    if (compress && !strcmp(compress, "0"))
+        features &= ~SYNC_FEATURE_LZ4;
+    if (hash && !strcmp(hash, "0"))
+        features &= ~SYNC_FEATURE_HASH;
+    return features;
+}
+
+static int sync_negotiate(int fd, unsigned wanted)
+{
+    syncmsg msg;
+    char list[256];
+    int len;
+
+    len = sync_format_features(wanted, list, sizeof(list));
+    msg.req.id = ID_FEAT;
+    msg.req.namelen = htoll(len);
+    if(writex(fd, &msg.req, sizeof(msg.req)) ||
+       writex(fd, list, len)) {
+        return -1;
+    }
+
+    if(readx(fd, &msg.status, sizeof(msg.status)) ||
+       msg.status.id != ID_FEAT) {
+        return -1;
+    }
+    len = ltohl(msg.status.msglen);
+    if(len >= (int)sizeof(list) || readx(fd, list, len)) {
+        return -1;
+    }
+    list[len] = 0;
+
+    sync_features = sync_parse_features(list) & wanted;
+    return 0;
+}
+
+/* open a sync: connection and agree on optional features.  A service
+** that predates ID_FEAT fails it and hangs up, so we reconnect and
+** remember not to ask again.  Features are per connection, so later
+** connections ask again for whatever the first one got.
+*/
+static int sync_connect(void)
+{
+    unsigned wanted;
+    int fd;
+
+    fd = adb_connect("sync:");
+    if(fd < 0) {
+        return fd;
+    }
+    if(sync_features_known) {
+        if(sync_features == 0) {
+            return fd;
+        }
+        wanted = sync_features;
+        if(sync_negotiate(fd, wanted) == 0 && sync_features == wanted) {
+            return fd;
+        }
+        adb_close(fd);
+        return -1;
+    }
+
+    wanted = sync_wanted_features();
+    sync_features_known = 1;
+    if(wanted == 0 || sync_negotiate(fd, wanted) == 0) {
+        return fd;
+    }
+
+    adb_close(fd);
+    sync_features = 0;
+    return adb_connect("sync:");
 }
 
 void sync_quit(int fd)
@@ -74,16 +190,18 @@ void sync_quit(int fd)
 
 typedef void (*sync_ls_cb)(unsigned mode, unsigned size, unsigned time, const char *name, void *cookie);
 
-int sync_ls(int fd, const char *path, sync_ls_cb func, void *cookie)
+/* ID_LIST or ID_TREE; both answer with ID_DENTs up to an ID_DONE */
+static int sync_list(int fd, unsigned id, const char *path,
+                     sync_ls_cb func, void *cookie)
 {
     syncmsg msg;
-    char buf[257];
+    char buf[SYNC_TREE_NAME_MAX + 1];
     int len;
 
     len = strlen(path);
     if(len > 1024) goto fail;
 
-    msg.req.id = ID_LIST;
+    msg.req.id = id;
     msg.req.namelen = htoll(len);
 
     if(writex(fd, &msg.req, sizeof(msg.req)) ||
@@ -97,7 +215,7 @@ int sync_ls(int fd, const char *path, sync_ls_cb func, void *cookie)
         if(msg.dent.id != ID_DENT) break;
 
         len = ltohl(msg.dent.namelen);
-        if(len > 256) break;
+        if(len > SYNC_TREE_NAME_MAX) break;
 
         if(readx(fd, buf, len)) break;
         buf[len] = 0;
@@ -113,15 +231,47 @@ fail:
     return -1;
 }
 
-typedef struct syncsendbuf syncsendbuf;
+int sync_ls(int fd, const char *path, sync_ls_cb func, void *cookie)
+{
+    return sync_list(fd, ID_LIST, path, func, cookie);
+}
 
-struct syncsendbuf {
-    unsigned id;
-    unsigned size;
-    char data[SYNC_DATA_MAX];
-};
+/* needs SYNC_FEATURE_TREE */
+static int sync_tree(int fd, const char *path, sync_ls_cb func, void *cookie)
+{
+    return sync_list(fd, ID_TREE, path, func, cookie);
+}
+
+
+/* send len bytes already in xfer->send.data as one data message,
+** compressed if that was negotiated and actually makes it smaller
+*/
+static int write_data_chunk(int fd, syncxfer *xfer, int len)
+{
+    syncsendbuf *sbuf = &xfer->send;
+    syncsendbuf *out = sbuf;
+    int z = 0;
+
+    if(sync_features & SYNC_FEATURE_LZ4) {
+        z = lz4_block_compress(sbuf->data, len, xfer->compress.data, len - 1);
+    }
+    if(z > 0) {
+        out = &xfer->compress;
+        out->id = ID_CDAT;
+        out->size = htoll(z);
+    } else {
+        z = len;
+        sbuf->id = ID_DATA;
+        sbuf->size = htoll(len);
+    }
 
-static syncsendbuf send_buffer;
+    if(writex(fd, out, sizeof(unsigned) * 2 + z)) {
+        return -1;
+    }
+    xfer->bytes += len;
+    xfer->wire_bytes += z;
+    return 0;
+}
 
 int sync_readtime(int fd, const char *path, unsigned *timestamp)
 {
@@ -148,20 +298,28 @@ int sync_readtime(int fd, const char *path, unsigned *timestamp)
     return 0;
 }
 
-static int sync_start_readtime(int fd, const char *path)
+/* send a request without waiting for the answer */
+static int sync_request(int fd, unsigned id, const char *path)
 {
-    syncmsg msg;
+    struct {
+        unsigned id;
+        unsigned namelen;
+        char name[1024];
+    } req;
     int len = strlen(path);
 
-    msg.req.id = ID_STAT;
-    msg.req.namelen = htoll(len);
+    if(len > 1024) return -1;
 
-    if(writex(fd, &msg.req, sizeof(msg.req)) ||
-       writex(fd, path, len)) {
-        return -1;
-    }
+    req.id = id;
+    req.namelen = htoll(len);
+    memcpy(req.name, path, len);
 
-    return 0;
+    return writex(fd, &req, sizeof(unsigned) * 2 + len);
+}
+
+static int sync_start_readtime(int fd, const char *path)
+{
+    return sync_request(fd, ID_STAT, path);
 }
 
 static int sync_finish_readtime(int fd, unsigned int *timestamp,
@@ -207,8 +365,9 @@ int sync_readmode(int fd, const char *path, unsigned *mode)
     return 0;
 }
 
-static int write_data_file(int fd, const char *path, syncsendbuf *sbuf)
+static int write_data_file(int fd, const char *path, syncxfer *xfer)
 {
+    syncsendbuf *sbuf = &xfer->send;
     int lfd, err = 0;
 
     lfd = adb_open(path, O_RDONLY);
@@ -217,7 +376,6 @@ static int write_data_file(int fd, const char *path, syncsendbuf *sbuf)
         return -1;
     }
 
-    sbuf->id = ID_DATA;
     for(;;) {
         int ret;
 
@@ -232,24 +390,22 @@ static int write_data_file(int fd, const char *path, syncsendbuf *sbuf)
             break;
         }
 
-        sbuf->size = htoll(ret);
-        if(writex(fd, sbuf, sizeof(unsigned) * 2 + ret)){
+        if(write_data_chunk(fd, xfer, ret)){
             err = -1;
             break;
         }
-        total_bytes += ret;
     }
 
     adb_close(lfd);
     return err;
 }
 
-static int write_data_buffer(int fd, char* file_buffer, int size, syncsendbuf *sbuf)
+static int write_data_buffer(int fd, char* file_buffer, int size, syncxfer *xfer)
 {
+    syncsendbuf *sbuf = &xfer->send;
     int err = 0;
     int total = 0;
 
-    sbuf->id = ID_DATA;
     while (total < size) {
         int count = size - total;
         if (count > SYNC_DATA_MAX) {
@@ -257,21 +413,20 @@ static int write_data_buffer(int fd, char* file_buffer, int size, syncsendbuf *s
         }
 
         memcpy(sbuf->data, &file_buffer[total], count);
-        sbuf->size = htoll(count);
-        if(writex(fd, sbuf, sizeof(unsigned) * 2 + count)){
+        if(write_data_chunk(fd, xfer, count)){
             err = -1;
             break;
         }
         total += count;
-        total_bytes += count;
     }
 
     return err;
 }
 
 #ifdef HAVE_SYMLINKS
-static int write_data_link(int fd, const char *path, syncsendbuf *sbuf)
+static int write_data_link(int fd, const char *path, syncxfer *xfer)
 {
+    syncsendbuf *sbuf = &xfer->send;
     int len, ret;
 
     len = readlink(path, sbuf->data, SYNC_DATA_MAX-1);
@@ -288,18 +443,56 @@ static int write_data_link(int fd, const char *path, syncsendbuf *sbuf)
     if(ret)
         return -1;
 
-    total_bytes += len + 1;
+    xfer->bytes += len + 1;
+    xfer->wire_bytes += len + 1;
 
     return 0;
 }
 #endif
 
-static int sync_send(int fd, const char *lpath, const char *rpath,
+/* finish an ID_SEND or ID_PTCH and collect the verdict */
+static int sync_send_done(int fd, syncxfer *xfer, const char *lpath,
+                          const char *rpath, unsigned mtime)
+{
+    syncmsg msg;
+    syncsendbuf *sbuf = &xfer->send;
+    int len;
+
+    msg.data.id = ID_DONE;
+    msg.data.size = htoll(mtime);
+    if(writex(fd, &msg.data, sizeof(msg.data))) {
+        fprintf(stderr,"protocol failure\n");
+        adb_close(fd);
+        xfer->closed = 1;
+        return -1;
+    }
+
+    if(readx(fd, &msg.status, sizeof(msg.status)))
+        return -1;
+
+    if(msg.status.id != ID_OKAY) {
+        if(msg.status.id == ID_FAIL) {
+            len = ltohl(msg.status.msglen);
+            if(len > 256) len = 256;
+            if(readx(fd, sbuf->data, len)) {
+                return -1;
+            }
+            sbuf->data[len] = 0;
+        } else
+            strcpy(sbuf->data, "unknown reason");
+
+        fprintf(stderr,"failed to copy '%s' to '%s': %s\n", lpath, rpath, sbuf->data);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int sync_send(int fd, syncxfer *xfer, const char *lpath, const char *rpath,
                      unsigned mtime, mode_t mode, int verifyApk)
 {
     syncmsg msg;
     int len, r;
-    syncsendbuf *sbuf = &send_buffer;
     char* file_buffer = NULL;
     int size = 0;
     char tmp[64];
@@ -377,45 +570,23 @@ static int sync_send(int fd, const char *lpath, const char *rpath,
     }
 
     if (file_buffer) {
-        write_data_buffer(fd, file_buffer, size, sbuf);
+        write_data_buffer(fd, file_buffer, size, xfer);
         free(file_buffer);
     } else if (S_ISREG(mode))
-        write_data_file(fd, lpath, sbuf);
+        write_data_file(fd, lpath, xfer);
 #ifdef HAVE_SYMLINKS
     else if (S_ISLNK(mode))
-        write_data_link(fd, lpath, sbuf);
+        write_data_link(fd, lpath, xfer);
 #endif
     else
         goto fail;
 
-    msg.data.id = ID_DONE;
-    msg.data.size = htoll(mtime);
-    if(writex(fd, &msg.data, sizeof(msg.data)))
-        goto fail;
-
-    if(readx(fd, &msg.status, sizeof(msg.status)))
-        return -1;
-
-    if(msg.status.id != ID_OKAY) {
-        if(msg.status.id == ID_FAIL) {
-            len = ltohl(msg.status.msglen);
-            if(len > 256) len = 256;
-            if(readx(fd, sbuf->data, len)) {
-                return -1;
-            }
-            sbuf->data[len] = 0;
-        } else
-            strcpy(sbuf->data, "unknown reason");
-
-        fprintf(stderr,"failed to copy '%s' to '%s': %s\n", lpath, rpath, sbuf->data);
-        return -1;
-    }
-
-    return 0;
+    return sync_send_done(fd, xfer, lpath, rpath, mtime);
 
 fail:
     fprintf(stderr,"protocol failure\n");
     adb_close(fd);
+    xfer->closed = 1;
     return -1;
 }
 
@@ -438,12 +609,12 @@ static int mkdirs(char *name)
     return 0;
 }
 
-int sync_recv(int fd, const char *rpath, const char *lpath)
+int sync_recv(int fd, syncxfer *xfer, const char *rpath, const char *lpath)
 {
     syncmsg msg;
     int len;
     int lfd = -1;
-    char *buffer = send_buffer.data;
+    char *buffer = xfer->send.data;
     unsigned id;
 
     len = strlen(rpath);
@@ -461,7 +632,7 @@ int sync_recv(int fd, const char *rpath, const char *lpath)
     }
     id = msg.data.id;
 
-    if((id == ID_DATA) || (id == ID_DONE)) {
+    if((id == ID_DATA) || (id == ID_CDAT) || (id == ID_DONE)) {
         adb_unlink(lpath);
         mkdirs((char *)lpath);
         lfd = adb_creat(lpath, 0644);
@@ -483,17 +654,28 @@ int sync_recv(int fd, const char *rpath, const char *lpath)
     handle_data:
         len = ltohl(msg.data.size);
         if(id == ID_DONE) break;
-        if(id != ID_DATA) goto remote_error;
+        if(id != ID_DATA && id != ID_CDAT) goto remote_error;
         if(len > SYNC_DATA_MAX) {
             fprintf(stderr,"data overrun\n");
             adb_close(lfd);
             return -1;
         }
 
-        if(readx(fd, buffer, len)) {
+        if(readx(fd, id == ID_CDAT ? xfer->compress.data : buffer, len)) {
             adb_close(lfd);
             return -1;
         }
+        xfer->wire_bytes += len;
+
+        if(id == ID_CDAT) {
+            len = lz4_block_decompress(xfer->compress.data, len,
+                                       buffer, SYNC_DATA_MAX);
+            if(len < 0) {
+                fprintf(stderr,"corrupt compressed data\n");
+                adb_close(lfd);
+                return -1;
+            }
+        }
 
         if(writex(lfd, buffer, len)) {
             fprintf(stderr,"cannot write '%s': %s\n", rpath, strerror(errno));
@@ -501,7 +683,7 @@ int sync_recv(int fd, const char *rpath, const char *lpath)
             return -1;
         }
 
-        total_bytes += len;
+        xfer->bytes += len;
     }
 
     adb_close(lfd);
@@ -540,7 +722,7 @@ static void do_sync_ls_cb(unsigned mode, unsigned size, unsigned time,
 
 int do_sync_ls(const char *path)
 {
-    int fd = adb_connect("sync:");
+    int fd = sync_connect();
     if(fd < 0) {
         fprintf(stderr,"error: %s\n", adb_error());
         return 1;
@@ -564,6 +746,8 @@ struct copyinfo
     unsigned int time;
     unsigned int mode;
     unsigned int size;
+    unsigned int rmode;     /* what is on the device, if we looked */
+    unsigned int rsize;
     int flag;
     //char data[0];
 };
@@ -587,6 +771,8 @@ copyinfo *mkcopyinfo(const char *spath, const char *dpath,
     ci->time = 0;
     ci->mode = 0;
     ci->size = 0;
+    ci->rmode = 0;
+    ci->rsize = 0;
     ci->flag = 0;
     ci->src = (const char*)(ci + 1);
     ci->dst = ci->src + ssize;
@@ -597,6 +783,203 @@ copyinfo *mkcopyinfo(const char *spath, const char *dpath,
     return ci;
 }
 
+/* --- parallel transfers --- */
+
+/* With ADB_SYNC_JOBS=n (n > 1), directory push and pull spread their
+** files over n sync connections on the same transport.  The files are
+** dealt out largest first to one queue per connection; a connection
+** that runs dry steals the smallest remaining file from whichever queue
+** is longest, so one big file does not leave the others idle.
+*/
+#define SYNC_MAX_JOBS 16
+
+ADB_MUTEX_DEFINE( sync_jobs_lock );
+
+typedef int (*sync_copy_func)(int fd, syncxfer *xfer, copyinfo *ci);
+
+typedef struct syncjobs syncjobs;
+
+typedef struct {
+    syncjobs *jobs;
+    int fd;
+    copyinfo **queue;   /* queue[head..tail) are still to do */
+    int head;
+    int tail;
+    int copied;
+    syncxfer xfer;
+} syncworker;
+
+struct syncjobs {
+    syncworker *workers;
+    int count;
+    sync_copy_func copy;
+    int failed;
+    int done_fd;        /* workers write a byte here when they finish */
+};
+
+static int sync_jobs(void)
+{
+    const char *jobs = getenv("ADB_SYNC_JOBS");
+    int n = jobs ? atoi(jobs) : 1;
+
+    if (n < 1) return 1;
+    if (n > SYNC_MAX_JOBS) return SYNC_MAX_JOBS;
+    return n;
+}
+
+static copyinfo *sync_next_job(syncworker *w)
+{
+    syncjobs *jobs = w->jobs;
+    syncworker *victim = w;
+    copyinfo *ci = NULL;
+    int i;
+
+    adb_mutex_lock(&sync_jobs_lock);
+    if (!jobs->failed) {
+        if (w->head == w->tail) {
+            for (i = 0; i < jobs->count; i++) {
+                syncworker *o = &jobs->workers[i];
+                if (o->tail - o->head > victim->tail - victim->head)
+                    victim = o;
+            }
+        }
+        if (victim == w && w->head < w->tail) {
+            ci = w->queue[w->head++];
+        } else if (victim != w) {
+            ci = victim->queue[--victim->tail];
+        }
+    }
+    adb_mutex_unlock(&sync_jobs_lock);
+    return ci;
+}
+
+static void sync_run_worker(syncworker *w)
+{
+    copyinfo *ci;
+
+    while ((ci = sync_next_job(w)) != NULL) {
+        int r = w->jobs->copy(w->fd, &w->xfer, ci);
+        free(ci);
+        if (r) {
+            adb_mutex_lock(&sync_jobs_lock);
+            w->jobs->failed = 1;
+            adb_mutex_unlock(&sync_jobs_lock);
+                /* the connection may be left mid-request, so it is not
+                ** reused; worker 0's belongs to the caller */
+            if (!w->xfer.closed && w != w->jobs->workers)
+                adb_close(w->fd);
+            w->fd = -1;
+            break;
+        }
+        w->copied++;
+    }
+}
+
+static void *sync_worker_thread(void *arg)
+{
+    syncworker *w = arg;
+    char c = 0;
+
+    sync_run_worker(w);
+    if (w->fd >= 0) {
+        sync_quit(w->fd);
+        adb_close(w->fd);
+    }
+    writex(w->jobs->done_fd, &c, 1);
+    return 0;
+}
+
+static int compare_size_desc(const void *a, const void *b)
+{
+    const copyinfo *x = *(const copyinfo **)a;
+    const copyinfo *y = *(const copyinfo **)b;
+
+    if (x->size == y->size) return 0;
+    return (x->size < y->size) ? 1 : -1;
+}
+
+/* Copy the count files in list using up to njobs connections, fd being
+** the first.  Frees every entry.  Returns the number copied, or -1 if a
+** copy failed (the others stop after the file they are on).
+*/
+static int sync_copy_parallel(int fd, copyinfo **list, int count, int njobs,
+                              sync_copy_func copy)
+{
+    syncjobs jobs;
+    adb_thread_t thread;
+    int done[2];
+    int started = 0;
+    int copied = 0;
+    int i;
+    char c;
+
+    if (njobs > count) njobs = count;
+
+    qsort(list, count, sizeof(*list), compare_size_desc);
+
+    memset(&jobs, 0, sizeof(jobs));
+    jobs.copy = copy;
+    jobs.workers = calloc(njobs, sizeof(syncworker));
+    if (jobs.workers == NULL || adb_socketpair(done)) {
+        fprintf(stderr, "out of memory\n");
+        abort();
+    }
+    jobs.done_fd = done[0];
+
+    for (i = 0; i < njobs; i++) {
+        syncworker *w = &jobs.workers[i];
+        int j;
+
+        w->jobs = &jobs;
+        w->queue = malloc(sizeof(copyinfo*) * (count / njobs + 1));
+        if (w->queue == NULL) {
+            fprintf(stderr, "out of memory\n");
+            abort();
+        }
+        for (j = i; j < count; j += njobs)
+            w->queue[w->tail++] = list[j];
+        w->fd = (i == 0) ? fd : sync_connect();
+    }
+    jobs.count = njobs;
+
+        /* a connection we could not open just leaves its queue to be
+        ** stolen by the others
+        */
+    for (i = 1; i < njobs; i++) {
+        syncworker *w = &jobs.workers[i];
+        if (w->fd < 0)
+            continue;
+        if (adb_thread_create(&thread, sync_worker_thread, w)) {
+            sync_quit(w->fd);
+            adb_close(w->fd);
+            w->fd = -1;
+            continue;
+        }
+        started++;
+    }
+
+    sync_run_worker(&jobs.workers[0]);
+
+    for (i = 0; i < started; i++) {
+        readx(done[1], &c, 1);
+    }
+    adb_close(done[0]);
+    adb_close(done[1]);
+
+    for (i = 0; i < njobs; i++) {
+        syncworker *w = &jobs.workers[i];
+        while (w->head < w->tail)
+            free(w->queue[w->head++]);
+        free(w->queue);
+        copied += w->copied;
+        sync_xfer.bytes += w->xfer.bytes;
+        sync_xfer.wire_bytes += w->xfer.wire_bytes;
+    }
+    free(jobs.workers);
+
+    return jobs.failed ? -1 : copied;
+}
+
 
 static int local_build_list(copyinfo **filelist,
                             const char *lpath, const char *rpath)
@@ -624,15 +1007,27 @@ static int local_build_list(copyinfo **filelist,
             if((name[1] == '.') && (name[2] == 0)) continue;
         }
 
-        /*
-         * We could use d_type if HAVE_DIRENT_D_TYPE is defined, but reiserfs
-         * always returns DT_UNKNOWN, so we just use stat() for all cases.
-         */
         if (strlen(lpath) + strlen(de->d_name) + 1 > sizeof(stat_path))
             continue;
         strcpy(stat_path, lpath);
         strcat(stat_path, de->d_name);
-        stat(stat_path, &st);
+
+        /*
+         * Trust d_type for directories and plain files, which saves a
+         * stat() per entry.  Symlinks still need one to find out whether
+         * they point at a directory, and some filesystems (reiserfs) only
+         * ever say DT_UNKNOWN.
+         */
+#if defined(DT_DIR) && defined(DT_REG)
+        if (de->d_type == DT_DIR) {
+            st.st_mode = S_IFDIR;
+        } else if (de->d_type == DT_REG) {
+            st.st_mode = S_IFREG;
+        } else
+#endif
+        if (stat(stat_path, &st)) {
+            st.st_mode = 0;
+        }
 
         if (S_ISDIR(st.st_mode)) {
             ci = mkcopyinfo(lpath, rpath, name, 1);
@@ -671,6 +1066,493 @@ static int local_build_list(copyinfo **filelist,
 }
 
 
+/* flag ci as already on the device if the remote copy looks the same */
+static void check_remote(copyinfo *ci, unsigned timestamp, unsigned mode,
+                         unsigned size)
+{
+    ci->rmode = mode;
+    ci->rsize = size;
+    if(size == ci->size) {
+        /* for links, we cannot update the atime/mtime */
+        if((S_ISREG(ci->mode & mode) && timestamp == ci->time) ||
+            (S_ISLNK(ci->mode & mode) && timestamp >= ci->time))
+            ci->flag = 1;
+    }
+}
+
+/* Keep up to this many ID_STATs in flight.  Sending them all before
+** reading any replies can wedge both ends once the socket buffers fill.
+*/
+#define SYNC_STAT_WINDOW 128
+
+static int check_remote_stat(int fd, copyinfo *filelist)
+{
+    copyinfo *ci = filelist;
+    copyinfo *sent = filelist;
+    int pending = 0;
+
+    while(ci != 0) {
+        unsigned int timestamp, mode, size;
+
+        while(sent != 0 && pending < SYNC_STAT_WINDOW) {
+            if(sync_start_readtime(fd, sent->dst))
+                return -1;
+            sent = sent->next;
+            pending++;
+        }
+        if(sync_finish_readtime(fd, &timestamp, &mode, &size))
+            return -1;
+        pending--;
+        check_remote(ci, timestamp, mode, size);
+        ci = ci->next;
+    }
+    return 0;
+}
+
+typedef struct remotestat remotestat;
+
+struct remotestat
+{
+    unsigned int time;
+    unsigned int mode;
+    unsigned int size;
+    char name[1];
+};
+
+typedef struct {
+    remotestat **list;
+    int count;
+    int max;
+} remotestat_list;
+
+static void remotestat_cb(unsigned mode, unsigned size, unsigned time,
+                          const char *name, void *cookie)
+{
+    remotestat_list *rl = cookie;
+    remotestat *rs;
+
+    if(rl->count == rl->max) {
+        rl->max = rl->max ? rl->max * 2 : 256;
+        rl->list = realloc(rl->list, rl->max * sizeof(remotestat*));
+        if(rl->list == 0) {
+            fprintf(stderr,"out of memory\n");
+            abort();
+        }
+    }
+    rs = malloc(sizeof(remotestat) + strlen(name));
+    if(rs == 0) {
+        fprintf(stderr,"out of memory\n");
+        abort();
+    }
+    rs->time = time;
+    rs->mode = mode;
+    rs->size = size;
+    strcpy(rs->name, name);
+    rl->list[rl->count++] = rs;
+}
+
+static int compare_remotestat(const void *a, const void *b)
+{
+    return strcmp((*(const remotestat **)a)->name,
+                  (*(const remotestat **)b)->name);
+}
+
+static int compare_remotestat_name(const void *key, const void *b)
+{
+    return strcmp(key, (*(const remotestat **)b)->name);
+}
+
+/* one ID_TREE for the whole of rpath (which ends in '/') instead of an
+** ID_STAT per file
+*/
+static int check_remote_tree(int fd, const char *rpath, copyinfo *filelist)
+{
+    remotestat_list rl;
+    copyinfo *ci;
+    size_t rlen = strlen(rpath);
+    int i;
+
+    memset(&rl, 0, sizeof(rl));
+    if(sync_tree(fd, rpath, remotestat_cb, &rl)) {
+        return -1;
+    }
+    qsort(rl.list, rl.count, sizeof(remotestat*), compare_remotestat);
+
+    for(ci = filelist; ci != 0; ci = ci->next) {
+        remotestat **rs = 0;
+        if(rl.count > 0 && strncmp(ci->dst, rpath, rlen) == 0) {
+            rs = bsearch(ci->dst + rlen, rl.list, rl.count,
+                         sizeof(remotestat*), compare_remotestat_name);
+        }
+        if(rs != 0) {
+            check_remote(ci, (*rs)->time, (*rs)->mode, (*rs)->size);
+        }
+    }
+
+    for(i = 0; i < rl.count; i++) {
+        free(rl.list[i]);
+    }
+    free(rl.list);
+    return 0;
+}
+
+static int push_one(int fd, syncxfer *xfer, copyinfo *ci)
+{
+    fprintf(stderr,"push: %s -> %s\n", ci->src, ci->dst);
+    return sync_send(fd, xfer, ci->src, ci->dst, ci->time, ci->mode, 0 /* no verify APK */);
+}
+
+/* --- content hashes ---
+**
+** When the device offers SYNC_FEATURE_HASH, adb sync does not take a
+** changed timestamp at its word for files the device already has.  A
+** second connection asks the device for their content hashes while the
+** first one pushes everything else.  Files whose contents match only
+** get their timestamp fixed; large files that differ only get their
+** changed blocks sent (ID_PTCH).  Blocks are compared at the same
+** offset on both sides, which covers rebuilt files that kept their
+** layout but not data inserted part way through.
+*/
+
+/* below this, a file whose size changed is simply pushed again */
+#define SYNC_DELTA_MIN (4 * SYNC_HASH_BLOCK)
+
+/* ID_HASH requests in flight on the hashing connection */
+#define SYNC_HASH_WINDOW 32
+
+typedef struct {
+    copyinfo *ci;
+    unsigned char *digests;     /* whole file, then each block; or NULL */
+    unsigned size;
+    int nblocks;
+} synchash;
+
+typedef struct {
+    int fd;
+    synchash *list;
+    int count;
+    int done_fd;    /* one byte per entry of list, in order */
+} synchasher;
+
+static int is_hash_candidate(copyinfo *ci)
+{
+    if(!S_ISREG(ci->mode) || !S_ISREG(ci->rmode))
+        return 0;
+    return ci->rsize == ci->size ||
+           (ci->size >= SYNC_DELTA_MIN && ci->rsize >= SYNC_DELTA_MIN);
+}
+
+static int sync_finish_hash(int fd, synchash *h)
+{
+    syncmsg msg;
+    unsigned size;
+    int len;
+
+    h->digests = NULL;
+    h->nblocks = 0;
+
+    if(readx(fd, &msg.status, sizeof(msg.status)) ||
+       msg.status.id != ID_HASH) {
+        return -1;
+    }
+    len = ltohl(msg.status.msglen);
+    if(len == 0)
+        return 0;
+    if(len < 4 + SYNC_HASH_SIZE || (len - 4) % SYNC_HASH_SIZE) {
+        return -1;
+    }
+
+    h->digests = malloc(len - 4);
+    if(h->digests == NULL) {
+        fprintf(stderr,"out of memory\n");
+        abort();
+    }
+    if(readx(fd, &size, 4) || readx(fd, h->digests, len - 4)) {
+        free(h->digests);
+        h->digests = NULL;
+        return -1;
+    }
+    h->size = ltohl(size);
+    h->nblocks = (len - 4) / SYNC_HASH_SIZE - 1;
+    return 0;
+}
+
+/* arg is a synchasher of the thread's own, which it frees.  The thread
+** is detached and the caller frees list as soon as it has read the last
+** byte from done_fd, so nothing shared may be touched after that write.
+*/
+static void *sync_hash_thread(void *arg)
+{
+    synchasher hs = *(synchasher *)arg;
+    int sent = 0, got = 0;
+    char c = 1;
+
+    free(arg);
+
+    while(got < hs.count) {
+        while(sent < hs.count && sent - got < SYNC_HASH_WINDOW) {
+            if(sync_request(hs.fd, ID_HASH, hs.list[sent].ci->dst))
+                goto fail;
+            sent++;
+        }
+        if(sync_finish_hash(hs.fd, &hs.list[got]))
+            goto fail;
+        got++;
+        writex(hs.done_fd, &c, 1);
+    }
+    sync_quit(hs.fd);
+    adb_close(hs.fd);
+    return 0;
+
+fail:
+        /* the files we have no hash for just get pushed */
+    adb_close(hs.fd);
+    c = 0;
+    for(; got < hs.count; got++) {
+        hs.list[got].digests = NULL;
+        writex(hs.done_fd, &c, 1);
+    }
+    return 0;
+}
+
+/* hash lpath the way the service does; returns the block count or -1 */
+static int hash_local_file(const char *lpath, unsigned char **digests,
+                           syncxfer *xfer)
+{
+    char *buffer = xfer->send.data;
+    unsigned char *list = NULL;
+    int lfd, n = 0, max = 0;
+
+    lfd = adb_open(lpath, O_RDONLY);
+    if(lfd < 0) {
+        fprintf(stderr,"cannot open '%s': %s\n", lpath, strerror(errno));
+        return -1;
+    }
+
+    for(;;) {
+        int len = 0;
+
+        while(len < SYNC_HASH_BLOCK) {
+            int r = adb_read(lfd, buffer + len, SYNC_HASH_BLOCK - len);
+            if(r < 0 && errno == EINTR)
+                continue;
+            if(r < 0) {
+                fprintf(stderr,"cannot read '%s': %s\n", lpath, strerror(errno));
+                adb_close(lfd);
+                free(list);
+                return -1;
+            }
+            if(r == 0)
+                break;
+            len += r;
+        }
+        if(len == 0)
+            break;
+
+        if(n + 1 >= max) {
+            max = max ? max * 2 : 64;
+            list = realloc(list, max * SYNC_HASH_SIZE);
+            if(list == NULL) {
+                fprintf(stderr,"out of memory\n");
+                abort();
+            }
+        }
+        SHA256_hash(buffer, len, list + SYNC_HASH_SIZE * (n + 1));
+        n++;
+        if(len < SYNC_HASH_BLOCK)
+            break;
+    }
+    adb_close(lfd);
+
+    if(list == NULL) {
+        list = malloc(SYNC_HASH_SIZE);
+        if(list == NULL) {
+            fprintf(stderr,"out of memory\n");
+            abort();
+        }
+    }
+    SHA256_hash(list + SYNC_HASH_SIZE, SYNC_HASH_SIZE * n, list);
+    *digests = list;
+    return n;
+}
+
+static int write_skip(int fd, unsigned len)
+{
+    syncmsg msg;
+
+    msg.data.id = ID_SKIP;
+    msg.data.size = htoll(len);
+    return writex(fd, &msg.data, sizeof(msg.data));
+}
+
+/* Bring ci up to date given the device's hashes for it.  Returns 1 if
+** the contents were already the same, 0 if data was sent, -1 on error.
+*/
+static int sync_push_hashed(int fd, syncxfer *xfer, synchash *h)
+{
+    copyinfo *ci = h->ci;
+    unsigned char *local;
+    unsigned skip = 0;
+    char name[1024 + 64];
+    int same, n, i, lfd;
+
+        /* the mode goes after the path, as for ID_SEND */
+    snprintf(name, sizeof(name), "%s,%d", ci->dst, ci->mode);
+    if(h->digests == NULL || strlen(name) > 1024)
+        return push_one(fd, xfer, ci);
+
+    n = hash_local_file(ci->src, &local, xfer);
+    if(n < 0)
+        return -1;
+
+    same = (h->size == ci->size &&
+            !memcmp(local, h->digests, SYNC_HASH_SIZE));
+    if(!same && (ci->size < SYNC_DELTA_MIN || h->size < SYNC_DELTA_MIN)) {
+        free(local);
+        return push_one(fd, xfer, ci);
+    }
+
+    if(!same)
+        fprintf(stderr,"push: %s -> %s\n", ci->src, ci->dst);
+
+    lfd = adb_open(ci->src, O_RDONLY);
+    if(lfd < 0) {
+        fprintf(stderr,"cannot open '%s': %s\n", ci->src, strerror(errno));
+        free(local);
+        return -1;
+    }
+
+    if(sync_request(fd, ID_PTCH, name))
+        goto fail;
+
+    for(i = 0; i < n; i++) {
+        unsigned off = (unsigned)i * SYNC_HASH_BLOCK;
+        unsigned blen = ci->size - off;
+        if(blen > SYNC_HASH_BLOCK) blen = SYNC_HASH_BLOCK;
+
+        if(same || (i < h->nblocks &&
+                    !memcmp(local + SYNC_HASH_SIZE * (i + 1),
+                            h->digests + SYNC_HASH_SIZE * (i + 1),
+                            SYNC_HASH_SIZE))) {
+            skip += blen;
+            continue;
+        }
+        if(skip && write_skip(fd, skip))
+            goto fail;
+        skip = 0;
+        if(adb_lseek(lfd, off, SEEK_SET) != (off_t)off ||
+           readx(lfd, xfer->send.data, blen)) {
+            fprintf(stderr,"cannot read '%s': %s\n", ci->src, strerror(errno));
+            goto fail;
+        }
+        if(write_data_chunk(fd, xfer, blen))
+            goto fail;
+    }
+    if(skip && write_skip(fd, skip))
+        goto fail;
+
+    adb_close(lfd);
+    free(local);
+    if(sync_send_done(fd, xfer, ci->src, ci->dst, ci->time))
+        return -1;
+    return same;
+
+fail:
+        /* the service is mid-request, so the connection is no use now */
+    adb_close(lfd);
+    free(local);
+    adb_close(fd);
+    xfer->closed = 1;
+    return -1;
+}
+
+/* Push the plain files, then those in list (all hash candidates) as
+** their hashes come in.  Frees every entry.  Returns how many needed
+** data, or -1; *skipped counts the rest.
+*/
+static int sync_push_candidates(int fd, copyinfo **list, int count,
+                                int *skipped, copyinfo **plain, int nplain)
+{
+    synchasher hs, *ths;
+    synchash *hashes;
+    adb_thread_t thread;
+    int done[2];
+    int pushed = 0;
+    int failed = 0;
+    int i;
+    char c;
+
+    hashes = calloc(count, sizeof(synchash));
+    if(hashes == NULL) {
+        fprintf(stderr,"out of memory\n");
+        abort();
+    }
+    for(i = 0; i < count; i++)
+        hashes[i].ci = list[i];
+
+    hs.fd = sync_connect();
+    hs.list = hashes;
+    hs.count = count;
+    if(hs.fd >= 0 && adb_socketpair(done) == 0) {
+        hs.done_fd = done[0];
+        ths = malloc(sizeof(*ths));
+        if(ths == NULL) {
+            fprintf(stderr,"out of memory\n");
+            abort();
+        }
+        *ths = hs;
+        if(adb_thread_create(&thread, sync_hash_thread, ths)) {
+            free(ths);
+            adb_close(done[0]);
+            adb_close(done[1]);
+            sync_quit(hs.fd);
+            adb_close(hs.fd);
+            hs.fd = -1;
+        }
+    } else if(hs.fd >= 0) {
+        sync_quit(hs.fd);
+        adb_close(hs.fd);
+        hs.fd = -1;
+    }
+
+    if(nplain > 0) {
+        pushed = sync_copy_parallel(fd, plain, nplain, sync_jobs(), push_one);
+        if(pushed < 0) {
+            pushed = 0;
+            failed = 1;
+        }
+    }
+
+    for(i = 0; i < count; i++) {
+        int r;
+
+        if(hs.fd >= 0)
+            readx(done[1], &c, 1);
+        if(failed)
+            continue;
+
+        r = sync_push_hashed(fd, &sync_xfer, &hashes[i]);
+        if(r < 0)
+            failed = 1;
+        else if(r == 1)
+            (*skipped)++;
+        else
+            pushed++;
+    }
+
+    if(hs.fd >= 0) {
+        adb_close(done[0]);
+        adb_close(done[1]);
+    }
+    for(i = 0; i < count; i++) {
+        free(hashes[i].digests);
+        free(list[i]);
+    }
+    free(hashes);
+
+    return failed ? -1 : pushed;
+}
+
 static int copy_local_dir_remote(int fd, const char *lpath, const char *rpath, int checktimestamps, int listonly)
 {
     copyinfo *filelist = 0;
@@ -699,29 +1581,58 @@ static int copy_local_dir_remote(int fd, const char *lpath, const char *rpath, i
     }
 
     if(checktimestamps){
-        for(ci = filelist; ci != 0; ci = ci->next) {
-            if(sync_start_readtime(fd, ci->dst)) {
+        if(sync_features & SYNC_FEATURE_TREE) {
+            if(check_remote_tree(fd, rpath, filelist))
                 return 1;
-            }
+        } else if(check_remote_stat(fd, filelist)) {
+            return 1;
         }
-        for(ci = filelist; ci != 0; ci = ci->next) {
-            unsigned int timestamp, mode, size;
-            if(sync_finish_readtime(fd, &timestamp, &mode, &size))
-                return 1;
-            if(size == ci->size) {
-                /* for links, we cannot update the atime/mtime */
-                if((S_ISREG(ci->mode & mode) && timestamp == ci->time) ||
-                    (S_ISLNK(ci->mode & mode) && timestamp >= ci->time))
-                    ci->flag = 1;
+    }
+    if(!listonly && (sync_jobs() > 1 ||
+                     (checktimestamps && (sync_features & SYNC_FEATURE_HASH)))) {
+        copyinfo **list, **hashed;
+        int count = 0, nhashed = 0;
+
+        for(ci = filelist; ci != 0; ci = ci->next) count++;
+        list = malloc(sizeof(copyinfo*) * (count + 1));
+        hashed = malloc(sizeof(copyinfo*) * (count + 1));
+        if(list == 0 || hashed == 0) return -1;
+        count = 0;
+        for(ci = filelist; ci != 0; ci = next) {
+            next = ci->next;
+            if(ci->flag != 0) {
+                skipped++;
+                free(ci);
+            } else if(checktimestamps && (sync_features & SYNC_FEATURE_HASH) &&
+                      is_hash_candidate(ci)) {
+                hashed[nhashed++] = ci;
+            } else {
+                list[count++] = ci;
             }
         }
+        filelist = 0;
+
+            /* the device hashes these while we push the rest */
+        if(nhashed > 0) {
+            int r = sync_push_candidates(fd, hashed, nhashed, &skipped,
+                                         list, count);
+            free(list);
+            free(hashed);
+            if(r < 0) return 1;
+            pushed = r;
+        } else {
+            pushed = (count > 0) ? sync_copy_parallel(fd, list, count, sync_jobs(), push_one) : 0;
+            free(list);
+            free(hashed);
+            if(pushed < 0) return 1;
+        }
     }
     for(ci = filelist; ci != 0; ci = next) {
         next = ci->next;
         if(ci->flag == 0) {
             fprintf(stderr,"%spush: %s -> %s\n", listonly ? "would " : "", ci->src, ci->dst);
             if(!listonly &&
-               sync_send(fd, ci->src, ci->dst, ci->time, ci->mode, 0 /* no verify APK */)){
+               sync_send(fd, &sync_xfer, ci->src, ci->dst, ci->time, ci->mode, 0 /* no verify APK */)){
                 return 1;
             }
             pushed++;
@@ -745,7 +1656,7 @@ int do_sync_push(const char *lpath, const char *rpath, int verifyApk)
     unsigned mode;
     int fd;
 
-    fd = adb_connect("sync:");
+    fd = sync_connect();
     if(fd < 0) {
         fprintf(stderr,"error: %s\n", adb_error());
         return 1;
@@ -786,7 +1697,7 @@ int do_sync_push(const char *lpath, const char *rpath, int verifyApk)
             rpath = tmp;
         }
         BEGIN();
-        if(sync_send(fd, lpath, rpath, st.st_mtime, st.st_mode, verifyApk)) {
+        if(sync_send(fd, &sync_xfer, lpath, rpath, st.st_mtime, st.st_mode, verifyApk)) {
             return 1;
         } else {
             END();
@@ -801,7 +1712,7 @@ int do_sync_push(const char *lpath, const char *rpath, int verifyApk)
 
 typedef struct {
     copyinfo **filelist;
-    copyinfo **dirlist;
+    copyinfo **dirlist;     /* NULL when the listing is already recursive */
     const char *rpath;
     const char *lpath;
 } sync_ls_build_list_cb_args;
@@ -816,6 +1727,8 @@ sync_ls_build_list_cb(unsigned mode, unsigned size, unsigned time,
     if (S_ISDIR(mode)) {
         copyinfo **dirlist = args->dirlist;
 
+        if (dirlist == NULL) return;
+
         /* Don't try recursing down "." or ".." */
         if (name[0] == '.') {
             if (name[1] == '\0') return;
@@ -850,6 +1763,12 @@ static int remote_build_list(int syncfd, copyinfo **filelist,
     args.rpath = rpath;
     args.lpath = lpath;
 
+    /* One request lists the whole tree if the service can. */
+    if (sync_features & SYNC_FEATURE_TREE) {
+        args.dirlist = NULL;
+        return sync_tree(syncfd, rpath, sync_ls_build_list_cb, (void *)&args) ? 1 : 0;
+    }
+
     /* Put the files/dirs in rpath on the lists. */
     if (sync_ls(syncfd, rpath, sync_ls_build_list_cb, (void *)&args)) {
         return 1;
@@ -868,6 +1787,12 @@ static int remote_build_list(int syncfd, copyinfo **filelist,
     return 0;
 }
 
+static int pull_one(int fd, syncxfer *xfer, copyinfo *ci)
+{
+    fprintf(stderr, "pull: %s -> %s\n", ci->src, ci->dst);
+    return sync_recv(fd, xfer, ci->src, ci->dst);
+}
+
 static int copy_remote_dir_local(int fd, const char *rpath, const char *lpath,
                                  int checktimestamps)
 {
@@ -919,11 +1844,33 @@ static int copy_remote_dir_local(int fd, const char *rpath, const char *lpath,
         }
     }
 #endif
+    if (sync_jobs() > 1) {
+        copyinfo **list;
+        int count = 0;
+
+        for (ci = filelist; ci != 0; ci = ci->next) count++;
+        list = malloc(sizeof(copyinfo*) * (count + 1));
+        if (list == 0) return -1;
+        count = 0;
+        for (ci = filelist; ci != 0; ci = next) {
+            next = ci->next;
+            if (ci->flag == 0) {
+                list[count++] = ci;
+            } else {
+                skipped++;
+                free(ci);
+            }
+        }
+        pulled = (count > 0) ? sync_copy_parallel(fd, list, count, sync_jobs(), pull_one) : 0;
+        free(list);
+        if (pulled < 0) return 1;
+        filelist = 0;
+    }
     for (ci = filelist; ci != 0; ci = next) {
         next = ci->next;
         if (ci->flag == 0) {
             fprintf(stderr, "pull: %s -> %s\n", ci->src, ci->dst);
-            if (sync_recv(fd, ci->src, ci->dst)) {
+            if (sync_recv(fd, &sync_xfer, ci->src, ci->dst)) {
                 return 1;
             }
             pulled++;
@@ -947,7 +1894,7 @@ int do_sync_pull(const char *rpath, const char *lpath)
 
     int fd;
 
-    fd = adb_connect("sync:");
+    fd = sync_connect();
     if(fd < 0) {
         fprintf(stderr,"error: %s\n", adb_error());
         return 1;
@@ -981,7 +1928,7 @@ int do_sync_pull(const char *rpath, const char *lpath)
             }
         }
         BEGIN();
-        if(sync_recv(fd, rpath, lpath)) {
+        if(sync_recv(fd, &sync_xfer, rpath, lpath)) {
             return 1;
         } else {
             END();
@@ -1007,7 +1954,7 @@ int do_sync_sync(const char *lpath, const char *rpath, int listonly)
 {
     fprintf(stderr,"syncing %s...\n",rpath);
 
-    int fd = adb_connect("sync:");
+    int fd = sync_connect();
     if(fd < 0) {
         fprintf(stderr,"error: %s\n", adb_error());
         return 1;
@@ -27,9 +27,16 @@
 
 #include "sysdeps.h"
 
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#define HAVE_SENDFILE 1
+#endif
+
 #define TRACE_TAG  TRACE_SYNC
 #include "adb.h"
 #include "file_sync_service.h"
+#include "lz4_block.h"
+#include "mincrypt/sha256.h"
 
 static int mkdirs(char *name)
 {
@@ -126,6 +133,75 @@ done:
     return writex(s, &msg.dent, sizeof(msg.dent));
 }
 
+/* path holds the directory being listed, len long; the names sent
+** start rootlen + 1 bytes in
+*/
+static int tree_walk(int s, char *path, int len, int rootlen)
+{
+    DIR *d;
+    struct dirent *de;
+    struct stat st;
+    syncmsg msg;
+
+    d = opendir(len ? path : "/");
+    if(d == 0) return 0;
+
+    msg.dent.id = ID_DENT;
+    path[len] = '/';
+
+    while((de = readdir(d))) {
+        char *name = de->d_name;
+        int nlen = strlen(name);
+        int end = len + 1 + nlen;
+
+        if(name[0] == '.') {
+            if(name[1] == 0) continue;
+            if((name[1] == '.') && (name[2] == 0)) continue;
+        }
+        if(end - (rootlen + 1) > SYNC_TREE_NAME_MAX) continue;
+
+        memcpy(path + len + 1, name, nlen + 1);
+        if(lstat(path, &st)) continue;
+
+        msg.dent.mode = htoll(st.st_mode);
+        msg.dent.size = htoll(st.st_size);
+        msg.dent.time = htoll(st.st_mtime);
+        msg.dent.namelen = htoll(end - (rootlen + 1));
+
+        if(writex(s, &msg.dent, sizeof(msg.dent)) ||
+           writex(s, path + rootlen + 1, end - (rootlen + 1)) ||
+           (S_ISDIR(st.st_mode) && tree_walk(s, path, end, rootlen))) {
+            closedir(d);
+            return -1;
+        }
+    }
+
+    closedir(d);
+    path[len] = 0;
+    return 0;
+}
+
+static int do_tree(int s, const char *path)
+{
+    syncmsg msg;
+    char tmp[1024 + 1 + SYNC_TREE_NAME_MAX + 1];
+    int len;
+
+    len = strlen(path);
+    while(len > 0 && path[len - 1] == '/') len--;
+    memcpy(tmp, path, len);
+    tmp[len] = 0;
+
+    if(tree_walk(s, tmp, len, len)) return -1;
+
+    msg.dent.id = ID_DONE;
+    msg.dent.mode = 0;
+    msg.dent.size = 0;
+    msg.dent.time = 0;
+    msg.dent.namelen = 0;
+    return writex(s, &msg.dent, sizeof(msg.dent));
+}
+
 static int fail_message(int s, const char *reason)
 {
     syncmsg msg;
@@ -148,7 +224,61 @@ static int fail_errno(int s)
     return fail_message(s, strerror(errno));
 }
 
-static int handle_send_file(int s, char *path, mode_t mode, char *buffer)
+/* accept whichever of the requested features we support */
+static int do_feat(int s, const char *list, unsigned *features)
+{
+    syncmsg msg;
+    char accepted[256];
+    int len;
+
+    *features = sync_parse_features(list);
+    len = sync_format_features(*features, accepted, sizeof(accepted));
+    D("sync: features '%s' -> '%s'\n", list, accepted);
+
+    msg.status.id = ID_FEAT;
+    msg.status.msglen = htoll(len);
+    if(writex(s, &msg.status, sizeof(msg.status)) ||
+       writex(s, accepted, len)) {
+        return -1;
+    }
+    return 0;
+}
+
+/* Cuts the ",mode" an ID_SEND or ID_PTCH path ends with off it.  Returns
+** the permissions a regular file should get, with the user bits copied
+** to "group" and "other", or 0644 if there is no valid mode.
+*/
+static mode_t split_send_mode(char *path, int *is_link)
+{
+    char *tmp;
+    mode_t mode;
+
+    tmp = strrchr(path,',');
+    if(tmp) {
+        *tmp = 0;
+        errno = 0;
+        mode = strtoul(tmp + 1, NULL, 0);
+#ifndef HAVE_SYMLINKS
+        *is_link = 0;
+#else
+        *is_link = S_ISLNK(mode);
+#endif
+        mode &= 0777;
+    }
+    if(!tmp || errno) {
+        mode = 0644;
+        *is_link = 0;
+    }
+
+    /* copy user permission bits to "group" and "other" permissions */
+    mode |= ((mode >> 3) & 0070);
+    mode |= ((mode >> 3) & 0007);
+    return mode;
+}
+
+/* zbuffer is non-NULL when the client negotiated SYNC_FEATURE_LZ4 */
+static int handle_send_file(int s, char *path, mode_t mode, char *buffer,
+                            char *zbuffer)
 {
     syncmsg msg;
     unsigned int timestamp = 0;
@@ -174,7 +304,8 @@ static int handle_send_file(int s, char *path, mode_t mode, char *buffer)
         if(readx(s, &msg.data, sizeof(msg.data)))
             goto fail;
 
-        if(msg.data.id != ID_DATA) {
+        if(msg.data.id != ID_DATA &&
+           !(msg.data.id == ID_CDAT && zbuffer)) {
             if(msg.data.id == ID_DONE) {
                 timestamp = ltohl(msg.data.size);
                 break;
@@ -187,7 +318,17 @@ static int handle_send_file(int s, char *path, mode_t mode, char *buffer)
             fail_message(s, "oversize data message");
             goto fail;
         }
-        if(readx(s, buffer, len))
+        if(msg.data.id == ID_CDAT) {
+            int r;
+            if(readx(s, zbuffer, len))
+                goto fail;
+            r = lz4_block_decompress(zbuffer, len, buffer, SYNC_DATA_MAX);
+            if(r < 0) {
+                fail_message(s, "corrupt compressed data message");
+                goto fail;
+            }
+            len = r;
+        } else if(readx(s, buffer, len))
             goto fail;
 
         if(fd < 0)
@@ -273,28 +414,461 @@ static int handle_send_link(int s, char *path, char *buffer)
 }
 #endif /* HAVE_SYMLINKS */
 
-static int do_send(int s, char *path, char *buffer)
+/* State of an ID_PTCH: the patched file is built in a temporary file next
+** to the target, copying the skipped ranges from the target, and renamed
+** over it once complete.  The target itself is never written, so files
+** that are read-only, being executed or mapped by someone are replaced
+** the way ID_SEND replaces them, and a failure leaves them as they were.
+*/
+typedef struct {
+    char *path;
+    char tmp[1024 + 16];
+    int src;            /* the current file, or -1 */
+    int fd;             /* the temporary file, or -1 until data arrives */
+    off_t size;         /* of the current file */
+    unsigned offset;    /* bytes of the new file so far */
+    unsigned copied;    /* of those, how many are in the temporary file */
+} patchstate;
+
+static void patch_abort(patchstate *ps)
 {
-    char *tmp;
+    int saved_errno = errno;
+
+    if(ps->fd >= 0) {
+        adb_close(ps->fd);
+        adb_unlink(ps->tmp);
+        ps->fd = -1;
+    }
+    if(ps->src >= 0) {
+        adb_close(ps->src);
+        ps->src = -1;
+    }
+    errno = saved_errno;
+}
+
+/* bring the temporary file up to ps->offset, creating it if need be */
+static int patch_catch_up(patchstate *ps, char *buffer)
+{
+    if(ps->fd < 0) {
+        snprintf(ps->tmp, sizeof(ps->tmp), "%s.adbpatch.XXXXXX", ps->path);
+        ps->fd = mkstemp(ps->tmp);
+        if(ps->fd < 0)
+            return -1;
+    }
+
+    while(ps->copied < ps->offset) {
+        unsigned len = ps->offset - ps->copied;
+        int r;
+
+        if(len > SYNC_DATA_MAX) len = SYNC_DATA_MAX;
+        r = pread(ps->src, buffer, len, ps->copied);
+        if(r < 0 && errno == EINTR)
+            continue;
+        if(r <= 0) {
+            if(r == 0) errno = EIO;
+            return -1;
+        }
+        if(writex(ps->fd, buffer, r))
+            return -1;
+        ps->copied += r;
+    }
+    return 0;
+}
+
+/* zbuffer is non-NULL when the client negotiated SYNC_FEATURE_LZ4 */
+static int do_patch(int s, char *path, char *buffer, char *zbuffer)
+{
+    syncmsg msg;
+    struct stat st;
+    patchstate ps;
+    unsigned int timestamp = 0;
     mode_t mode;
-    int is_link, ret;
+    int is_link;
+
+    mode = split_send_mode(path, &is_link);
+
+    ps.path = path;
+    ps.fd = -1;
+    ps.offset = 0;
+    ps.copied = 0;
+    ps.src = adb_open(path, O_RDONLY);
+    if(ps.src >= 0 && (fstat(ps.src, &st) || !S_ISREG(st.st_mode) || is_link)) {
+        adb_close(ps.src);
+        ps.src = -1;
+        errno = EINVAL;
+    }
+    if(ps.src < 0) {
+        if(fail_errno(s))
+            return -1;
+    } else {
+        ps.size = st.st_size;
+    }
 
-    tmp = strrchr(path,',');
-    if(tmp) {
-        *tmp = 0;
-        errno = 0;
-        mode = strtoul(tmp + 1, NULL, 0);
-#ifndef HAVE_SYMLINKS
-        is_link = 0;
-#else
-        is_link = S_ISLNK(mode);
-#endif
-        mode &= 0777;
+    for(;;) {
+        unsigned int len;
+
+        if(readx(s, &msg.data, sizeof(msg.data)))
+            goto fail;
+
+        len = ltohl(msg.data.size);
+        if(msg.data.id == ID_DONE) {
+            timestamp = len;
+            break;
+        }
+        if(msg.data.id == ID_SKIP) {
+            if(ps.src < 0)
+                continue;
+            if(ps.offset + len < ps.offset || ps.offset + len > ps.size) {
+                fail_message(s, "skip past end of file");
+                goto fail;
+            }
+            ps.offset += len;
+            continue;
+        }
+        if(msg.data.id != ID_DATA &&
+           !(msg.data.id == ID_CDAT && zbuffer)) {
+            fail_message(s, "invalid data message");
+            goto fail;
+        }
+        if(len > SYNC_DATA_MAX) {
+            fail_message(s, "oversize data message");
+            goto fail;
+        }
+            /* before buffer is needed for the data */
+        if(ps.src >= 0 && patch_catch_up(&ps, buffer)) {
+            patch_abort(&ps);
+            if(fail_errno(s)) return -1;
+        }
+        if(msg.data.id == ID_CDAT) {
+            int r;
+            if(readx(s, zbuffer, len))
+                goto fail;
+            r = lz4_block_decompress(zbuffer, len, buffer, SYNC_DATA_MAX);
+            if(r < 0) {
+                fail_message(s, "corrupt compressed data message");
+                goto fail;
+            }
+            len = r;
+        } else if(readx(s, buffer, len))
+            goto fail;
+
+        if(ps.src < 0)
+            continue;
+        if(writex(ps.fd, buffer, len)) {
+            patch_abort(&ps);
+            if(fail_errno(s)) return -1;
+            continue;
+        }
+        ps.offset += len;
+        ps.copied = ps.offset;
     }
-    if(!tmp || errno) {
-        mode = 0644;
-        is_link = 0;
+
+    if(ps.src < 0)
+        return 0;
+
+    if(ps.fd < 0 && ps.offset == ps.size) {
+            /* nothing changed: only the metadata needs fixing */
+        adb_close(ps.src);
+        chmod(path, mode);
+    } else {
+        if(patch_catch_up(&ps, buffer) || fchmod(ps.fd, mode)) {
+            patch_abort(&ps);
+            return fail_errno(s);
+        }
+        adb_close(ps.src);
+        ps.src = -1;
+        if(adb_close(ps.fd)) {
+            ps.fd = -1;
+            adb_unlink(ps.tmp);
+            return fail_errno(s);
+        }
+        ps.fd = -1;
+        if(rename(ps.tmp, path)) {
+            int saved_errno = errno;
+            adb_unlink(ps.tmp);
+            errno = saved_errno;
+            return fail_errno(s);
+        }
+    }
+
+    {
+        struct utimbuf u;
+        u.actime = timestamp;
+        u.modtime = timestamp;
+        utime(path, &u);
+    }
+
+    msg.status.id = ID_OKAY;
+    msg.status.msglen = 0;
+    if(writex(s, &msg.status, sizeof(msg.status)))
+        return -1;
+    return 0;
+
+fail:
+    patch_abort(&ps);
+    return -1;
+}
+
+/* --- content hashing ---
+**
+** ID_HASH requests are handed to a small pool of threads so that the
+** device reads and hashes several files at once, and keeps going while
+** the client is busy with the answers it already has.  The answers go
+** out in request order: whichever thread finishes the oldest request
+** writes it and any finished ones behind it.  Other requests wait until
+** every hash has been answered, so the two never interleave.
+*/
+#define SYNC_HASH_THREADS 4
+#define SYNC_HASH_QUEUE   64
+
+typedef struct hashjob hashjob;
+
+struct hashjob {
+    hashjob *next;
+    char *reply;    /* status header plus body, once done */
+    int len;
+    int done;
+    char path[1];
+};
+
+typedef struct {
+    adb_mutex_t lock;
+    adb_cond_t cond;
+    hashjob *head;      /* oldest unanswered request */
+    hashjob *tail;
+    hashjob *todo;      /* oldest one no thread has picked up */
+    int pending;        /* requests not yet answered */
+    int writing;        /* a thread is writing answers */
+    int threads;        /* threads still running */
+    int stop;
+    int failed;
+    int fd;
+} hashpool;
+
+static int read_block(int fd, char *buffer, int len)
+{
+    int n = 0;
+
+    while(n < len) {
+        int r = adb_read(fd, buffer + n, len - n);
+        if(r < 0 && errno == EINTR)
+            continue;
+        if(r <= 0)
+            break;
+        n += r;
+    }
+    return n;
+}
+
+static void hash_file(hashjob *job, char *buffer)
+{
+    struct stat st;
+    unsigned nblocks, i;
+    unsigned size = 0;
+    unsigned char *digests;
+    int fd, len = 0;
+
+    job->reply = NULL;
+    fd = adb_open(job->path, O_RDONLY);
+    if(fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+       st.st_size == (off_t)(unsigned)st.st_size) {
+        nblocks = ((unsigned)st.st_size + SYNC_HASH_BLOCK - 1) / SYNC_HASH_BLOCK;
+        len = 4 + SYNC_HASH_SIZE * (1 + nblocks);
+        job->reply = malloc(sizeof(unsigned) * 2 + len);
+    }
+    if(job->reply == NULL) {
+        job->reply = malloc(sizeof(unsigned) * 2);
+        len = 0;
+    }
+    if(job->reply == NULL) {
+        if(fd >= 0) adb_close(fd);
+        job->len = -1;
+        return;
+    }
+
+    if(len > 0) {
+        digests = (unsigned char*) job->reply + sizeof(unsigned) * 3;
+            /* hash what is there if the file shrank meanwhile */
+        for(i = 0; i < nblocks; i++) {
+            int r = read_block(fd, buffer, SYNC_HASH_BLOCK);
+            if(r <= 0)
+                break;
+            SHA256_hash(buffer, r, digests + SYNC_HASH_SIZE * (1 + i));
+            size += r;
+            if(r < SYNC_HASH_BLOCK) {
+                i++;
+                break;
+            }
+        }
+        SHA256_hash(digests + SYNC_HASH_SIZE, SYNC_HASH_SIZE * i, digests);
+        len = 4 + SYNC_HASH_SIZE * (1 + i);
+        ((unsigned*) job->reply)[2] = htoll(size);
+    }
+    if(fd >= 0) adb_close(fd);
+
+    ((unsigned*) job->reply)[0] = ID_HASH;
+    ((unsigned*) job->reply)[1] = htoll(len);
+    job->len = sizeof(unsigned) * 2 + len;
+}
+
+/* called with the lock held */
+static void hashpool_write_locked(hashpool *pool)
+{
+    while(!pool->writing && pool->head && pool->head->done) {
+        hashjob *job = pool->head;
+        int failed = pool->failed;
+
+        pool->writing = 1;
+        adb_mutex_unlock(&pool->lock);
+        if(job->len < 0 ||
+           (!failed && writex(pool->fd, job->reply, job->len))) {
+            failed = 1;
+        }
+        free(job->reply);
+        adb_mutex_lock(&pool->lock);
+
+        pool->failed = failed;
+
+        pool->head = job->next;
+        if(pool->head == NULL) pool->tail = NULL;
+        pool->pending--;
+        pool->writing = 0;
+        free(job);
+        adb_cond_broadcast(&pool->cond);
+    }
+}
+
+static void *hashpool_thread(void *arg)
+{
+    hashpool *pool = arg;
+    char *buffer = malloc(SYNC_HASH_BLOCK);
+
+    adb_mutex_lock(&pool->lock);
+    for(;;) {
+        hashjob *job;
+
+        while(!pool->stop && pool->todo == NULL)
+            adb_cond_wait(&pool->cond, &pool->lock);
+        if(pool->todo == NULL)
+            break;
+
+        job = pool->todo;
+        pool->todo = job->next;
+        adb_mutex_unlock(&pool->lock);
+
+        if(buffer) {
+            hash_file(job, buffer);
+        } else {
+            job->reply = NULL;
+            job->len = -1;
+        }
+
+        adb_mutex_lock(&pool->lock);
+        job->done = 1;
+        hashpool_write_locked(pool);
+    }
+    pool->threads--;
+    adb_cond_broadcast(&pool->cond);
+    adb_mutex_unlock(&pool->lock);
+
+    free(buffer);
+    return 0;
+}
+
+static hashpool *hashpool_create(int fd)
+{
+    hashpool *pool = calloc(1, sizeof(hashpool));
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int i;
+
+    if(pool == NULL) return NULL;
+    adb_mutex_init(&pool->lock, NULL);
+    adb_cond_init(&pool->cond, NULL);
+    pool->fd = fd;
+
+    if(ncpu < 1) ncpu = 1;
+    if(ncpu > SYNC_HASH_THREADS) ncpu = SYNC_HASH_THREADS;
+    for(i = 0; i < ncpu; i++) {
+        adb_thread_t tid;
+        adb_mutex_lock(&pool->lock);
+        pool->threads++;
+        adb_mutex_unlock(&pool->lock);
+        if(adb_thread_create(&tid, hashpool_thread, pool)) {
+            adb_mutex_lock(&pool->lock);
+            pool->threads--;
+            adb_mutex_unlock(&pool->lock);
+            break;
+        }
+    }
+    if(pool->threads == 0) {
+        adb_cond_destroy(&pool->cond);
+        adb_mutex_destroy(&pool->lock);
+        free(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+static int hashpool_submit(hashpool *pool, const char *path)
+{
+    hashjob *job = calloc(1, sizeof(hashjob) + strlen(path));
+
+    if(job == NULL) return -1;
+    strcpy(job->path, path);
+
+    adb_mutex_lock(&pool->lock);
+    while(pool->pending >= SYNC_HASH_QUEUE && !pool->failed)
+        adb_cond_wait(&pool->cond, &pool->lock);
+    if(pool->failed) {
+        adb_mutex_unlock(&pool->lock);
+        free(job);
+        return -1;
     }
+    if(pool->tail) pool->tail->next = job;
+    else pool->head = job;
+    pool->tail = job;
+    if(pool->todo == NULL) pool->todo = job;
+    pool->pending++;
+    adb_cond_broadcast(&pool->cond);
+    adb_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+/* wait until every hash asked for has been answered */
+static int hashpool_drain(hashpool *pool)
+{
+    int failed;
+
+    adb_mutex_lock(&pool->lock);
+    while(pool->pending > 0)
+        adb_cond_wait(&pool->cond, &pool->lock);
+    failed = pool->failed;
+    adb_mutex_unlock(&pool->lock);
+    return failed ? -1 : 0;
+}
+
+static void hashpool_destroy(hashpool *pool)
+{
+    hashpool_drain(pool);
+
+    adb_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    adb_cond_broadcast(&pool->cond);
+    while(pool->threads > 0)
+        adb_cond_wait(&pool->cond, &pool->lock);
+    adb_mutex_unlock(&pool->lock);
+
+    adb_cond_destroy(&pool->cond);
+    adb_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+static int do_send(int s, char *path, char *buffer, char *zbuffer)
+{
+    mode_t mode;
+    int is_link, ret;
+
+    mode = split_send_mode(path, &is_link);
 
     adb_unlink(path);
 
@@ -306,29 +880,114 @@ static int do_send(int s, char *path, char *buffer)
 #else
     {
 #endif
-        /* copy user permission bits to "group" and "other" permissions */
-        mode |= ((mode >> 3) & 0070);
-        mode |= ((mode >> 3) & 0007);
-
-        ret = handle_send_file(s, path, mode, buffer);
+        ret = handle_send_file(s, path, mode, buffer, zbuffer);
     }
 
     return ret;
 }
 
-static int do_recv(int s, const char *path, char *buffer)
+#if HAVE_SENDFILE
+/* after this many chunks in a row that LZ4 could not shrink, stop
+** trying and let the kernel move the rest of the file
+*/
+#define SYNC_RECV_INCOMPRESSIBLE 4
+
+/* set once sendfile() turns out not to work into our socket */
+static int sendfile_broken;
+
+/* Send the next len bytes of fd as one ID_DATA, letting the kernel copy
+** them from the page cache into the socket.  Returns 1 if the file came
+** up short; the chunk is padded out to keep the stream in step.
+*/
+static int send_file_data(int s, int fd, unsigned len, char *buffer)
 {
     syncmsg msg;
-    int fd, r;
+    int short_read = 0;
+
+    msg.data.id = ID_DATA;
+    msg.data.size = htoll(len);
+    if(writex(s, &msg.data, sizeof(msg.data)))
+        return -1;
+
+    while(len > 0) {
+        ssize_t n;
+
+        if(!sendfile_broken) {
+            n = sendfile(s, fd, NULL, len);
+            if(n < 0 && errno == EINTR)
+                continue;
+            if(n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+                sendfile_broken = 1;
+                continue;
+            }
+            if(n < 0)
+                return -1;
+        } else {
+            n = adb_read(fd, buffer, len);
+            if(n < 0 && errno == EINTR)
+                continue;
+            if(n > 0 && writex(s, buffer, n))
+                return -1;
+        }
+        if(n <= 0) {
+            memset(buffer, 0, len);
+            if(writex(s, buffer, len))
+                return -1;
+            short_read = 1;
+            break;
+        }
+        len -= n;
+    }
+    return short_read;
+}
+#endif
+
+/* zbuffer is non-NULL when the client negotiated SYNC_FEATURE_LZ4;
+** chunks that do not shrink still go out as plain ID_DATA
+*/
+static int do_recv(int s, const char *path, char *buffer, char *zbuffer)
+{
+    syncmsg msg;
+    int fd, r, z;
+#if HAVE_SENDFILE
+    struct stat st;
+    off_t pos = 0;
+    int incompressible = 0;
+#endif
 
     fd = adb_open(path, O_RDONLY);
     if(fd < 0) {
         if(fail_errno(s)) return -1;
         return 0;
     }
+#if HAVE_SENDFILE
+    if(fstat(fd, &st) || !S_ISREG(st.st_mode))
+        st.st_size = 0;
+#endif
 
-    msg.data.id = ID_DATA;
     for(;;) {
+#if HAVE_SENDFILE
+            /* regular files skip the trip through buffer, unless the
+            ** data is worth compressing; whatever the file grew by
+            ** since we looked goes the slow way
+            */
+        if(pos < st.st_size &&
+           (!zbuffer || incompressible >= SYNC_RECV_INCOMPRESSIBLE)) {
+            unsigned len = SYNC_DATA_MAX;
+            if(st.st_size - pos < len) len = st.st_size - pos;
+            r = send_file_data(s, fd, len, buffer);
+            if(r < 0) {
+                adb_close(fd);
+                return -1;
+            }
+            if(r > 0) {
+                adb_close(fd);
+                return fail_message(s, "file changed during transfer");
+            }
+            pos += len;
+            continue;
+        }
+#endif
         r = adb_read(fd, buffer, SYNC_DATA_MAX);
         if(r <= 0) {
             if(r == 0) break;
@@ -337,9 +996,15 @@ static int do_recv(int s, const char *path, char *buffer)
             adb_close(fd);
             return r;
         }
-        msg.data.size = htoll(r);
+        z = zbuffer ? lz4_block_compress(buffer, r, zbuffer, r - 1) : 0;
+#if HAVE_SENDFILE
+        pos += r;
+        incompressible = z ? 0 : incompressible + 1;
+#endif
+        msg.data.id = z ? ID_CDAT : ID_DATA;
+        msg.data.size = htoll(z ? z : r);
         if(writex(s, &msg.data, sizeof(msg.data)) ||
-           writex(s, buffer, r)) {
+           writex(s, z ? zbuffer : buffer, z ? z : r)) {
             adb_close(fd);
             return -1;
         }
@@ -361,6 +1026,9 @@ void file_sync_service(int fd, void *cookie)
     syncmsg msg;
     char name[1025];
     unsigned namelen;
+    unsigned features = 0;
+    char *zbuffer = NULL;
+    hashpool *hashes = NULL;
 
     char *buffer = malloc(SYNC_DATA_MAX);
     if(buffer == 0) goto fail;
@@ -386,6 +1054,13 @@ void file_sync_service(int fd, void *cookie)
         msg.req.namelen = 0;
         D("sync: '%s' '%s'\n", (char*) &msg.req, name);
 
+        if(msg.req.id == ID_HASH && (features & SYNC_FEATURE_HASH)) {
+            if(hashes == NULL) hashes = hashpool_create(fd);
+            if(hashes == NULL || hashpool_submit(hashes, name)) goto fail;
+            continue;
+        }
+        if(hashes != NULL && hashpool_drain(hashes)) goto fail;
+
         switch(msg.req.id) {
         case ID_STAT:
             if(do_stat(fd, name)) goto fail;
@@ -393,11 +1068,31 @@ void file_sync_service(int fd, void *cookie)
         case ID_LIST:
             if(do_list(fd, name)) goto fail;
             break;
+        case ID_TREE:
+            if(do_tree(fd, name)) goto fail;
+            break;
         case ID_SEND:
-            if(do_send(fd, name, buffer)) goto fail;
+            if(do_send(fd, name, buffer, zbuffer)) goto fail;
             break;
         case ID_RECV:
-            if(do_recv(fd, name, buffer)) goto fail;
+            if(do_recv(fd, name, buffer, zbuffer)) goto fail;
+            break;
+        case ID_PTCH:
+            if(!(features & SYNC_FEATURE_HASH)) {
+                fail_message(fd, "unknown command");
+                goto fail;
+            }
+            if(do_patch(fd, name, buffer, zbuffer)) goto fail;
+            break;
+        case ID_FEAT:
+            if(do_feat(fd, name, &features)) goto fail;
+            if(!(features & SYNC_FEATURE_LZ4)) {
+                free(zbuffer);
+                zbuffer = NULL;
+            } else if(zbuffer == NULL) {
+                zbuffer = malloc(SYNC_DATA_MAX);
+                if(zbuffer == NULL) goto fail;
+            }
             break;
         case ID_QUIT:
             goto fail;
@@ -408,7 +1103,9 @@ void file_sync_service(int fd, void *cookie)
     }
 
 fail:
+    if(hashes != NULL) hashpool_destroy(hashes);
     if(buffer != 0) free(buffer);
+    free(zbuffer);
     D("sync: done\n");
     adb_close(fd);
 }
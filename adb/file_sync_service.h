@@ -45,6 +45,12 @@ static inline unsigned __swap_uint32(unsigned x)
 #define ID_OKAY MKID('O','K','A','Y')
 #define ID_FAIL MKID('F','A','I','L')
 #define ID_QUIT MKID('Q','U','I','T')
+#define ID_FEAT MKID('F','E','A','T')
+#define ID_CDAT MKID('C','D','A','T')
+#define ID_TREE MKID('T','R','E','E')
+#define ID_HASH MKID('H','A','S','H')
+#define ID_PTCH MKID('P','T','C','H')
+#define ID_SKIP MKID('S','K','I','P')
 
 typedef union {
     unsigned id;
@@ -84,4 +90,91 @@ int do_sync_pull(const char *rpath, const char *lpath);
 
 #define SYNC_DATA_MAX (64*1024)
 
+/* ID_TREE answers like ID_LIST, but for the whole subtree: one ID_DENT
+** per entry below the directory (not following symlinks), named
+** relative to it, each directory before its contents.  Entries whose
+** relative name would be longer than this are left out.
+*/
+#define SYNC_TREE_NAME_MAX 1024
+
+/* ID_HASH asks for the content hash of a file.  The answer is laid out
+** like a status message; its body is the file's size (4 bytes, little
+** endian), then the SHA-256 of the concatenated block digests, then the
+** SHA-256 of each SYNC_HASH_BLOCK sized block in order, the last one
+** short.  An empty body means the path is not a readable regular file.
+**
+** ID_PTCH replaces an existing file with a patched copy of it.  The
+** client sends the path and mode as for ID_SEND, then a run of
+** ID_DATA/ID_CDAT (new bytes at the current offset) and ID_SKIP (size
+** bytes to keep as they are), then ID_DONE with the mtime, at which
+** point the file ends at the current offset.  The service builds the
+** new file next to the old one and renames it into place, so the old
+** file is untouched if anything fails.  The service answers ID_OKAY or
+** ID_FAIL like ID_SEND.
+*/
+#define SYNC_HASH_BLOCK SYNC_DATA_MAX
+#define SYNC_HASH_SIZE  32
+
+/* Optional sync features.  The client sends ID_FEAT with a comma
+** separated list of the ones it wants as the name; the service answers
+** ID_FEAT (laid out like a status message) listing those it accepted.
+** Services that predate ID_FEAT answer ID_FAIL and drop the connection.
+*/
+#define SYNC_FEATURE_LZ4    0x0001  /* ID_CDAT: LZ4 block compressed ID_DATA */
+#define SYNC_FEATURE_TREE   0x0002  /* ID_TREE: recursive ID_LIST */
+#define SYNC_FEATURE_HASH   0x0004  /* ID_HASH and ID_PTCH: delta sync */
+
+static const struct {
+    unsigned bit;
+    const char *name;
+} sync_feature_names[] = {
+    { SYNC_FEATURE_LZ4, "lz4" },
+    { SYNC_FEATURE_TREE, "tree" },
+    { SYNC_FEATURE_HASH, "hash" },
+};
+
+#define SYNC_FEATURE_COUNT \
+    (sizeof(sync_feature_names) / sizeof(sync_feature_names[0]))
+
+static inline unsigned sync_parse_features(const char *list)
+{
+    unsigned features = 0;
+    unsigned i;
+
+    while (*list) {
+        const char *end = strchr(list, ',');
+        size_t len = end ? (size_t)(end - list) : strlen(list);
+
+        for (i = 0; i < SYNC_FEATURE_COUNT; i++) {
+            if (strlen(sync_feature_names[i].name) == len &&
+                !strncmp(sync_feature_names[i].name, list, len)) {
+                features |= sync_feature_names[i].bit;
+            }
+        }
+        list += len;
+        if (*list == ',') list++;
+    }
+    return features;
+}
+
+/* returns the length written, not counting the terminator */
+static inline int sync_format_features(unsigned features, char *buf, size_t size)
+{
+    size_t len = 0;
+    unsigned i;
+
+    buf[0] = 0;
+    for (i = 0; i < SYNC_FEATURE_COUNT; i++) {
+        if (features & sync_feature_names[i].bit) {
+            len += snprintf(buf + len, size - len, "%s%s",
+                            len ? "," : "", sync_feature_names[i].name);
+            if (len >= size) {
+                len = size - 1;
+                break;
+            }
+        }
+    }
+    return len;
+}
+
 #endif
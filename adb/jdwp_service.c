@@ -588,7 +588,7 @@ jdwp_socket_ready( asocket*  s )
     */
     if (jdwp->pass == 0) {
         apacket*  p = get_apacket();
-        p->len = jdwp_process_list((char*)p->data, MAX_PAYLOAD);
+        p->len = jdwp_process_list((char*)p->data, MAX_PAYLOAD_V1);
         peer->enqueue(peer, p);
         jdwp->pass = 1;
     }
@@ -677,7 +677,7 @@ jdwp_tracker_ready( asocket*  s )
     if (t->need_update) {
         apacket*  p = get_apacket();
         t->need_update = 0;
-        p->len = jdwp_process_list_msg((char*)p->data, sizeof(p->data));
+        p->len = jdwp_process_list_msg((char*)p->data, MAX_PAYLOAD_V1);
         s->peer->enqueue(s->peer, p);
     }
 }
@@ -0,0 +1,224 @@
+/*
+ * Copyright (C) 2013 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+
+#include "lz4_block.h"
+
+#define MINMATCH       4
+#define LAST_LITERALS  5    /* the last 5 bytes are always literals */
+#define MFLIMIT        12   /* and no match starts within the last 12 */
+#define MAX_DISTANCE   65535
+#define HASH_BITS      12
+#define SKIP_SHIFT     6    /* search step grows every 64 misses */
+
+static unsigned read32(const unsigned char *p)
+{
+    unsigned v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static unsigned hash32(unsigned v)
+{
+    return (v * 2654435761U) >> (32 - HASH_BITS);
+}
+
+/* write a length continuation (the part beyond the 4 bit token field) */
+static unsigned char *put_length(unsigned char *op, unsigned len)
+{
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = len;
+    return op;
+}
+
+/* how many bytes put_length() writes for a length of len */
+static size_t length_bytes(unsigned len)
+{
+    return len >= 15 ? (len - 15) / 255 + 1 : 0;
+}
+
+/* emit one sequence: literals from anchor, then a match of matchlen
+** bytes at distance offset (offset 0 for the trailing literal run)
+*/
+static unsigned char *put_sequence(unsigned char *op, unsigned char *oend,
+                                   const unsigned char *anchor,
+                                   unsigned litlen, unsigned offset,
+                                   unsigned matchlen)
+{
+    unsigned char *token;
+    size_t need;
+
+        /* token and literals, then offset and match length unless this
+        ** is the trailing literal run */
+    need = 1 + (size_t)litlen + length_bytes(litlen);
+    if (offset != 0)
+        need += 2 + length_bytes(matchlen - MINMATCH);
+    if (op > oend || (size_t)(oend - op) < need)
+        return NULL;
+
+    token = op++;
+
+    if (litlen >= 15) {
+        *token = 15 << 4;
+        op = put_length(op, litlen - 15);
+    } else {
+        *token = litlen << 4;
+    }
+    memcpy(op, anchor, litlen);
+    op += litlen;
+
+    if (offset == 0)
+        return op;
+
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+    matchlen -= MINMATCH;
+    if (matchlen >= 15) {
+        *token |= 15;
+        op = put_length(op, matchlen - 15);
+    } else {
+        *token |= matchlen;
+    }
+    return op;
+}
+
+int lz4_block_compress(const void *_src, int len, void *_dst, int cap)
+{
+    const unsigned char *src = _src;
+    const unsigned char *ip = src;
+    const unsigned char *anchor = src;
+    const unsigned char *end = src + len;
+    const unsigned char *mflimit = end - MFLIMIT;
+    const unsigned char *matchlimit = end - LAST_LITERALS;
+    unsigned char *op = _dst;
+    unsigned char *oend = op + cap;
+    unsigned table[1 << HASH_BITS];
+    unsigned misses = 0;
+
+    if (len < 0 || cap <= 0)
+        return 0;
+
+    if (len > MFLIMIT) {
+            /* positions are stored +1 so that 0 means "empty" */
+        memset(table, 0, sizeof(table));
+
+        while (ip < mflimit) {
+            unsigned seq = read32(ip);
+            unsigned h = hash32(seq);
+            unsigned pos = table[h];
+            const unsigned char *ref = src + pos - 1;
+            table[h] = ip - src + 1;
+
+            if (pos != 0 && ip - ref <= MAX_DISTANCE && read32(ref) == seq) {
+                const unsigned char *m = ip + MINMATCH;
+                const unsigned char *r = ref + MINMATCH;
+
+                while (m < matchlimit && *m == *r) {
+                    m++;
+                    r++;
+                }
+                    /* walk back over literals that also match */
+                while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+                    ip--;
+                    ref--;
+                }
+
+                op = put_sequence(op, oend, anchor, ip - anchor, ip - ref, m - ip);
+                if (op == NULL)
+                    return 0;
+                ip = anchor = m;
+                misses = 0;
+            } else {
+                ip += 1 + (misses++ >> SKIP_SHIFT);
+            }
+        }
+    }
+
+    op = put_sequence(op, oend, anchor, end - anchor, 0, 0);
+    if (op == NULL)
+        return 0;
+    return op - (unsigned char *)_dst;
+}
+
+int lz4_block_decompress(const void *_src, int len, void *_dst, int cap)
+{
+    const unsigned char *ip = _src;
+    const unsigned char *iend = ip + len;
+    unsigned char *dst = _dst;
+    unsigned char *op = dst;
+    unsigned char *oend = dst + cap;
+
+    while (ip < iend) {
+        unsigned token = *ip++;
+        unsigned litlen = token >> 4;
+        unsigned matchlen = token & 15;
+        unsigned offset;
+        unsigned b;
+
+        if (litlen == 15) {
+            do {
+                if (ip >= iend)
+                    return -1;
+                b = *ip++;
+                litlen += b;
+            } while (b == 255);
+        }
+        if (litlen > (unsigned)(iend - ip) || litlen > (unsigned)(oend - op))
+            return -1;
+        memcpy(op, ip, litlen);
+        op += litlen;
+        ip += litlen;
+
+            /* the final sequence is literals only */
+        if (ip == iend)
+            break;
+
+        if (iend - ip < 2)
+            return -1;
+        offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (unsigned)(op - dst))
+            return -1;
+
+        if (matchlen == 15) {
+            do {
+                if (ip >= iend)
+                    return -1;
+                b = *ip++;
+                matchlen += b;
+            } while (b == 255);
+        }
+        matchlen += MINMATCH;
+        if (matchlen > (unsigned)(oend - op))
+            return -1;
+
+        if (offset >= matchlen) {
+            memcpy(op, op - offset, matchlen);
+            op += matchlen;
+        } else {
+                /* overlapping copy repeats the last offset bytes */
+            const unsigned char *ref = op - offset;
+            while (matchlen--)
+                *op++ = *ref++;
+        }
+    }
+
+    return op - dst;
+}
@@ -0,0 +1,41 @@
+/*
+ * Copyright (C) 2013 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _LZ4_BLOCK_H_
+#define _LZ4_BLOCK_H_
+
+/* A small, self-contained coder for the LZ4 block format, used to
+** squeeze sync data chunks.  It favours speed over ratio: one hash
+** probe per position, and it skips ahead faster through data that
+** does not match.
+*/
+
+/* worst case output size for len bytes of input */
+#define LZ4_BLOCK_BOUND(len)  ((len) + (len) / 255 + 16)
+
+/* Compress len bytes from src into dst, which holds cap bytes.  Returns
+** the compressed size, or 0 if the result would not fit in cap bytes.
+** Passing cap < len therefore doubles as "only if it actually shrinks".
+*/
+int lz4_block_compress(const void *src, int len, void *dst, int cap);
+
+/* Expand the len byte block at src into dst, which holds cap bytes.
+** Returns the expanded size, or -1 if the block is malformed or would
+** not fit.
+*/
+int lz4_block_decompress(const void *src, int len, void *dst, int cap);
+
+#endif
@@ -8,8 +8,10 @@
 #endif
 ADB_MUTEX(socket_list_lock)
 ADB_MUTEX(transport_lock)
+ADB_MUTEX(apacket_pool_lock)
 #if ADB_HOST
 ADB_MUTEX(local_transports_lock)
+ADB_MUTEX(sync_jobs_lock)
 #endif
 ADB_MUTEX(usb_lock)
 
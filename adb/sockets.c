@@ -43,7 +43,26 @@ int sendfailmsg(int fd, const char *reason)
 
 //extern int online;
 
-static unsigned local_socket_next_id = 1;
+/* local socket ids are (generation << SOCKET_SLOT_BITS) | slot, and the
+** slot indexes a two-level table so find_local_socket() is a couple of
+** loads instead of a walk over every open socket.  table pages are never
+** freed, which lets lookups skip socket_list_lock: the id check rejects
+** a slot that was reused since the packet was sent.
+*/
+#define SOCKET_SLOT_BITS   16
+#define SOCKET_SLOT_MASK   ((1u << SOCKET_SLOT_BITS) - 1)
+#define SOCKET_PAGE_BITS   8
+#define SOCKET_PAGE_SIZE   (1u << SOCKET_PAGE_BITS)
+#define SOCKET_PAGE_COUNT  (1u << (SOCKET_SLOT_BITS - SOCKET_PAGE_BITS))
+
+static asocket **local_socket_pages[SOCKET_PAGE_COUNT];
+static unsigned local_socket_next_gen = 1;
+static unsigned local_socket_next_slot = 1; /* slot 0 would allow id 0 */
+
+/* slots given back by remove_socket(), reused before fresh ones */
+static unsigned *local_socket_free_slots;
+static unsigned local_socket_free_count;
+static unsigned local_socket_free_max;
 
 static asocket local_socket_list = {
     .next = &local_socket_list,
@@ -61,19 +80,19 @@ static asocket local_socket_closing_list = {
 
 asocket *find_local_socket(unsigned id)
 {
+    unsigned slot = id & SOCKET_SLOT_MASK;
+    asocket **page;
     asocket *s;
-    asocket *result = NULL;
 
-    adb_mutex_lock(&socket_list_lock);
-    for (s = local_socket_list.next; s != &local_socket_list; s = s->next) {
-        if (s->id == id) {
-            result = s;
-            break;
-        }
+    page = local_socket_pages[slot >> SOCKET_PAGE_BITS];
+    if (page == NULL) {
+        return NULL;
     }
-    adb_mutex_unlock(&socket_list_lock);
-
-    return result;
+    s = page[slot & (SOCKET_PAGE_SIZE - 1)];
+    if (s == NULL || s->id != id) {
+        return NULL;
+    }
+    return s;
 }
 
 static void
@@ -85,22 +104,77 @@ insert_local_socket(asocket*  s, asocket*  list)
     s->next->prev = s;
 }
 
+// socket_list_lock should already be held
+static asocket **local_socket_slot_locked(unsigned slot)
+{
+    asocket ***page = &local_socket_pages[slot >> SOCKET_PAGE_BITS];
+
+    if (*page == NULL) {
+        asocket **fresh = calloc(SOCKET_PAGE_SIZE, sizeof(asocket*));
+        if (fresh == NULL) fatal("cannot allocate local socket table");
+            /* zeroed page must be visible before the pointer to it */
+        __sync_synchronize();
+        *page = fresh;
+    }
+    return &(*page)[slot & (SOCKET_PAGE_SIZE - 1)];
+}
 
 void install_local_socket(asocket *s)
 {
+    unsigned slot;
+
     adb_mutex_lock(&socket_list_lock);
 
-    s->id = local_socket_next_id++;
+    if (local_socket_free_count > 0) {
+        slot = local_socket_free_slots[--local_socket_free_count];
+    } else if (local_socket_next_slot <= SOCKET_SLOT_MASK) {
+        slot = local_socket_next_slot++;
+    } else {
+        fatal("too many local sockets");
+    }
+
+    s->id = ((local_socket_next_gen++) << SOCKET_SLOT_BITS) | slot;
     insert_local_socket(s, &local_socket_list);
 
+        /* publish only once the id is in place */
+    __sync_synchronize();
+    *local_socket_slot_locked(slot) = s;
+
     adb_mutex_unlock(&socket_list_lock);
 }
 
+static void release_local_socket_slot_locked(asocket *s)
+{
+    unsigned slot = s->id & SOCKET_SLOT_MASK;
+    asocket **page = local_socket_pages[slot >> SOCKET_PAGE_BITS];
+
+    if (page == NULL || page[slot & (SOCKET_PAGE_SIZE - 1)] != s) {
+        return;
+    }
+    page[slot & (SOCKET_PAGE_SIZE - 1)] = NULL;
+
+    if (local_socket_free_count == local_socket_free_max) {
+        unsigned max = local_socket_free_max ? local_socket_free_max * 2 : 64;
+        unsigned *slots = realloc(local_socket_free_slots,
+                                  max * sizeof(unsigned));
+        if (slots == NULL) {
+            /* just leak the slot; there are plenty more */
+            return;
+        }
+        local_socket_free_slots = slots;
+        local_socket_free_max = max;
+    }
+    local_socket_free_slots[local_socket_free_count++] = slot;
+}
+
 void remove_socket(asocket *s)
 {
     // socket_list_lock should already be held
     if (s->prev && s->next)
     {
+        if (s->id) {
+            release_local_socket_slot_locked(s);
+        }
         s->prev->next = s->next;
         s->next->prev = s->prev;
         s->next = 0;
@@ -127,6 +201,23 @@ restart:
     adb_mutex_unlock(&socket_list_lock);
 }
 
+/* the largest payload that may be queued towards s's peer: bounded by
+** whichever transport the data will eventually cross
+*/
+size_t get_max_payload(asocket *s)
+{
+    size_t max_payload = MAX_PAYLOAD;
+
+    if (s->transport && s->transport->max_payload < max_payload) {
+        max_payload = s->transport->max_payload;
+    }
+    if (s->peer && s->peer->transport &&
+        s->peer->transport->max_payload < max_payload) {
+        max_payload = s->peer->transport->max_payload;
+    }
+    return max_payload;
+}
+
 static int local_socket_enqueue(asocket *s, apacket *p)
 {
     D("LS(%d): enqueue %d\n", s->id, p->len);
@@ -320,7 +411,8 @@ static void local_socket_event_func(int fd, unsigned ev, void *_s)
     if(ev & FDE_READ){
         apacket *p = get_apacket();
         unsigned char *x = p->data;
-        size_t avail = MAX_PAYLOAD;
+        size_t max_payload = get_max_payload(s);
+        size_t avail = max_payload;
         int r;
         int is_eof = 0;
 
@@ -343,10 +435,10 @@ static void local_socket_event_func(int fd, unsigned ev, void *_s)
         }
         D("LS(%d): fd=%d post avail loop. r=%d is_eof=%d forced_eof=%d\n",
           s->id, s->fd, r, is_eof, s->fde.force_eof);
-        if((avail == MAX_PAYLOAD) || (s->peer == 0)) {
+        if((avail == max_payload) || (s->peer == 0)) {
             put_apacket(p);
         } else {
-            p->len = MAX_PAYLOAD - avail;
+            p->len = max_payload - avail;
 
             r = s->peer->enqueue(s->peer, p);
             D("LS(%d): fd=%d post peer->enqueue(). r=%d\n", s->id, s->fd, r);
@@ -544,7 +636,7 @@ void connect_to_remote(asocket *s, const char *destination)
     apacket *p = get_apacket();
     int len = strlen(destination) + 1;
 
-    if(len > (MAX_PAYLOAD-1)) {
+    if(len > (MAX_PAYLOAD_V1-1)) {
         fatal("destination oversized");
     }
 
@@ -0,0 +1,179 @@
+/* a simple stress test for fdevent.c: bounces messages through thousands of
+** socket pairs that are relayed the way adb forwards sockets (the relay stops
+** reading one side until the other side answers), and reports how often the
+** loop turns and how many interest changes actually reach the kernel.
+**
+** build: gcc -O2 -DADB_HOST=1 -D_GNU_SOURCE -I../include \
+**            -o test_fdevent_stress test_fdevent_stress.c fdevent.c -lpthread
+** usage: test_fdevent_stress [forwards] [seconds]
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "sysdeps.h"
+#include "fdevent.h"
+
+#define MSG_SIZE  64
+
+typedef struct forward
+{
+    int a, b;               /* the two "clients" */
+    fdevent fa, fb;
+    fdevent near, far;      /* relay ends facing a and b */
+} forward;
+
+static forward *forwards;
+static int nforwards;
+static int seconds_left;
+static uint64_t round_trips;
+static fdevent tick_fde;
+static fdevent_stats last;
+
+static void
+panic( const char*  msg )
+{
+    fprintf(stderr, "PANIC: %s: %s\n", msg, strerror(errno));
+    exit(1);
+}
+
+/* fdevent.c wants this from transport.c */
+int readx(int fd, void *ptr, size_t len)
+{
+    char *p = ptr;
+    int r;
+
+    while(len > 0) {
+        r = adb_read(fd, p, len);
+        if(r <= 0) {
+            if(r < 0 && errno == EINTR) continue;
+            return -1;
+        }
+        len -= r;
+        p += r;
+    }
+    return 0;
+}
+
+static void relay(int from, int to)
+{
+    char buf[MSG_SIZE];
+    int n = adb_read(from, buf, sizeof(buf));
+
+    if(n <= 0) {
+        if(n < 0 && errno == EAGAIN) return;
+        panic("relay read");
+    }
+    if(adb_write(to, buf, n) != n) panic("relay write");
+}
+
+static void near_event(int fd, unsigned ev, void *arg)
+{
+    forward *f = arg;
+
+        /* like a local socket waiting for OKAY: stop reading this side
+        ** until the answer comes back the other way */
+    relay(fd, f->far.fd);
+    fdevent_del(&f->near, FDE_READ);
+    fdevent_add(&f->far, FDE_READ);
+}
+
+static void far_event(int fd, unsigned ev, void *arg)
+{
+    forward *f = arg;
+
+    relay(fd, f->near.fd);
+    fdevent_del(&f->far, FDE_READ);
+    fdevent_add(&f->near, FDE_READ);
+}
+
+static void a_event(int fd, unsigned ev, void *arg)
+{
+    char buf[MSG_SIZE];
+
+    if(adb_read(fd, buf, sizeof(buf)) <= 0) {
+        if(errno == EAGAIN) return;
+        panic("client read");
+    }
+    round_trips++;
+    if(adb_write(fd, buf, sizeof(buf)) != sizeof(buf)) panic("client write");
+}
+
+static void b_event(int fd, unsigned ev, void *arg)
+{
+    char buf[MSG_SIZE];
+    int n = adb_read(fd, buf, sizeof(buf));
+
+    if(n <= 0) {
+        if(n < 0 && errno == EAGAIN) return;
+        panic("echo read");
+    }
+    if(adb_write(fd, buf, n) != n) panic("echo write");
+}
+
+static void tick_event(int fd, unsigned ev, void *arg)
+{
+    fdevent_stats st;
+
+    fdevent_get_stats(&st);
+    printf("%d forwards: %llu round trips/s, %llu loops/s, %llu callbacks/s, "
+           "%llu epoll_ctl/s\n", nforwards,
+           (unsigned long long)round_trips,
+           (unsigned long long)(st.loops - last.loops),
+           (unsigned long long)(st.callbacks - last.callbacks),
+           (unsigned long long)(st.syscalls - last.syscalls));
+    fflush(stdout);
+    last = st;
+    round_trips = 0;
+
+    if(--seconds_left <= 0) exit(0);
+    fdevent_set_timeout(&tick_fde, 1000);
+}
+
+int main(int argc, char **argv)
+{
+    char msg[MSG_SIZE];
+    struct rlimit rl;
+    int i, s[2];
+
+    nforwards = (argc > 1) ? atoi(argv[1]) : 2000;
+    seconds_left = (argc > 2) ? atoi(argv[2]) : 5;
+
+        /* four descriptors per forward, plus a few */
+    if(getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    forwards = calloc(nforwards, sizeof(forward));
+    if(forwards == NULL) panic("calloc");
+    memset(msg, 'x', sizeof(msg));
+
+    for(i = 0; i < nforwards; i++) {
+        forward *f = forwards + i;
+
+        if(adb_socketpair(s)) panic("socketpair");
+        f->a = s[0];
+        fdevent_install(&f->near, s[1], near_event, f);
+        if(adb_socketpair(s)) panic("socketpair");
+        f->b = s[0];
+        fdevent_install(&f->far, s[1], far_event, f);
+
+        fdevent_install(&f->fa, f->a, a_event, f);
+        fdevent_install(&f->fb, f->b, b_event, f);
+        fdevent_add(&f->fa, FDE_READ);
+        fdevent_add(&f->fb, FDE_READ);
+        fdevent_add(&f->near, FDE_READ);
+
+        if(adb_write(f->a, msg, sizeof(msg)) != sizeof(msg)) panic("write");
+    }
+
+    fdevent_install(&tick_fde, FD_TIMER, tick_event, NULL);
+    fdevent_set_timeout(&tick_fde, 1000);
+
+    fdevent_loop();
+    return 0;
+}
@@ -0,0 +1,134 @@
+/* round trip test for lz4_block.c: compresses assorted inputs into every
+** output size from 1 byte up to LZ4_BLOCK_BOUND, and checks that nothing
+** is written past the capacity it was given, that the result either fits
+** or is refused, and that what fits expands back to the input.  An input
+** whose compressed size is exactly the capacity must still be accepted.
+**
+** build: gcc -O2 -o test_lz4_block test_lz4_block.c lz4_block.c
+** usage: test_lz4_block [iterations]
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lz4_block.h"
+
+#define MAX_INPUT  4096
+#define GUARD      64
+#define GUARD_BYTE 0xa5
+
+static unsigned char src[MAX_INPUT];
+static unsigned char dst[LZ4_BLOCK_BOUND(MAX_INPUT) + GUARD];
+static unsigned char out[MAX_INPUT];
+static int failures;
+
+static void
+fail( const char*  what, int  len, int  cap, int  z )
+{
+    fprintf(stderr, "FAIL: %s len=%d cap=%d z=%d\n", what, len, cap, z);
+    failures++;
+}
+
+/* returns the compressed size at capacity cap, checking everything */
+static int
+check_one( int  len, int  cap )
+{
+    int z, i;
+
+    memset(dst, GUARD_BYTE, cap + GUARD);
+    z = lz4_block_compress(src, len, dst, cap);
+    for (i = cap; i < cap + GUARD; i++) {
+        if (dst[i] != GUARD_BYTE) {
+            fail("wrote past cap", len, cap, z);
+            return z;
+        }
+    }
+    if (z < 0 || z > cap) {
+        fail("overflow", len, cap, z);
+        return z;
+    }
+    if (z > 0) {
+        int n = lz4_block_decompress(dst, z, out, MAX_INPUT);
+        if (n != len || memcmp(out, src, len))
+            fail("round trip", len, cap, z);
+    }
+    return z;
+}
+
+static void
+check_input( int  len )
+{
+    int bound = LZ4_BLOCK_BOUND(len);
+    int full, cap;
+
+    full = check_one(len, bound);
+    if (full == 0) {
+        fail("refused at LZ4_BLOCK_BOUND", len, bound, full);
+        return;
+    }
+    for (cap = 1; cap < bound; cap++) {
+        int z = check_one(len, cap);
+        if (cap >= full && z != full)
+            fail("refused an exact fit", len, cap, z);
+    }
+}
+
+/* random bytes with runs and repeats mixed in, the way the fuzzer
+** that found the end-of-buffer overflow generated them */
+static void
+fill_input( int  len, unsigned  seed )
+{
+    int i = 0;
+
+    srand(seed);
+    while (i < len) {
+        int n = 1 + rand() % 40;
+        if (n > len - i) n = len - i;
+        switch (rand() % 3) {
+        case 0:
+            while (n--) src[i++] = rand();
+            break;
+        case 1:
+            memset(src + i, rand(), n);
+            i += n;
+            break;
+        default:
+            if (i > 0) {
+                int back = 1 + rand() % i;
+                while (n--) {
+                    src[i] = src[i - back];
+                    i++;
+                }
+            } else {
+                src[i++] = rand();
+            }
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int iterations = argc > 1 ? atoi(argv[1]) : 200;
+    int len, i;
+
+        /* every short length, all literals and all one byte */
+    for (len = 0; len <= 300; len++) {
+        for (i = 0; i < len; i++) src[i] = rand();
+        check_input(len);
+        memset(src, 'a', len);
+        check_input(len);
+    }
+
+    for (i = 0; i < iterations; i++) {
+        len = rand() % (MAX_INPUT + 1);
+        fill_input(len, i);
+        check_input(len);
+    }
+
+    if (failures) {
+        fprintf(stderr, "%d failures\n", failures);
+        return 1;
+    }
+    printf("ok\n");
+    return 0;
+}
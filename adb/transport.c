@@ -22,6 +22,18 @@
 
 #include "sysdeps.h"
 
+#if defined(__linux__)
+#include <stdint.h>
+#include <sys/eventfd.h>
+#define HAVE_EVENTFD 1
+#endif
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #define   TRACE_TAG  TRACE_TRANSPORT
 #include "adb.h"
 
@@ -138,97 +150,211 @@ dump_packet(const char* name, const char* func, apacket* p)
 }
 #endif /* ADB_TRACE */
 
-static int
-read_packet(int  fd, const char* name, apacket** ppacket)
+/* --- packet queues ---
+**
+** The producer stores the slot, then tail; the consumer reads tail,
+** then the slot, then stores head.  Full barriers between the store of
+** one index and the load of the other make sure that a consumer about
+** to sleep on an empty ring and a producer filling it cannot both miss
+** each other: either the consumer sees the new tail, or the producer
+** sees that the ring was drained and sends a wakeup.
+*/
+#define APACKET_QUEUE_MASK (APACKET_QUEUE_SIZE - 1)
+#define queue_barrier() __sync_synchronize()
+
+static int apacket_queue_init(apacket_queue *q)
 {
-    char *p = (char*)ppacket;  /* really read a packet address */
-    int   r;
-    int   len = sizeof(*ppacket);
-    char  buff[8];
-    if (!name) {
-        snprintf(buff, sizeof buff, "fd=%d", fd);
-        name = buff;
-    }
-    while(len > 0) {
-        r = adb_read(fd, p, len);
-        if(r > 0) {
-            len -= r;
-            p   += r;
-        } else {
-            D("%s: read_packet (fd=%d), error ret=%d errno=%d: %s\n", name, fd, r, errno, strerror(errno));
-            if((r < 0) && (errno == EINTR)) continue;
+    q->head = 0;
+    q->tail = 0;
+#if HAVE_EVENTFD
+    q->wake_read = q->wake_write = eventfd(0, 0);
+    if(q->wake_read < 0)
+        return -1;
+    close_on_exec(q->wake_read);
+#else
+    {
+        int s[2];
+        if(adb_socketpair(s))
             return -1;
-        }
-    }
-
-#if ADB_TRACE
-    if (ADB_TRACING) {
-        dump_packet(name, "from remote", *ppacket);
+        q->wake_read = s[0];
+        q->wake_write = s[1];
     }
 #endif
     return 0;
 }
 
-static int
-write_packet(int  fd, const char* name, apacket** ppacket)
+static void apacket_queue_wake(apacket_queue *q)
 {
-    char *p = (char*) ppacket;  /* we really write the packet address */
-    int r, len = sizeof(ppacket);
-    char buff[8];
-    if (!name) {
-        snprintf(buff, sizeof buff, "fd=%d", fd);
-        name = buff;
+#if HAVE_EVENTFD
+    uint64_t one = 1;
+    while(adb_write(q->wake_write, &one, sizeof(one)) < 0 && errno == EINTR)
+        ;
+#else
+    char c = 0;
+    while(adb_write(q->wake_write, &c, 1) < 0 && errno == EINTR)
+        ;
+#endif
+}
+
+/* swallow pending wakeups; blocks unless the fd is non-blocking */
+static int apacket_queue_clear(apacket_queue *q)
+{
+    int r;
+#if HAVE_EVENTFD
+    uint64_t count;
+    r = adb_read(q->wake_read, &count, sizeof(count));
+#else
+    char buf[64];
+    r = adb_read(q->wake_read, buf, sizeof(buf));
+#endif
+    if(r < 0 && (errno == EINTR || errno == EAGAIN))
+        return 0;
+    return (r > 0) ? 0 : -1;
+}
+
+static void apacket_queue_push(apacket_queue *q, apacket *p)
+{
+    unsigned tail = q->tail;
+
+        /* the consumer is a whole ring behind; let it catch up */
+    while(tail - q->head == APACKET_QUEUE_SIZE)
+        adb_sleep_ms(1);
+
+    q->ring[tail & APACKET_QUEUE_MASK] = p;
+    queue_barrier();
+    q->tail = tail + 1;
+    queue_barrier();
+    if(q->head == tail)
+        apacket_queue_wake(q);
+}
+
+static apacket *apacket_queue_pop(apacket_queue *q)
+{
+    unsigned head = q->head;
+    apacket *p;
+
+    if(head == q->tail)
+        return NULL;
+    queue_barrier();
+    p = q->ring[head & APACKET_QUEUE_MASK];
+    queue_barrier();
+    q->head = head + 1;
+    queue_barrier();
+    return p;
+}
+
+/* for the input thread: returns NULL once the wakeup fd is gone */
+static apacket *apacket_queue_wait(apacket_queue *q)
+{
+    apacket *p;
+
+    while((p = apacket_queue_pop(q)) == NULL) {
+        if(apacket_queue_clear(q))
+            return NULL;
     }
+    return p;
+}
+
+static void apacket_queue_close(apacket_queue *q)
+{
+    apacket *p;
+
+    while((p = apacket_queue_pop(q)) != NULL)
+        put_apacket(p);
+    if(q->wake_write != q->wake_read)
+        adb_close(q->wake_write);
+    adb_close(q->wake_read);
+}
 
+static void enqueue_packet(atransport *t, apacket_queue *q, apacket *p,
+                           const char *what)
+{
 #if ADB_TRACE
     if (ADB_TRACING) {
-        dump_packet(name, "to remote", *ppacket);
+        dump_packet(t->serial, what, p);
     }
 #endif
-    len = sizeof(ppacket);
-    while(len > 0) {
-        r = adb_write(fd, p, len);
-        if(r > 0) {
-            len -= r;
-            p += r;
-        } else {
-            D("%s: write_packet (fd=%d) error ret=%d errno=%d: %s\n", name, fd, r, errno, strerror(errno));
-            if((r < 0) && (errno == EINTR)) continue;
-            return -1;
-        }
-    }
-    return 0;
+    apacket_queue_push(q, p);
 }
 
 static void transport_socket_events(int fd, unsigned events, void *_t)
 {
     atransport *t = _t;
+    apacket *p;
+    int count = 0;
+
     D("transport_socket_events(fd=%d, events=%04x,...)\n", fd, events);
     if(events & FDE_READ){
-        apacket *p = 0;
-        if(read_packet(fd, t->serial, &p)){
-            D("%s: failed to read packet from transport socket on fd %d\n", t->serial, fd);
-        } else {
-            handle_packet(p, (atransport *) _t);
+        apacket_queue_clear(&t->incoming);
+            /* don't hog the loop; if we leave packets behind, make
+            ** sure we come back for them
+            */
+        while(count < APACKET_QUEUE_SIZE &&
+              (p = apacket_queue_pop(&t->incoming)) != NULL) {
+            handle_packet(p, t);
+            count++;
         }
+        if(count == APACKET_QUEUE_SIZE)
+            apacket_queue_wake(&t->incoming);
+        t->wakeups++;
+        t->wakeup_packets += count;
     }
 }
 
-void send_packet(apacket *p, atransport *t)
+/* the handshake goes out before either side knows what the other
+** speaks, so CNXN and AUTH always carry a checksum
+*/
+static int skips_checksum(apacket *p, unsigned version)
 {
-    unsigned char *x;
-    unsigned sum;
-    unsigned count;
+    if (version < A_VERSION_SKIP_CHECKSUM)
+        return 0;
+    return p->msg.command != A_CNXN && p->msg.command != A_AUTH;
+}
 
-    p->msg.magic = p->msg.command ^ 0xffffffff;
+/* plain byte sum of the payload, 16 bytes per step where we can */
+static unsigned checksum_data(const unsigned char *x, unsigned count)
+{
+    unsigned sum = 0;
+
+#if defined(__SSE2__)
+    __m128i zero = _mm_setzero_si128();
+    __m128i acc = zero;
+
+    while (count >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) x);
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(v, zero));
+        x += 16;
+        count -= 16;
+    }
+    sum = _mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+    uint32x4_t acc = vdupq_n_u32(0);
+    uint64x2_t acc64;
+
+    while (count >= 16) {
+        acc = vpadalq_u16(acc, vpaddlq_u8(vld1q_u8(x)));
+        x += 16;
+        count -= 16;
+    }
+    acc64 = vpaddlq_u32(acc);
+    sum = (unsigned) (vgetq_lane_u64(acc64, 0) + vgetq_lane_u64(acc64, 1));
+#endif
 
-    count = p->msg.data_length;
-    x = (unsigned char *) p->data;
-    sum = 0;
     while(count-- > 0){
         sum += *x++;
     }
-    p->msg.data_check = sum;
+    return sum;
+}
+
+void send_packet(apacket *p, atransport *t)
+{
+    p->msg.magic = p->msg.command ^ 0xffffffff;
+
+    if (t && skips_checksum(p, t->protocol_version)) {
+        p->msg.data_check = 0;
+    } else {
+        p->msg.data_check = checksum_data(p->data, p->msg.data_length);
+    }
 
     print_packet("send", p);
 
@@ -239,9 +365,7 @@ void send_packet(apacket *p, atransport *t)
         fatal_errno("Transport is null");
     }
 
-    if(write_packet(t->transport_socket, t->serial, &p)){
-        fatal_errno("cannot enqueue packet on transport socket");
-    }
+    enqueue_packet(t, &t->outgoing, p, "to remote");
 }
 
 /* The transport is opened by transport_register_func before
@@ -262,18 +386,14 @@ static void *output_thread(void *_t)
     atransport *t = _t;
     apacket *p;
 
-    D("%s: starting transport output thread on fd %d, SYNC online (%d)\n",
-       t->serial, t->fd, t->sync_token + 1);
+    D("%s: starting transport output thread, SYNC online (%d)\n",
+       t->serial, t->sync_token + 1);
     p = get_apacket();
     p->msg.command = A_SYNC;
     p->msg.arg0 = 1;
     p->msg.arg1 = ++(t->sync_token);
     p->msg.magic = A_SYNC ^ 0xffffffff;
-    if(write_packet(t->fd, t->serial, &p)) {
-        put_apacket(p);
-        D("%s: failed to write SYNC packet\n", t->serial);
-        goto oops;
-    }
+    enqueue_packet(t, &t->incoming, p, "from remote");
 
     D("%s: data pump started\n", t->serial);
     for(;;) {
@@ -282,11 +402,7 @@ static void *output_thread(void *_t)
         if(t->read_from_remote(p, t) == 0){
             D("%s: received remote packet, sending to transport\n",
               t->serial);
-            if(write_packet(t->fd, t->serial, &p)){
-                put_apacket(p);
-                D("%s: failed to write apacket to transport\n", t->serial);
-                goto oops;
-            }
+            enqueue_packet(t, &t->incoming, p, "from remote");
         } else {
             D("%s: remote read failed for transport\n", t->serial);
             put_apacket(p);
@@ -300,31 +416,34 @@ static void *output_thread(void *_t)
     p->msg.arg0 = 0;
     p->msg.arg1 = 0;
     p->msg.magic = A_SYNC ^ 0xffffffff;
-    if(write_packet(t->fd, t->serial, &p)) {
-        put_apacket(p);
-        D("%s: failed to write SYNC apacket to transport", t->serial);
-    }
+    enqueue_packet(t, &t->incoming, p, "from remote");
 
-oops:
     D("%s: transport output thread is exiting\n", t->serial);
     kick_transport(t);
     transport_unref(t);
     return 0;
 }
 
+/* most packets write_batch_to_remote() is handed at once */
+#define WRITE_BATCH_MAX 16
+
 static void *input_thread(void *_t)
 {
     atransport *t = _t;
     apacket *p;
+    apacket *next = NULL;
     int active = 0;
 
-    D("%s: starting transport input thread, reading from fd %d\n",
-       t->serial, t->fd);
+    D("%s: starting transport input thread, waking on fd %d\n",
+       t->serial, t->outgoing.wake_read);
 
     for(;;){
-        if(read_packet(t->fd, t->serial, &p)) {
-            D("%s: failed to read apacket from transport on fd %d\n",
-               t->serial, t->fd );
+        if(next != NULL) {
+            p = next;
+            next = NULL;
+        } else if((p = apacket_queue_wait(&t->outgoing)) == NULL) {
+            D("%s: failed to wait for apacket from transport on fd %d\n",
+               t->serial, t->outgoing.wake_read);
             break;
         }
         if(p->msg.command == A_SYNC){
@@ -342,7 +461,26 @@ static void *input_thread(void *_t)
                 }
             }
         } else {
-            if(active) {
+            if(active && t->write_batch_to_remote) {
+                    /* take whatever else is already queued, up to
+                    ** the next SYNC, and send it all in one go
+                    */
+                apacket *batch[WRITE_BATCH_MAX];
+                int i, count = 1;
+
+                batch[0] = p;
+                while(count < WRITE_BATCH_MAX &&
+                      (next = apacket_queue_pop(&t->outgoing)) != NULL &&
+                      next->msg.command != A_SYNC) {
+                    batch[count++] = next;
+                    next = NULL;
+                }
+                D("%s: transport got %d packets, sending to remote\n",
+                  t->serial, count);
+                t->write_batch_to_remote(batch, count, t);
+                for(i = 1; i < count; i++)
+                    put_apacket(batch[i]);
+            } else if(active) {
                 D("%s: transport got packet, sending to remote\n", t->serial);
                 t->write_to_remote(p, t);
             } else {
@@ -357,7 +495,7 @@ static void *input_thread(void *_t)
     // while a client socket is still active.
     close_all_sockets(t);
 
-    D("%s: transport input thread is exiting, fd %d\n", t->serial, t->fd);
+    D("%s: transport input thread is exiting\n", t->serial);
     kick_transport(t);
     transport_unref(t);
     return 0;
@@ -573,8 +711,8 @@ static void transport_registration_func(int _fd, unsigned ev, void *data)
     tmsg m;
     adb_thread_t output_thread_ptr;
     adb_thread_t input_thread_ptr;
-    int s[2];
     atransport *t;
+    apacket *p;
 
     if(!(ev & FDE_READ)) {
         return;
@@ -587,13 +725,21 @@ static void transport_registration_func(int _fd, unsigned ev, void *data)
     t = m.transport;
 
     if(m.action == 0){
-        D("transport: %s removing and free'ing %d\n", t->serial, t->transport_socket);
+        D("transport: %s removing and free'ing %d\n", t->serial, t->incoming.wake_read);
+        D("transport: %s handled %llu packets in %llu wakeups\n",
+          t->serial, t->wakeup_packets, t->wakeups);
 
-            /* IMPORTANT: the remove closes one half of the
-            ** socket pair.  The close closes the other half.
+            /* IMPORTANT: the remove closes incoming's wakeup fd
+            ** (both ends of it if it is an eventfd).  The rest goes
+            ** here, along with any packets nobody picked up.
             */
         fdevent_remove(&(t->transport_fde));
-        adb_close(t->fd);
+        fdevent_remove(&(t->auth_retry_fde));
+        while((p = apacket_queue_pop(&t->incoming)) != NULL)
+            put_apacket(p);
+        if(t->incoming.wake_write != t->incoming.wake_read)
+            adb_close(t->incoming.wake_write);
+        apacket_queue_close(&t->outgoing);
 
         adb_mutex_lock(&transport_lock);
         t->next->prev = t->prev;
@@ -625,17 +771,16 @@ static void transport_registration_func(int _fd, unsigned ev, void *data)
         /* initial references are the two threads */
         t->ref_count = 2;
 
-        if(adb_socketpair(s)) {
-            fatal_errno("cannot open transport socketpair");
+        if(apacket_queue_init(&t->incoming) ||
+           apacket_queue_init(&t->outgoing)) {
+            fatal_errno("cannot open transport queues");
         }
 
-        D("transport: %s (%d,%d) starting\n", t->serial, s[0], s[1]);
-
-        t->transport_socket = s[0];
-        t->fd = s[1];
+        D("transport: %s (%d,%d) starting\n", t->serial,
+          t->incoming.wake_read, t->outgoing.wake_read);
 
         fdevent_install(&(t->transport_fde),
-                        t->transport_socket,
+                        t->incoming.wake_read,
                         transport_socket_events,
                         t);
 
@@ -1212,21 +1357,20 @@ int check_header(apacket *p)
     return 0;
 }
 
-int check_data(apacket *p)
+int check_data(apacket *p, atransport *t)
 {
-    unsigned count, sum;
-    unsigned char *x;
+    if (skips_checksum(p, t->recv_version))
+        return 0;
 
-    count = p->msg.data_length;
-    x = p->data;
-    sum = 0;
-    while(count-- > 0) {
-        sum += *x++;
+    if(checksum_data(p->data, p->msg.data_length) != p->msg.data_check) {
+        return -1;
     }
 
-    if(sum != p->msg.data_check) {
-        return -1;
-    } else {
-        return 0;
+        /* the peer stops checksumming once it has seen our CNXN, and it
+        ** always sends its own CNXN before anything that could skip it
+        */
+    if (p->msg.command == A_CNXN) {
+        t->recv_version = p->msg.arg0;
     }
+    return 0;
 }
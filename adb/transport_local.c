@@ -21,6 +21,9 @@
 
 #include "sysdeps.h"
 #include <sys/types.h>
+#ifndef _WIN32
+#include <sys/uio.h>
+#endif
 #if !ADB_HOST
 #include <cutils/properties.h>
 #endif
@@ -55,9 +58,72 @@ ADB_MUTEX_DEFINE( local_transports_lock );
 static atransport*  local_transports[ ADB_LOCAL_TRANSPORT_MAX ];
 #endif /* ADB_HOST */
 
+/* Incoming bytes are read in chunks of up to LOCAL_SBUF_SIZE, so a
+** burst of small packets (shell, logcat) costs one read() rather than
+** two per packet.  Payloads too big for the buffer skip it.
+*/
+#define LOCAL_SBUF_SIZE (64*1024)
+
+static int sbuf_fill(atransport *t)
+{
+    int r;
+
+    if(t->sbuf_start == t->sbuf_end) {
+        t->sbuf_start = t->sbuf_end = 0;
+    } else if(t->sbuf_end == LOCAL_SBUF_SIZE) {
+        memmove(t->sbuf, t->sbuf + t->sbuf_start, t->sbuf_end - t->sbuf_start);
+        t->sbuf_end -= t->sbuf_start;
+        t->sbuf_start = 0;
+    }
+
+    for(;;) {
+        r = adb_read(t->sfd, t->sbuf + t->sbuf_end, LOCAL_SBUF_SIZE - t->sbuf_end);
+        if(r > 0) {
+            t->sbuf_end += r;
+            return 0;
+        }
+        if(r < 0 && errno == EINTR)
+            continue;
+        return -1;
+    }
+}
+
+static int sbuf_read(atransport *t, void *data, unsigned len)
+{
+    unsigned char *p = data;
+
+    while(len > 0) {
+        unsigned avail = t->sbuf_end - t->sbuf_start;
+
+        if(avail == 0) {
+            if(len >= LOCAL_SBUF_SIZE)
+                return readx(t->sfd, p, len);
+            if(sbuf_fill(t))
+                return -1;
+            continue;
+        }
+        if(avail > len)
+            avail = len;
+        memcpy(p, t->sbuf + t->sbuf_start, avail);
+        t->sbuf_start += avail;
+        p += avail;
+        len -= avail;
+    }
+    return 0;
+}
+
 static int remote_read(apacket *p, atransport *t)
 {
-    if(readx(t->sfd, &p->msg, sizeof(amessage))){
+    if(t->sbuf == NULL) {
+        t->sbuf = malloc(LOCAL_SBUF_SIZE);
+        if(t->sbuf == NULL) {
+            D("remote local: out of memory\n");
+            return -1;
+        }
+        t->sbuf_start = t->sbuf_end = 0;
+    }
+
+    if(sbuf_read(t, &p->msg, sizeof(amessage))){
         D("remote local: read terminated (message)\n");
         return -1;
     }
@@ -73,12 +139,12 @@ static int remote_read(apacket *p, atransport *t)
         return -1;
     }
 
-    if(readx(t->sfd, p->data, p->msg.data_length)){
+    if(sbuf_read(t, p->data, p->msg.data_length)){
         D("remote local: terminated (data)\n");
         return -1;
     }
 
-    if(check_data(p)) {
+    if(check_data(p, t)) {
         D("bad data: terminated (data)\n");
         return -1;
     }
@@ -104,6 +170,61 @@ static int remote_write(apacket *p, atransport *t)
     return 0;
 }
 
+/* Header and payload already sit next to each other in an apacket, so
+** each packet is one iovec and a batch goes out in a single writev().
+*/
+#define LOCAL_IOV_MAX 16
+
+static int remote_write_batch(apacket **list, int count, atransport *t)
+{
+#ifdef _WIN32
+    int i;
+
+    for(i = 0; i < count; i++) {
+        if(remote_write(list[i], t))
+            return -1;
+    }
+    return 0;
+#else
+    struct iovec iov[LOCAL_IOV_MAX];
+    struct iovec *v = iov;
+    int i, n;
+
+    while(count > 0) {
+        n = (count > LOCAL_IOV_MAX) ? LOCAL_IOV_MAX : count;
+        for(i = 0; i < n; i++) {
+            int length = list[i]->msg.data_length;
+            fix_endians(list[i]);
+            iov[i].iov_base = &list[i]->msg;
+            iov[i].iov_len = sizeof(amessage) + length;
+        }
+        list += n;
+        count -= n;
+
+        v = iov;
+        while(n > 0) {
+            ssize_t r = writev(t->sfd, v, n);
+            if(r < 0) {
+                if(errno == EINTR)
+                    continue;
+                D("remote local: writev terminated\n");
+                return -1;
+            }
+            while(n > 0 && (size_t)r >= v->iov_len) {
+                r -= v->iov_len;
+                v++;
+                n--;
+            }
+            if(n > 0) {
+                v->iov_base = (char*) v->iov_base + r;
+                v->iov_len -= r;
+            }
+        }
+    }
+    return 0;
+#endif
+}
+
 
 int local_connect(int port) {
     return local_connect_arbitrary_ports(port-1, port);
@@ -356,7 +477,14 @@ static void remote_kick(atransport *t)
 
 static void remote_close(atransport *t)
 {
-    adb_close(t->fd);
+        /* normally remote_kick() has closed it already */
+    int fd = t->sfd;
+    if (fd != -1) {
+        t->sfd = -1;
+        adb_close(fd);
+    }
+    free(t->sbuf);
+    t->sbuf = NULL;
 }
 
 
@@ -410,8 +538,12 @@ int init_socket_transport(atransport *t, int s, int adb_port, int local)
     t->close = remote_close;
     t->read_from_remote = remote_read;
     t->write_to_remote = remote_write;
+    t->write_batch_to_remote = remote_write_batch;
     t->sfd = s;
     t->sync_token = 1;
+    t->max_payload = MAX_PAYLOAD_V1;
+    t->protocol_version = A_VERSION_MIN;
+    t->recv_version = A_VERSION_MIN;
     t->connection_state = CS_OFFLINE;
     t->type = kTransportLocal;
     t->adb_port = 0;
@@ -71,7 +71,7 @@ static int remote_read(apacket *p, atransport *t)
         }
     }
 
-    if(check_data(p)) {
+    if(check_data(p, t)) {
         D("remote usb: check_data failed\n");
         return -1;
     }
@@ -118,6 +118,9 @@ void init_usb_transport(atransport *t, usb_handle *h, int state)
     t->write_to_remote = remote_write;
     t->sync_token = 1;
     t->connection_state = state;
+    t->max_payload = MAX_PAYLOAD_V1;
+    t->protocol_version = A_VERSION_MIN;
+    t->recv_version = A_VERSION_MIN;
     t->type = kTransportUsb;
     t->usb = h;
 
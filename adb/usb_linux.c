@@ -45,6 +45,14 @@
 /* usb scan debugging is waaaay too verbose */
 #define DBGX(x...)
 
+/* a bulk transfer is split into URBs of at most USB_URB_SIZE bytes (the
+** old usbfs per-URB limit) and up to USB_URB_DEPTH of them are queued at
+** once, so the host controller always has the next one ready instead of
+** idling while we reap and resubmit.
+*/
+#define USB_URB_SIZE   16384
+#define USB_URB_DEPTH  8
+
 ADB_MUTEX_DEFINE( usb_lock );
 
 struct usb_handle
@@ -60,9 +68,10 @@ struct usb_handle
     unsigned zero_mask;
     unsigned writeable;
 
-    struct usbdevfs_urb urb_in;
-    struct usbdevfs_urb urb_out;
+    struct usbdevfs_urb urb_in[USB_URB_DEPTH];
+    struct usbdevfs_urb urb_out[USB_URB_DEPTH];
 
+        /* number of URBs of each direction still owned by the kernel */
     int urb_in_busy;
     int urb_out_busy;
     int dead;
@@ -308,19 +317,85 @@ void usb_cleanup()
 {
 }
 
+/* fill in up to USB_URB_DEPTH URBs covering the start of data; returns
+** how many were set up.  A zero length transfer still takes one URB.
+*/
+static int usb_fill_urbs(struct usbdevfs_urb *urbs, unsigned char ep,
+                         unsigned char *data, int len)
+{
+    int count = 0;
+
+    do {
+        struct usbdevfs_urb *urb = &urbs[count++];
+        int xfer = (len > USB_URB_SIZE) ? USB_URB_SIZE : len;
+
+        memset(urb, 0, sizeof(*urb));
+        urb->type = USBDEVFS_URB_TYPE_BULK;
+        urb->endpoint = ep;
+        urb->status = -1;
+        urb->buffer = data;
+        urb->buffer_length = xfer;
+
+        data += xfer;
+        len -= xfer;
+    } while (len > 0 && count < USB_URB_DEPTH);
+
+    return count;
+}
+
+/* submit urbs[0..count); on failure the ones already queued are
+** discarded again.  Called with h->lock held.
+*/
+static int usb_submit_urbs(usb_handle *h, struct usbdevfs_urb *urbs,
+                           int count, int *busy)
+{
+    int i, res;
+
+    for (i = 0; i < count; i++) {
+        do {
+            res = ioctl(h->desc, USBDEVFS_SUBMITURB, &urbs[i]);
+        } while((res < 0) && (errno == EINTR));
+
+        if (res < 0) {
+            D("[ submit urb %d/%d failed, errno = %d ]\n", i, count, errno);
+            while (i-- > 0) {
+                ioctl(h->desc, USBDEVFS_DISCARDURB, &urbs[i]);
+            }
+            return -1;
+        }
+        (*busy)++;
+    }
+    return 0;
+}
+
+/* bytes transferred by urbs[0..count) up to the first short or failed
+** one, or -1 if nothing at all got through
+*/
+static int usb_urbs_result(struct usbdevfs_urb *urbs, int count)
+{
+    int i, total = 0;
+
+    for (i = 0; i < count; i++) {
+        if (urbs[i].status != 0) {
+            return total ? total : -1;
+        }
+        total += urbs[i].actual_length;
+        if (urbs[i].actual_length != urbs[i].buffer_length) {
+            break;
+        }
+    }
+    return total;
+}
+
 static int usb_bulk_write(usb_handle *h, const void *data, int len)
 {
-    struct usbdevfs_urb *urb = &h->urb_out;
+    struct usbdevfs_urb *urbs = h->urb_out;
+    int count;
     int res;
     struct timeval tv;
     struct timespec ts;
 
-    memset(urb, 0, sizeof(*urb));
-    urb->type = USBDEVFS_URB_TYPE_BULK;
-    urb->endpoint = h->ep_out;
-    urb->status = -1;
-    urb->buffer = (void*) data;
-    urb->buffer_length = len;
+    count = usb_fill_urbs(urbs, h->ep_out, (unsigned char*) data, len);
 
     D("++ write ++\n");
 
@@ -329,16 +404,16 @@ static int usb_bulk_write(usb_handle *h, const void *data, int len)
         res = -1;
         goto fail;
     }
-    do {
-        res = ioctl(h->desc, USBDEVFS_SUBMITURB, urb);
-    } while((res < 0) && (errno == EINTR));
 
+    res = usb_submit_urbs(h, urbs, count, &h->urb_out_busy);
     if(res < 0) {
         goto fail;
     }
 
+        /* the reader thread reaps our URBs and wakes us when the
+        ** last one has come back
+        */
     res = -1;
-    h->urb_out_busy = 1;
     for(;;) {
         /* time out after five seconds */
         gettimeofday(&tv, NULL);
@@ -349,9 +424,7 @@ static int usb_bulk_write(usb_handle *h, const void *data, int len)
             break;
         }
         if(h->urb_out_busy == 0) {
-            if(urb->status == 0) {
-                res = urb->actual_length;
-            }
+            res = usb_urbs_result(urbs, count);
             break;
         }
     }
@@ -363,33 +436,26 @@ fail:
 
 static int usb_bulk_read(usb_handle *h, void *data, int len)
 {
-    struct usbdevfs_urb *urb = &h->urb_in;
+    struct usbdevfs_urb *urbs = h->urb_in;
     struct usbdevfs_urb *out = NULL;
+    int count;
     int res;
+    int i;
 
-    memset(urb, 0, sizeof(*urb));
-    urb->type = USBDEVFS_URB_TYPE_BULK;
-    urb->endpoint = h->ep_in;
-    urb->status = -1;
-    urb->buffer = data;
-    urb->buffer_length = len;
-
+    count = usb_fill_urbs(urbs, h->ep_in, data, len);
 
     adb_mutex_lock(&h->lock);
     if(h->dead) {
         res = -1;
         goto fail;
     }
-    do {
-        res = ioctl(h->desc, USBDEVFS_SUBMITURB, urb);
-    } while((res < 0) && (errno == EINTR));
 
+    res = usb_submit_urbs(h, urbs, count, &h->urb_in_busy);
     if(res < 0) {
         goto fail;
     }
 
-    h->urb_in_busy = 1;
-    for(;;) {
+    while(h->urb_in_busy > 0) {
         D("[ reap urb - wait ]\n");
         h->reaper_thread = pthread_self();
         adb_mutex_unlock(&h->lock);
@@ -399,34 +465,39 @@ static int usb_bulk_read(usb_handle *h, void *data, int len)
         h->reaper_thread = 0;
         if(h->dead) {
             res = -1;
-            break;
+            goto fail;
         }
         if(res < 0) {
             if(saved_errno == EINTR) {
                 continue;
             }
             D("[ reap urb - error ]\n");
-            break;
+            goto fail;
         }
         D("[ urb @%p status = %d, actual = %d ]\n",
             out, out->status, out->actual_length);
 
-        if(out == &h->urb_in) {
+        if(out >= h->urb_in && out < h->urb_in + USB_URB_DEPTH) {
             D("[ reap urb - IN complete ]\n");
-            h->urb_in_busy = 0;
-            if(urb->status == 0) {
-                res = urb->actual_length;
-            } else {
-                res = -1;
+            h->urb_in_busy--;
+
+                /* a short or failed URB ends the transfer; whatever is
+                ** still queued behind it would eat the next message
+                */
+            if(out->status != 0 ||
+               out->actual_length != out->buffer_length) {
+                for(i = (out - h->urb_in) + 1; i < count; i++) {
+                    ioctl(h->desc, USBDEVFS_DISCARDURB, &h->urb_in[i]);
+                }
             }
-            break;
-        }
-        if(out == &h->urb_out) {
+        } else if(out >= h->urb_out && out < h->urb_out + USB_URB_DEPTH) {
             D("[ reap urb - OUT compelete ]\n");
-            h->urb_out_busy = 0;
-            adb_cond_broadcast(&h->notify);
+            if(--h->urb_out_busy == 0) {
+                adb_cond_broadcast(&h->notify);
+            }
         }
     }
+    res = usb_urbs_result(urbs, count);
 fail:
     adb_mutex_unlock(&h->lock);
     return res;
@@ -450,7 +521,8 @@ int usb_write(usb_handle *h, const void *_data, int len)
     }
 
     while(len > 0) {
-        int xfer = (len > 4096) ? 4096 : len;
+        int xfer = (len > USB_URB_SIZE * USB_URB_DEPTH) ?
+                USB_URB_SIZE * USB_URB_DEPTH : len;
 
         n = usb_bulk_write(h, data, xfer);
         if(n != xfer) {
@@ -478,7 +550,8 @@ int usb_read(usb_handle *h, void *_data, int len)
 
     D("++ usb_read ++\n");
     while(len > 0) {
-        int xfer = (len > 4096) ? 4096 : len;
+        int xfer = (len > USB_URB_SIZE * USB_URB_DEPTH) ?
+                USB_URB_SIZE * USB_URB_DEPTH : len;
 
         D("[ usb read %d fd = %d], fname=%s\n", xfer, h->desc, h->fname);
         n = usb_bulk_read(h, data, xfer);
@@ -507,6 +580,8 @@ int usb_read(usb_handle *h, void *_data, int len)
 
 void usb_kick(usb_handle *h)
 {
+    int i;
+
     D("[ kicking %p (fd = %d) ]\n", h, h->desc);
     adb_mutex_lock(&h->lock);
     if(h->dead == 0) {
@@ -526,10 +601,12 @@ void usb_kick(usb_handle *h)
             ** but this ensures that a reader blocked on REAPURB
             ** will get unblocked
             */
-            ioctl(h->desc, USBDEVFS_DISCARDURB, &h->urb_in);
-            ioctl(h->desc, USBDEVFS_DISCARDURB, &h->urb_out);
-            h->urb_in.status = -ENODEV;
-            h->urb_out.status = -ENODEV;
+            for (i = 0; i < USB_URB_DEPTH; i++) {
+                ioctl(h->desc, USBDEVFS_DISCARDURB, &h->urb_in[i]);
+                ioctl(h->desc, USBDEVFS_DISCARDURB, &h->urb_out[i]);
+                h->urb_in[i].status = -ENODEV;
+                h->urb_out[i].status = -ENODEV;
+            }
             h->urb_in_busy = 0;
             h->urb_out_busy = 0;
             adb_cond_broadcast(&h->notify);
@@ -21,7 +21,9 @@
 
 #include <linux/usb/ch9.h>
 #include <linux/usb/functionfs.h>
+#include <linux/aio_abi.h>
 #include <sys/ioctl.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <dirent.h>
 #include <errno.h>
@@ -34,6 +36,27 @@
 #define MAX_PACKET_SIZE_FS	64
 #define MAX_PACKET_SIZE_HS	512
 
+/* f_adb rejects reads larger than its 4K request buffer, and functionfs
+** has to kmalloc a bounce buffer for each transfer; keep both small now
+** that a single apacket may carry up to MAX_PAYLOAD bytes.
+*/
+#define USB_ADB_MAX_READ        MAX_PAYLOAD_V1
+#define USB_FFS_MAX_BULK_SIZE   (16 * 1024)
+
+/* functionfs endpoints take AIO, which lets us keep this many bulk
+** requests queued on the UDC rather than one at a time
+*/
+#define USB_FFS_AIO_DEPTH       8
+
+struct usb_ffs_aio
+{
+    aio_context_t ctx;      /* 0 when AIO is unavailable */
+    int verified;           /* a submit has succeeded on this context */
+    struct iocb iocb[USB_FFS_AIO_DEPTH];
+    struct iocb *iocbs[USB_FFS_AIO_DEPTH];
+    struct io_event events[USB_FFS_AIO_DEPTH];
+};
+
 #define cpu_to_le16(x)  htole16(x)
 #define cpu_to_le32(x)  htole32(x)
 
@@ -53,6 +76,10 @@ struct usb_handle
     int control;
     int bulk_out; /* "out" from the host's perspective => source for adbd */
     int bulk_in;  /* "in" from the host's perspective => sink for adbd */
+
+    // one context per direction: reads and writes run on different threads
+    struct usb_ffs_aio read_aio;
+    struct usb_ffs_aio write_aio;
 };
 
 static const struct {
@@ -247,16 +274,23 @@ static int usb_adb_write(usb_handle *h, const void *data, int len)
     return 0;
 }
 
-static int usb_adb_read(usb_handle *h, void *data, int len)
+static int usb_adb_read(usb_handle *h, void *_data, int len)
 {
+    char *data = _data;
     int n;
 
     D("about to read (fd=%d, len=%d)\n", h->fd, len);
-    n = adb_read(h->fd, data, len);
-    if(n != len) {
-        D("ERROR: fd = %d, n = %d, errno = %d (%s)\n",
-            h->fd, n, errno, strerror(errno));
-        return -1;
+    while (len > 0) {
+        int xfer = (len > USB_ADB_MAX_READ) ? USB_ADB_MAX_READ : len;
+
+        n = adb_read(h->fd, data, xfer);
+        if(n != xfer) {
+            D("ERROR: fd = %d, n = %d, errno = %d (%s)\n",
+                h->fd, n, errno, strerror(errno));
+            return -1;
+        }
+        len -= xfer;
+        data += xfer;
     }
     D("[ done fd=%d ]\n", h->fd);
     return 0;
@@ -398,7 +432,11 @@ static int bulk_write(int bulk_in, const char *buf, size_t length)
     int ret;
 
     do {
-        ret = adb_write(bulk_in, buf + count, length - count);
+        size_t xfer = length - count;
+
+        if (xfer > USB_FFS_MAX_BULK_SIZE)
+            xfer = USB_FFS_MAX_BULK_SIZE;
+        ret = adb_write(bulk_in, buf + count, xfer);
         if (ret < 0) {
             if (errno != EINTR)
                 return ret;
@@ -411,12 +449,110 @@ static int bulk_write(int bulk_in, const char *buf, size_t length)
     return count;
 }
 
+static void usb_ffs_aio_init(struct usb_ffs_aio *aio)
+{
+    aio->ctx = 0;
+    if (syscall(__NR_io_setup, USB_FFS_AIO_DEPTH, &aio->ctx) < 0) {
+        D("[ io_setup failed, errno=%d; using synchronous transfers ]\n", errno);
+        aio->ctx = 0;
+    }
+}
+
+/* move length bytes through fd with up to USB_FFS_AIO_DEPTH requests in
+** flight.  A read request that completes short (e.g. on a zero length
+** packet) leaves a hole, so the bytes that landed in later requests are
+** slid down to keep the buffer contiguous.  If the kernel turns out not
+** to support AIO on the endpoint, aio->ctx is cleared and -1 returned
+** before anything was queued so the caller can fall back.
+*/
+static int bulk_aio(struct usb_ffs_aio *aio, int fd, unsigned opcode,
+                    char *buf, size_t length)
+{
+    size_t count = 0;
+    size_t got[USB_FFS_AIO_DEPTH];
+    int n, i, done, ret;
+
+    while (count < length) {
+        size_t queued = count;
+
+        for (n = 0; n < USB_FFS_AIO_DEPTH && queued < length; n++) {
+            struct iocb *cb = &aio->iocb[n];
+            size_t xfer = length - queued;
+
+            if (xfer > USB_FFS_MAX_BULK_SIZE)
+                xfer = USB_FFS_MAX_BULK_SIZE;
+            memset(cb, 0, sizeof(*cb));
+            cb->aio_data = n;
+            cb->aio_fildes = fd;
+            cb->aio_lio_opcode = opcode;
+            cb->aio_buf = (uintptr_t) (buf + queued);
+            cb->aio_nbytes = xfer;
+            aio->iocbs[n] = cb;
+            queued += xfer;
+        }
+
+        do {
+            ret = syscall(__NR_io_submit, aio->ctx, n, aio->iocbs);
+        } while (ret < 0 && errno == EINTR);
+        if (ret < 0) {
+            if (errno == EINVAL && !aio->verified) {
+                D("[ fd=%d: no AIO support, using synchronous transfers ]\n", fd);
+                syscall(__NR_io_destroy, aio->ctx);
+                aio->ctx = 0;
+            }
+            return -1;
+        }
+        aio->verified = 1;
+        n = ret;
+
+        for (done = 0; done < n; ) {
+            ret = syscall(__NR_io_getevents, aio->ctx, n - done, n - done,
+                          aio->events + done, NULL);
+            if (ret < 0) {
+                if (errno == EINTR)
+                    continue;
+                D("[ io_getevents failed fd=%d errno=%d ]\n", fd, errno);
+                return -1;
+            }
+            done += ret;
+        }
+
+        for (i = 0; i < n; i++) {
+            struct io_event *ev = &aio->events[i];
+            if ((long long) ev->res < 0) {
+                errno = -(long long) ev->res;
+                D("[ bulk aio failed fd=%d length=%d count=%d ]\n",
+                                           fd, (int) length, (int) count);
+                return -1;
+            }
+            got[ev->data] = ev->res;
+        }
+
+        for (i = 0; i < n; i++) {
+            char *src = (char*) (uintptr_t) aio->iocb[i].aio_buf;
+            if (opcode == IOCB_CMD_PWRITE && got[i] != aio->iocb[i].aio_nbytes) {
+                errno = EIO;
+                return -1;
+            }
+            if (src != buf + count)
+                memmove(buf + count, src, got[i]);
+            count += got[i];
+        }
+    }
+
+    return count;
+}
+
 static int usb_ffs_write(usb_handle *h, const void *data, int len)
 {
-    int n;
+    int n = -1;
 
     D("about to write (fd=%d, len=%d)\n", h->bulk_in, len);
-    n = bulk_write(h->bulk_in, data, len);
+    if (h->write_aio.ctx)
+        n = bulk_aio(&h->write_aio, h->bulk_in, IOCB_CMD_PWRITE,
+                     (char*) data, len);
+    if (!h->write_aio.ctx)
+        n = bulk_write(h->bulk_in, data, len);
     if (n != len) {
         D("ERROR: fd = %d, n = %d, errno = %d (%s)\n",
             h->bulk_in, n, errno, strerror(errno));
@@ -432,7 +568,11 @@ static int bulk_read(int bulk_out, char *buf, size_t length)
     int ret;
 
     do {
-        ret = adb_read(bulk_out, buf + count, length - count);
+        size_t xfer = length - count;
+
+        if (xfer > USB_FFS_MAX_BULK_SIZE)
+            xfer = USB_FFS_MAX_BULK_SIZE;
+        ret = adb_read(bulk_out, buf + count, xfer);
         if (ret < 0) {
             if (errno != EINTR) {
                 D("[ bulk_read failed fd=%d length=%d count=%d ]\n",
@@ -452,7 +592,11 @@ static int usb_ffs_read(usb_handle *h, void *data, int len)
     int n;
 
     D("about to read (fd=%d, len=%d)\n", h->bulk_out, len);
-    n = bulk_read(h->bulk_out, data, len);
+    n = -1;
+    if (h->read_aio.ctx)
+        n = bulk_aio(&h->read_aio, h->bulk_out, IOCB_CMD_PREAD, data, len);
+    if (!h->read_aio.ctx)
+        n = bulk_read(h->bulk_out, data, len);
     if (n != len) {
         D("ERROR: fd = %d, n = %d, errno = %d (%s)\n",
             h->bulk_out, n, errno, strerror(errno));
@@ -505,6 +649,9 @@ static void usb_ffs_init()
     h->bulk_out = -1;
     h->bulk_out = -1;
 
+    usb_ffs_aio_init(&h->read_aio);
+    usb_ffs_aio_init(&h->write_aio);
+
     adb_cond_init(&h->notify, 0);
     adb_mutex_init(&h->lock, 0);
 
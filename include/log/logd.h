@@ -42,6 +42,94 @@ int __android_log_bwrite(int32_t tag, const void *payload, size_t len);
 int __android_log_btwrite(int32_t tag, char type, const void *payload,
     size_t len);
 
+/*
+ * Building a structured binary event without packing bytes by hand.  The
+ * builder lives on the caller's stack and writes into a caller-supplied
+ * buffer; nothing is allocated.
+ *
+ *     unsigned char buf[ANDROID_LOG_EVENT_BUF_SIZE];
+ *     struct android_log_event_builder b;
+ *
+ *     __android_log_event_init(&b, tag, buf, sizeof(buf));
+ *     __android_log_event_append_int(&b, uid);
+ *     __android_log_event_append_string(&b, name);
+ *     __android_log_event_begin_list(&b);
+ *     __android_log_event_append_long(&b, start);
+ *     __android_log_event_append_long(&b, end);
+ *     __android_log_event_end_list(&b);
+ *     __android_log_event_write(&b);
+ *
+ * An event carrying a single value is written as that value; one with
+ * several top-level values is written as a list of them, the way
+ * EventLog.writeEvent(int, Object...) does.  A list holds at most 255
+ * values and lists nest ANDROID_LOG_EVENT_MAX_DEPTH deep.
+ *
+ * The append calls return 0, or -1 once the event no longer fits or is
+ * malformed.  Errors are sticky, so a sequence of appends can be checked
+ * once: __android_log_event_write() then writes nothing and returns
+ * -ENOSPC (out of room) or -EINVAL (bad nesting).
+ */
+#define ANDROID_LOG_EVENT_MAX_DEPTH     8
+#define ANDROID_LOG_EVENT_BUF_SIZE      (4076 - 4)  /* max payload less tag */
+
+struct android_log_event_builder {
+    int32_t tag;
+    unsigned char *buf;
+    size_t size;
+    size_t pos;
+    int depth;
+    int error;
+    size_t count_pos[ANDROID_LOG_EVENT_MAX_DEPTH + 1];  /* the count bytes */
+};
+
+void __android_log_event_init(struct android_log_event_builder *b,
+    int32_t tag, void *buf, size_t size);
+int __android_log_event_append_int(struct android_log_event_builder *b,
+    int32_t value);
+int __android_log_event_append_long(struct android_log_event_builder *b,
+    int64_t value);
+int __android_log_event_append_string(struct android_log_event_builder *b,
+    const char *value);
+int __android_log_event_append_stringn(struct android_log_event_builder *b,
+    const char *value, size_t len);
+int __android_log_event_begin_list(struct android_log_event_builder *b);
+int __android_log_event_end_list(struct android_log_event_builder *b);
+
+/*
+ * Returns the finished payload (without the tag) and its length, or NULL
+ * if the event is malformed or overflowed.
+ */
+const void *__android_log_event_payload(struct android_log_event_builder *b,
+    size_t *len);
+
+/* writes the event to the events log */
+int __android_log_event_write(struct android_log_event_builder *b);
+
+/*
+ * Asynchronous logging, off unless the process turns it on.  Once started,
+ * every thread copies its messages into a ring of its own (ring_size
+ * bytes, rounded up to a power of two, at most 1MB), and a background
+ * thread writes them to the log devices in each thread's order.  A
+ * message that does not fit in its ring is dropped and counted; the
+ * flusher logs how many were lost.  Fatal messages, and
+ * __android_log_assert(), flush everything queued and are written
+ * directly.  Returns 0 once started (or if already running), -1 if there
+ * is no log device or no thread support.
+ */
+int __android_log_async_start(size_t ring_size);
+
+/* write out everything queued so far, from the calling thread */
+void __android_log_async_flush(void);
+
+struct android_log_async_stats {
+    uint64_t queued;    /* messages put in a ring */
+    uint64_t written;   /* messages the flusher wrote */
+    uint64_t dropped;   /* messages lost to a full ring */
+    uint32_t rings;     /* threads with a ring */
+};
+
+void __android_log_async_get_stats(struct android_log_async_stats *stats);
+
 #ifdef __cplusplus
 }
 #endif
@@ -119,6 +119,76 @@ int android_log_processBinaryLogBuffer(struct logger_entry *buf,
     AndroidLogEntry *entry, const EventTagMap* map, char* messageBuf,
     int messageBufLen);
 
+/**
+ * Walks the values of a binary event without copying or formatting them.
+ * Values come back in the order they were written, each list ahead of its
+ * contents: "depth" is how deeply a value is nested, and a list's "value"
+ * is how many values follow it one level deeper.  Strings point into the
+ * entry and are not NUL-terminated; their "value" is the length.
+ */
+typedef struct AndroidEventValue_t {
+    AndroidEventLogType type;
+    int depth;
+    int64_t value;          /* int, long, string length or list count */
+    const char *str;        /* EVENT_TYPE_STRING only */
+} AndroidEventValue;
+
+typedef struct AndroidEventReader_t {
+    int32_t tag;
+    const unsigned char *pos;
+    const unsigned char *end;
+    int depth;
+    unsigned int left[ANDROID_LOG_EVENT_MAX_DEPTH + 1];
+} AndroidEventReader;
+
+/**
+ * Returns 0, or -1 if the entry is too short to hold an event tag
+ */
+int android_log_eventReaderInit(AndroidEventReader *reader,
+    const struct logger_entry *buf);
+
+/**
+ * Returns 1 with the next value in *value, 0 at the end of the event,
+ * or -1 on a malformed or too deeply nested event
+ */
+int android_log_eventReaderNext(AndroidEventReader *reader,
+    AndroidEventValue *value);
+
+/**
+ * Binary events decoded straight into columns.  The caller supplies each
+ * array along with the capacities; any array may be NULL if that column
+ * is not wanted.  Every decoded event adds one row, whose values are
+ * value rows firstValue .. firstValue + valueCount - 1, in reader order.
+ * str[] points into the log entries, which must outlive the columns.
+ */
+typedef struct AndroidEventColumns_t {
+    size_t maxEvents;
+    size_t numEvents;
+    int32_t *tag;
+    int32_t *sec;
+    int32_t *nsec;
+    int32_t *pid;
+    int32_t *tid;
+    uint32_t *firstValue;
+    uint32_t *valueCount;
+
+    size_t maxValues;
+    size_t numValues;
+    uint8_t *type;
+    uint8_t *depth;
+    int64_t *value;
+    const char **str;
+} AndroidEventColumns;
+
+/**
+ * Appends one binary log entry to the columns.
+ *
+ * Returns 0 on success, 1 if the columns are full and -1 on a malformed
+ * event; in both of the latter cases nothing is appended.
+ */
+int android_log_decodeEventColumns(AndroidEventColumns *columns,
+    const struct logger_entry *buf);
+
 
 /**
  * Formats a log message into a buffer
@@ -26,6 +26,9 @@
 #include <stdarg.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
 
 #include <log/logger.h>
 #include <log/logd.h>
@@ -95,7 +98,7 @@ static int __write_to_log_kernel(log_id_t log_id, struct iovec *vec, size_t nr)
     return ret;
 }
 
-static int __write_to_log_init(log_id_t log_id, struct iovec *vec, size_t nr)
+static void __write_to_log_open(void)
 {
 #ifdef HAVE_PTHREADS
     pthread_mutex_lock(&log_init_lock);
@@ -128,10 +131,386 @@ static int __write_to_log_init(log_id_t log_id, struct iovec *vec, size_t nr)
 #ifdef HAVE_PTHREADS
     pthread_mutex_unlock(&log_init_lock);
 #endif
+}
+
+static int __write_to_log_init(log_id_t log_id, struct iovec *vec, size_t nr)
+{
+    __write_to_log_open();
 
     return write_to_log(log_id, vec, nr);
 }
 
+#ifdef HAVE_PTHREADS
+
+/*
+ * Asynchronous mode.  Each thread gets a single-producer ring; the flusher
+ * thread is the only consumer (anyone draining takes async_flush_lock).
+ * Head and tail only ever grow, and are published with full barriers the
+ * same way on both sides.  A record is a 32-bit header, (log_id << 16) |
+ * length, followed by the message bytes padded to 4; a header of
+ * ASYNC_WRAP means the rest of the ring up to its end is unused.
+ *
+ * The kernel logger makes one entry per write and stamps it when it is
+ * written, so the flusher issues one writev() per record.  What moves off
+ * the caller's path is the syscall itself; to keep the stamps close, the
+ * flusher is woken by the first record after it went idle rather than
+ * on a timer.
+ */
+#define ASYNC_MAX_RINGS     64      /* threads beyond this log directly */
+#define ASYNC_MIN_RING      (8 * 1024)
+#define ASYNC_MAX_RING      (1024 * 1024)
+#define ASYNC_WRAP          0xffffffffu
+#define ASYNC_ALIGN(n)      (((n) + 3) & ~3u)
+
+typedef struct log_ring_t {
+    struct log_ring_t *next;
+    volatile uint32_t head;     /* written by the owning thread */
+    volatile uint32_t tail;     /* written by the flusher */
+    volatile uint32_t queued;   /* owning thread's counters */
+    volatile uint32_t dropped;
+    uint32_t reported;          /* drops the flusher already logged */
+    volatile int dead;          /* owning thread has exited */
+    pid_t tid;
+    uint32_t size;              /* power of two */
+    unsigned char buf[];
+} log_ring_t;
+
+static int (*async_write_direct)(log_id_t, struct iovec *vec, size_t nr);
+static size_t async_ring_size;
+static volatile int async_running = 0;
+static pthread_key_t async_key;
+static log_ring_t async_no_ring;    /* marks threads past ASYNC_MAX_RINGS */
+
+static pthread_mutex_t async_list_lock = PTHREAD_MUTEX_INITIALIZER;
+static log_ring_t *async_rings = NULL;
+static uint32_t async_ring_count = 0;
+static uint64_t async_retired_queued = 0;   /* from freed rings */
+static uint64_t async_retired_dropped = 0;
+
+static pthread_mutex_t async_flush_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t async_written = 0;
+
+static pthread_mutex_t async_wake_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t async_wake_cond = PTHREAD_COND_INITIALIZER;
+static volatile int async_wake = 0;
+
+static pid_t async_gettid(void)
+{
+#if defined(__linux__) && defined(__NR_gettid)
+    return syscall(__NR_gettid);
+#else
+    return getpid();
+#endif
+}
+
+static void async_thread_exit(void *arg)
+{
+    log_ring_t *ring = arg;
+
+    __sync_synchronize();
+    ring->dead = 1;
+}
+
+/* Writes out whatever the ring holds; caller holds async_flush_lock. */
+static void async_ring_drain(log_ring_t *ring)
+{
+    uint32_t mask = ring->size - 1;
+    uint32_t tail = ring->tail;
+    uint32_t head, hdr, off, dropped;
+    struct iovec iov;
+
+    __sync_synchronize();
+    head = ring->head;
+    __sync_synchronize();
+
+    while (tail != head) {
+        off = tail & mask;
+        hdr = *(uint32_t *)(ring->buf + off);
+        if (hdr == ASYNC_WRAP) {
+            tail += ring->size - off;
+            continue;
+        }
+        iov.iov_base = ring->buf + off + 4;
+        iov.iov_len = hdr & 0xffff;
+        async_write_direct((log_id_t)(hdr >> 16), &iov, 1);
+        async_written++;
+        tail += 4 + ASYNC_ALIGN(hdr & 0xffff);
+
+        __sync_synchronize();
+        ring->tail = tail;
+    }
+
+    dropped = ring->dropped;
+    if (dropped != ring->reported) {
+        char msg[64];
+        unsigned char prio = ANDROID_LOG_WARN;
+        struct iovec vec[3];
+
+        snprintf(msg, sizeof(msg), "dropped %u messages from tid %d",
+                dropped - ring->reported, (int)ring->tid);
+        vec[0].iov_base = &prio;
+        vec[0].iov_len = 1;
+        vec[1].iov_base = (void *)"liblog";
+        vec[1].iov_len = sizeof("liblog");
+        vec[2].iov_base = msg;
+        vec[2].iov_len = strlen(msg) + 1;
+        async_write_direct(LOG_ID_MAIN, vec, 3);
+        ring->reported = dropped;
+    }
+}
+
+static void async_drain_all(void)
+{
+    log_ring_t **pp, *ring;
+
+    pthread_mutex_lock(&async_flush_lock);
+    pthread_mutex_lock(&async_list_lock);
+    for (pp = &async_rings; (ring = *pp) != NULL; ) {
+        int dead = ring->dead;
+
+        async_ring_drain(ring);
+        if (dead && ring->tail == ring->head) {
+            *pp = ring->next;
+            async_ring_count--;
+            async_retired_queued += ring->queued;
+            async_retired_dropped += ring->dropped;
+            free(ring);
+        } else {
+            pp = &ring->next;
+        }
+    }
+    pthread_mutex_unlock(&async_list_lock);
+    pthread_mutex_unlock(&async_flush_lock);
+}
+
+static log_ring_t *async_ring_get(void)
+{
+    log_ring_t *ring = pthread_getspecific(async_key);
+
+    if (ring != NULL) {
+        return ring != &async_no_ring ? ring : NULL;
+    }
+
+    pthread_mutex_lock(&async_list_lock);
+    if (async_ring_count >= ASYNC_MAX_RINGS) {
+            /* rings of exited threads count until the flusher frees them */
+        pthread_mutex_unlock(&async_list_lock);
+        async_drain_all();
+        pthread_mutex_lock(&async_list_lock);
+    }
+    if (async_ring_count < ASYNC_MAX_RINGS) {
+        ring = calloc(1, sizeof(log_ring_t) + async_ring_size);
+    }
+    if (ring != NULL) {
+        ring->tid = async_gettid();
+        ring->size = async_ring_size;
+        ring->next = async_rings;
+        async_rings = ring;
+        async_ring_count++;
+        pthread_setspecific(async_key, ring);
+    } else {
+        pthread_setspecific(async_key, &async_no_ring);
+    }
+    pthread_mutex_unlock(&async_list_lock);
+
+    return ring;
+}
+
+static void *async_flusher(void *arg)
+{
+    for (;;) {
+        pthread_mutex_lock(&async_wake_lock);
+        while (!async_wake) {
+            pthread_cond_wait(&async_wake_cond, &async_wake_lock);
+        }
+        async_wake = 0;
+        pthread_mutex_unlock(&async_wake_lock);
+        __sync_synchronize();
+
+        async_drain_all();
+    }
+    return NULL;
+}
+
+static int __write_to_log_async(log_id_t log_id, struct iovec *vec, size_t nr)
+{
+    log_ring_t *ring;
+    uint32_t mask, head, tail, off, len, need, skip;
+    unsigned char *p;
+    size_t i, total;
+
+    if ((int)log_id >= (int)LOG_ID_MAX) {
+        return -EBADF;
+    }
+
+        /* whatever comes right before a crash must not be left queued */
+    if (log_id != LOG_ID_EVENTS && nr > 0 && vec[0].iov_len == 1
+            && *(unsigned char *)vec[0].iov_base >= ANDROID_LOG_FATAL) {
+        __android_log_async_flush();
+        return async_write_direct(log_id, vec, nr);
+    }
+
+    ring = async_ring_get();
+    if (ring == NULL) {
+        return async_write_direct(log_id, vec, nr);
+    }
+
+    for (total = 0, i = 0; i < nr; i++) {
+        total += vec[i].iov_len;
+    }
+        /* the driver would truncate it the same way */
+    len = total < LOGGER_ENTRY_MAX_PAYLOAD ? total : LOGGER_ENTRY_MAX_PAYLOAD;
+
+    mask = ring->size - 1;
+    head = ring->head;
+    tail = ring->tail;
+    __sync_synchronize();
+
+    off = head & mask;
+    need = 4 + ASYNC_ALIGN(len);
+    skip = (ring->size - off < need) ? ring->size - off : 0;
+    if (head + skip + need - tail > ring->size) {
+        ring->dropped++;
+        return -EAGAIN;
+    }
+    if (skip) {
+        *(uint32_t *)(ring->buf + off) = ASYNC_WRAP;
+        head += skip;
+        off = 0;
+    }
+
+    *(uint32_t *)(ring->buf + off) = ((uint32_t)log_id << 16) | len;
+    p = ring->buf + off + 4;
+    for (i = 0; i < nr && len > 0; i++) {
+        size_t n = vec[i].iov_len < len ? vec[i].iov_len : len;
+        memcpy(p, vec[i].iov_base, n);
+        p += n;
+        len -= n;
+    }
+
+    __sync_synchronize();
+    ring->head = head + need;
+    ring->queued++;
+    __sync_synchronize();
+
+    if (!async_wake) {
+        pthread_mutex_lock(&async_wake_lock);
+        async_wake = 1;
+        pthread_cond_signal(&async_wake_cond);
+        pthread_mutex_unlock(&async_wake_lock);
+    }
+
+    return total;
+}
+
+static void async_atfork_child(void)
+{
+        /* the flusher did not come along; the locks may be held by threads
+         * that did not either, so go back to writing directly */
+    async_running = 0;
+    write_to_log = async_write_direct;
+}
+
+int __android_log_async_start(size_t ring_size)
+{
+    pthread_attr_t attr;
+    pthread_t thread;
+    size_t size;
+    int ret = 0;
+
+    if (write_to_log == __write_to_log_init) {
+        __write_to_log_open();
+    }
+
+    pthread_mutex_lock(&log_init_lock);
+    if (async_running) {
+        goto done;
+    }
+    if (write_to_log == __write_to_log_null) {
+        ret = -1;
+        goto done;
+    }
+
+    if (ring_size > ASYNC_MAX_RING) {
+        ring_size = ASYNC_MAX_RING;
+    }
+    for (size = ASYNC_MIN_RING; size < ring_size; size <<= 1)
+        ;
+    async_ring_size = size;
+    async_write_direct = write_to_log;
+
+    if (pthread_key_create(&async_key, async_thread_exit) != 0) {
+        ret = -1;
+        goto done;
+    }
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, async_flusher, NULL) != 0) {
+        pthread_attr_destroy(&attr);
+        pthread_key_delete(async_key);
+        ret = -1;
+        goto done;
+    }
+    pthread_attr_destroy(&attr);
+
+    pthread_atfork(NULL, NULL, async_atfork_child);
+    atexit(__android_log_async_flush);
+
+    async_running = 1;
+    write_to_log = __write_to_log_async;
+
+done:
+    pthread_mutex_unlock(&log_init_lock);
+    return ret;
+}
+
+void __android_log_async_flush(void)
+{
+    if (async_running) {
+        async_drain_all();
+    }
+}
+
+void __android_log_async_get_stats(struct android_log_async_stats *stats)
+{
+    log_ring_t *ring;
+
+    memset(stats, 0, sizeof(*stats));
+
+    pthread_mutex_lock(&async_list_lock);
+    stats->queued = async_retired_queued;
+    stats->dropped = async_retired_dropped;
+    for (ring = async_rings; ring != NULL; ring = ring->next) {
+        stats->queued += ring->queued;
+        stats->dropped += ring->dropped;
+        stats->rings++;
+    }
+    pthread_mutex_unlock(&async_list_lock);
+
+    pthread_mutex_lock(&async_flush_lock);
+    stats->written = async_written;
+    pthread_mutex_unlock(&async_flush_lock);
+}
+
+#else /* !HAVE_PTHREADS */
+
+int __android_log_async_start(size_t ring_size)
+{
+    return -1;
+}
+
+void __android_log_async_flush(void)
+{
+}
+
+void __android_log_async_get_stats(struct android_log_async_stats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+}
+
+#endif /* HAVE_PTHREADS */
+
 int __android_log_write(int prio, const char *tag, const char *msg)
 {
     struct iovec vec[3];
@@ -257,6 +636,7 @@ void __android_log_assert(const char *cond, const char *tag,
     }
 
     __android_log_write(ANDROID_LOG_FATAL, tag, buf);
+    __android_log_async_flush();
 
     __builtin_trap(); /* trap so we have a chance to debug the situation */
 }
@@ -292,3 +672,175 @@ int __android_log_btwrite(int32_t tag, char type, const void *payload,
 
     return write_to_log(LOG_ID_EVENTS, vec, 3);
 }
+
+/*
+ * Structured event builder.  buf[0..1] is always reserved for a top-level
+ * list header; if the event ends up holding a single value the payload
+ * starts after it, so that value is written bare.
+ */
+static int event_fail(struct android_log_event_builder *b, int error)
+{
+    if (b->error == 0) {
+        b->error = error;
+    }
+    return -1;
+}
+
+static unsigned char *event_reserve(struct android_log_event_builder *b,
+    size_t len)
+{
+    unsigned char *p;
+    size_t count_pos;
+
+    if (b->error) {
+        return NULL;
+    }
+    count_pos = b->count_pos[b->depth];
+    if (b->buf[count_pos] == 255) {
+        event_fail(b, -EINVAL);
+        return NULL;
+    }
+    if (len > b->size - b->pos) {
+        event_fail(b, -ENOSPC);
+        return NULL;
+    }
+    b->buf[count_pos]++;
+    p = b->buf + b->pos;
+    b->pos += len;
+    return p;
+}
+
+static void event_put4LE(unsigned char *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+void __android_log_event_init(struct android_log_event_builder *b,
+    int32_t tag, void *buf, size_t size)
+{
+    memset(b, 0, sizeof(*b));
+    b->tag = tag;
+    b->buf = buf;
+    b->size = size;
+    if (size < 2) {
+        b->error = -ENOSPC;
+        return;
+    }
+    b->buf[0] = EVENT_TYPE_LIST;
+    b->buf[1] = 0;
+    b->count_pos[0] = 1;
+    b->pos = 2;
+}
+
+int __android_log_event_append_int(struct android_log_event_builder *b,
+    int32_t value)
+{
+    unsigned char *p = event_reserve(b, 1 + 4);
+
+    if (p == NULL) {
+        return -1;
+    }
+    p[0] = EVENT_TYPE_INT;
+    event_put4LE(p + 1, value);
+    return 0;
+}
+
+int __android_log_event_append_long(struct android_log_event_builder *b,
+    int64_t value)
+{
+    unsigned char *p = event_reserve(b, 1 + 8);
+
+    if (p == NULL) {
+        return -1;
+    }
+    p[0] = EVENT_TYPE_LONG;
+    event_put4LE(p + 1, (uint64_t)value);
+    event_put4LE(p + 5, (uint64_t)value >> 32);
+    return 0;
+}
+
+int __android_log_event_append_stringn(struct android_log_event_builder *b,
+    const char *value, size_t len)
+{
+    unsigned char *p;
+
+    if (len > b->size) {
+        return event_fail(b, -ENOSPC);
+    }
+    p = event_reserve(b, 1 + 4 + len);
+    if (p == NULL) {
+        return -1;
+    }
+    p[0] = EVENT_TYPE_STRING;
+    event_put4LE(p + 1, len);
+    memcpy(p + 5, value, len);
+    return 0;
+}
+
+int __android_log_event_append_string(struct android_log_event_builder *b,
+    const char *value)
+{
+    if (value == NULL) {
+        value = "NULL";
+    }
+    return __android_log_event_append_stringn(b, value, strlen(value));
+}
+
+int __android_log_event_begin_list(struct android_log_event_builder *b)
+{
+    unsigned char *p;
+
+    if (b->depth == ANDROID_LOG_EVENT_MAX_DEPTH) {
+        return event_fail(b, -EINVAL);
+    }
+    p = event_reserve(b, 1 + 1);
+    if (p == NULL) {
+        return -1;
+    }
+    p[0] = EVENT_TYPE_LIST;
+    p[1] = 0;
+    b->count_pos[++b->depth] = p + 1 - b->buf;
+    return 0;
+}
+
+int __android_log_event_end_list(struct android_log_event_builder *b)
+{
+    if (b->depth == 0) {
+        return event_fail(b, -EINVAL);
+    }
+    b->depth--;
+    return b->error ? -1 : 0;
+}
+
+const void *__android_log_event_payload(struct android_log_event_builder *b,
+    size_t *len)
+{
+    if (b->error == 0 && b->depth != 0) {
+        b->error = -EINVAL;
+    }
+    if (b->error) {
+        *len = 0;
+        return NULL;
+    }
+    if (b->buf[1] == 1) {
+        *len = b->pos - 2;
+        return b->buf + 2;
+    }
+    *len = b->pos;
+    return b->buf;
+}
+
+int __android_log_event_write(struct android_log_event_builder *b)
+{
+    const void *payload;
+    size_t len;
+
+    payload = __android_log_event_payload(b, &len);
+    if (payload == NULL) {
+        return b->error;
+    }
+    return __android_log_bwrite(b->tag, payload, len);
+}
@@ -32,13 +32,53 @@
 typedef struct FilterInfo_t {
     char *mTag;
     android_LogPriority mPri;
+    uint32_t mHash;
+    int mPrefix;    /* "tag*": applies to every tag starting with mTag */
     struct FilterInfo_t *p_next;
 } FilterInfo;
 
+/*
+ * Prefix rules, one node per character.  The deepest node with a rule
+ * along a tag's path is its longest matching prefix.
+ */
+typedef struct FilterTrie_t {
+    char c;
+    android_LogPriority pri;    /* ANDROID_LOG_UNKNOWN: no rule ends here */
+    struct FilterTrie_t *child;
+    struct FilterTrie_t *sibling;
+} FilterTrie;
+
+/* tags resolved recently, so the common case is one hash and one strcmp */
+#define FILTER_CACHE_SIZE    64
+#define FILTER_CACHE_TAG_MAX 32
+
+typedef struct FilterCacheEntry_t {
+    uint32_t hash;
+    android_LogPriority pri;
+    char tag[FILTER_CACHE_TAG_MAX];
+} FilterCacheEntry;
+
 struct AndroidLogFormat_t {
     android_LogPriority global_pri;
     FilterInfo *filters;
     AndroidLogPrintFormat format;
+
+    /*
+     * Exact-tag rules, open addressed on mHash.  Each slot holds the most
+     * recent rule for its tag, which is the one the list lookup used to
+     * find first.
+     */
+    FilterInfo **filter_table;
+    size_t filter_table_size;   /* power of two */
+    size_t filter_table_count;
+
+    FilterTrie *prefix_trie;
+    FilterCacheEntry filter_cache[FILTER_CACHE_SIZE];
+
+    /* "%m-%d %H:%M:%S" of time_sec, reused for every line in that second */
+    int time_valid;
+    time_t time_sec;
+    char time_buf[32];
 };
 
 static FilterInfo * filterinfo_new(const char * tag, android_LogPriority pri)
@@ -62,6 +102,136 @@ static void filterinfo_free(FilterInfo *p_info)
     p_info->mTag = NULL;
 }
 
+/* FNV-1a; never 0, which marks an empty filter cache slot */
+static uint32_t filterHash(const char *tag)
+{
+    uint32_t h = 2166136261u;
+
+    while (*tag) {
+        h = (h ^ (uint8_t)*tag++) * 16777619u;
+    }
+    return h ? h : 1;
+}
+
+static int filterTableInsert(AndroidLogFormat *p_format, FilterInfo *p_fi)
+{
+    size_t i, mask;
+
+    if ((p_format->filter_table_count + 1) * 2 > p_format->filter_table_size) {
+        size_t oldSize = p_format->filter_table_size;
+        FilterInfo **oldTable = p_format->filter_table;
+        size_t newSize = oldSize ? oldSize * 2 : 64;
+        FilterInfo **newTable = calloc(newSize, sizeof(FilterInfo *));
+
+        if (newTable == NULL) {
+            return -1;
+        }
+        p_format->filter_table = newTable;
+        p_format->filter_table_size = newSize;
+        p_format->filter_table_count = 0;
+        for (i = 0; i < oldSize; i++) {
+            if (oldTable[i] != NULL) {
+                filterTableInsert(p_format, oldTable[i]);
+            }
+        }
+        free(oldTable);
+    }
+
+    mask = p_format->filter_table_size - 1;
+    for (i = p_fi->mHash & mask; ; i = (i + 1) & mask) {
+        FilterInfo *p_slot = p_format->filter_table[i];
+
+        if (p_slot == NULL) {
+            p_format->filter_table_count++;
+            break;
+        }
+        if (p_slot->mHash == p_fi->mHash && 0 == strcmp(p_slot->mTag, p_fi->mTag)) {
+            break;
+        }
+    }
+    p_format->filter_table[i] = p_fi;
+
+    return 0;
+}
+
+static FilterInfo *filterTableFind(AndroidLogFormat *p_format,
+        const char *tag, uint32_t hash)
+{
+    size_t i, mask;
+
+    if (p_format->filter_table_count == 0) {
+        return NULL;
+    }
+
+    mask = p_format->filter_table_size - 1;
+    for (i = hash & mask; p_format->filter_table[i] != NULL; i = (i + 1) & mask) {
+        FilterInfo *p_slot = p_format->filter_table[i];
+
+        if (p_slot->mHash == hash && 0 == strcmp(p_slot->mTag, tag)) {
+            return p_slot;
+        }
+    }
+    return NULL;
+}
+
+static int filterTrieInsert(AndroidLogFormat *p_format,
+        const char *prefix, android_LogPriority pri)
+{
+    FilterTrie **pp_node = &p_format->prefix_trie;
+    FilterTrie *p_node = NULL;
+
+    for (; *prefix; prefix++) {
+        while (*pp_node != NULL && (*pp_node)->c != *prefix) {
+            pp_node = &(*pp_node)->sibling;
+        }
+        if (*pp_node == NULL) {
+            *pp_node = calloc(1, sizeof(FilterTrie));
+            if (*pp_node == NULL) {
+                return -1;
+            }
+            (*pp_node)->c = *prefix;
+            (*pp_node)->pri = ANDROID_LOG_UNKNOWN;
+        }
+        p_node = *pp_node;
+        pp_node = &p_node->child;
+    }
+
+    p_node->pri = pri;
+    return 0;
+}
+
+static android_LogPriority filterTrieFind(AndroidLogFormat *p_format,
+        const char *tag)
+{
+    FilterTrie *p_node = p_format->prefix_trie;
+    android_LogPriority pri = ANDROID_LOG_UNKNOWN;
+
+    for (; *tag && p_node != NULL; tag++) {
+        while (p_node != NULL && p_node->c != *tag) {
+            p_node = p_node->sibling;
+        }
+        if (p_node == NULL) {
+            break;
+        }
+        if (p_node->pri != ANDROID_LOG_UNKNOWN) {
+            pri = p_node->pri;
+        }
+        p_node = p_node->child;
+    }
+    return pri;
+}
+
+static void filterTrieFree(FilterTrie *p_node)
+{
+    while (p_node != NULL) {
+        FilterTrie *p_next = p_node->sibling;
+
+        filterTrieFree(p_node->child);
+        free(p_node);
+        p_node = p_next;
+    }
+}
+
 /*
  * Note: also accepts 0-9 priorities
  * returns ANDROID_LOG_UNKNOWN if the character is unrecognized
@@ -118,25 +288,39 @@ static char filterPriToChar (android_LogPriority pri)
     }
 }
 
+/*
+ * An exact rule for the tag wins, then the longest "prefix*" rule, then
+ * the global priority.
+ */
 static android_LogPriority filterPriForTag(
         AndroidLogFormat *p_format, const char *tag)
 {
-    FilterInfo *p_curFilter;
+    uint32_t hash = filterHash(tag);
+    FilterCacheEntry *p_cache = &p_format->filter_cache[hash % FILTER_CACHE_SIZE];
+    FilterInfo *p_fi;
+    android_LogPriority pri;
 
-    for (p_curFilter = p_format->filters
-            ; p_curFilter != NULL
-            ; p_curFilter = p_curFilter->p_next
-    ) {
-        if (0 == strcmp(tag, p_curFilter->mTag)) {
-            if (p_curFilter->mPri == ANDROID_LOG_DEFAULT) {
-                return p_format->global_pri;
-            } else {
-                return p_curFilter->mPri;
-            }
-        }
+    if (p_cache->hash == hash && 0 == strcmp(p_cache->tag, tag)) {
+        return p_cache->pri;
+    }
+
+    p_fi = filterTableFind(p_format, tag, hash);
+    if (p_fi != NULL) {
+        pri = p_fi->mPri;
+    } else {
+        pri = filterTrieFind(p_format, tag);
+    }
+    if (pri == ANDROID_LOG_UNKNOWN || pri == ANDROID_LOG_DEFAULT) {
+        pri = p_format->global_pri;
     }
 
-    return p_format->global_pri;
+    if (strlen(tag) < FILTER_CACHE_TAG_MAX) {
+        p_cache->hash = hash;
+        p_cache->pri = pri;
+        strcpy(p_cache->tag, tag);
+    }
+
+    return pri;
 }
 
 /** for debugging */
@@ -149,7 +333,7 @@ static void dumpFilters(AndroidLogFormat *p_format)
         if (p_fi->mPri == ANDROID_LOG_DEFAULT) {
             cPri = filterPriToChar(p_format->global_pri);
         }
-        fprintf(stderr,"%s:%c\n", p_fi->mTag, cPri);
+        fprintf(stderr,"%s%s:%c\n", p_fi->mTag, p_fi->mPrefix ? "*" : "", cPri);
     }
 
     fprintf(stderr,"*:%c\n", filterPriToChar(p_format->global_pri));
@@ -188,9 +372,12 @@ void android_log_format_free(AndroidLogFormat *p_format)
         p_info_old = p_info;
         p_info = p_info->p_next;
 
+        filterinfo_free(p_info_old);
         free(p_info_old);
     }
 
+    free(p_format->filter_table);
+    filterTrieFree(p_format->prefix_trie);
     free(p_format);
 }
 
@@ -224,7 +411,7 @@ AndroidLogPrintFormat android_log_formatFromString(const char * formatString)
 
 /**
  * filterExpression: a single filter expression
- * eg "AT:d"
+ * eg "AT:d", or "Wifi*:w" for every tag starting with "Wifi"
  *
  * returns 0 on success and -1 on invalid expression
  *
@@ -283,10 +470,30 @@ int android_log_addFilterRule(AndroidLogFormat *p_format,
         FilterInfo *p_fi = filterinfo_new(tagName, pri);
         free(tagName);
 
+        if (tagNameLength > 1 && p_fi->mTag[tagNameLength - 1] == '*') {
+            p_fi->mTag[tagNameLength - 1] = '\0';
+            p_fi->mPrefix = 1;
+            if (filterTrieInsert(p_format, p_fi->mTag, pri) < 0) {
+                filterinfo_free(p_fi);
+                free(p_fi);
+                goto error;
+            }
+        } else {
+            p_fi->mHash = filterHash(p_fi->mTag);
+            if (filterTableInsert(p_format, p_fi) < 0) {
+                filterinfo_free(p_fi);
+                free(p_fi);
+                goto error;
+            }
+        }
+
         p_fi->p_next = p_format->filters;
         p_format->filters = p_fi;
     }
 
+    // anything resolved so far may have changed
+    memset(p_format->filter_cache, 0, sizeof(p_format->filter_cache));
+
     return 0;
 error:
     return -1;
@@ -411,7 +618,7 @@ int android_log_processLogBuffer(struct logger_entry *buf,
  */
 static inline uint32_t get4LE(const uint8_t* src)
 {
-    return src[0] | (src[1] << 8) | (src[2] << 16) | (src[3] << 24);
+    return src[0] | (src[1] << 8) | (src[2] << 16) | ((uint32_t) src[3] << 24);
 }
 
 /*
@@ -421,8 +628,8 @@ static inline uint64_t get8LE(const uint8_t* src)
 {
     uint32_t low, high;
 
-    low = src[0] | (src[1] << 8) | (src[2] << 16) | (src[3] << 24);
-    high = src[4] | (src[5] << 8) | (src[6] << 16) | (src[7] << 24);
+    low = src[0] | (src[1] << 8) | (src[2] << 16) | ((uint32_t) src[3] << 24);
+    high = src[4] | (src[5] << 8) | (src[6] << 16) | ((uint32_t) src[7] << 24);
     return ((long long) high << 32) | (long long) low;
 }
 
@@ -689,33 +896,199 @@ int android_log_processBinaryLogBuffer(struct logger_entry *buf,
     return 0;
 }
 
-/**
- * Formats a log message into a buffer
- *
- * Uses defaultBuffer if it can, otherwise malloc()'s a new buffer
- * If return value != defaultBuffer, caller must call free()
- * Returns NULL on malloc error
+int android_log_eventReaderInit(AndroidEventReader *reader,
+    const struct logger_entry *buf)
+{
+    const unsigned char *eventData = (const unsigned char *) buf->msg;
+
+    if (buf->len < 4)
+        return -1;
+
+    reader->tag = get4LE(eventData);
+    reader->pos = eventData + 4;
+    reader->end = eventData + buf->len;
+    reader->depth = 0;
+    reader->left[0] = (reader->pos < reader->end) ? 1 : 0;
+    return 0;
+}
+
+int android_log_eventReaderNext(AndroidEventReader *reader,
+    AndroidEventValue *value)
+{
+    const unsigned char *p = reader->pos;
+    size_t avail;
+    unsigned char type;
+
+    while (reader->left[reader->depth] == 0) {
+        if (reader->depth == 0)
+            return 0;
+        reader->depth--;
+    }
+
+    avail = reader->end - p;
+    if (avail < 1)
+        return -1;
+    type = *p++;
+    avail--;
+
+    value->type = type;
+    value->depth = reader->depth;
+    value->str = NULL;
+
+    switch (type) {
+    case EVENT_TYPE_INT:
+        if (avail < 4)
+            return -1;
+        value->value = (int32_t) get4LE(p);
+        p += 4;
+        break;
+    case EVENT_TYPE_LONG:
+        if (avail < 8)
+            return -1;
+        value->value = (int64_t) get8LE(p);
+        p += 8;
+        break;
+    case EVENT_TYPE_STRING:
+        if (avail < 4)
+            return -1;
+        value->value = get4LE(p);
+        p += 4;
+        if (avail - 4 < (uint64_t) value->value)
+            return -1;
+        value->str = (const char *) p;
+        p += value->value;
+        break;
+    case EVENT_TYPE_LIST:
+        if (avail < 1 || reader->depth == ANDROID_LOG_EVENT_MAX_DEPTH)
+            return -1;
+        value->value = *p++;
+        break;
+    default:
+        return -1;
+    }
+
+    reader->left[reader->depth]--;
+    if (type == EVENT_TYPE_LIST) {
+        reader->left[++reader->depth] = value->value;
+    }
+    reader->pos = p;
+    return 1;
+}
+
+int android_log_decodeEventColumns(AndroidEventColumns *columns,
+    const struct logger_entry *buf)
+{
+    AndroidEventReader reader;
+    AndroidEventValue value;
+    size_t row = columns->numEvents;
+    size_t first = columns->numValues;
+    size_t n = first;
+    int result;
+
+    if (row >= columns->maxEvents)
+        return 1;
+    if (android_log_eventReaderInit(&reader, buf) < 0)
+        return -1;
+
+    while ((result = android_log_eventReaderNext(&reader, &value)) > 0) {
+        if (n >= columns->maxValues)
+            return 1;
+        if (columns->type != NULL)
+            columns->type[n] = value.type;
+        if (columns->depth != NULL)
+            columns->depth[n] = value.depth;
+        if (columns->value != NULL)
+            columns->value[n] = value.value;
+        if (columns->str != NULL)
+            columns->str[n] = value.str;
+        n++;
+    }
+    if (result < 0)
+        return -1;
+
+    if (columns->tag != NULL)
+        columns->tag[row] = reader.tag;
+    if (columns->sec != NULL)
+        columns->sec[row] = buf->sec;
+    if (columns->nsec != NULL)
+        columns->nsec[row] = buf->nsec;
+    if (columns->pid != NULL)
+        columns->pid[row] = buf->pid;
+    if (columns->tid != NULL)
+        columns->tid[row] = buf->tid;
+    if (columns->firstValue != NULL)
+        columns->firstValue[row] = first;
+    if (columns->valueCount != NULL)
+        columns->valueCount[row] = n - first;
+
+    columns->numEvents = row + 1;
+    columns->numValues = n;
+    return 0;
+}
+
+/*
+ * Hand-rolled replacements for the snprintf() calls that used to build
+ * the line prefix, which was most of the cost of formatting a line.
+ * Each one stops at 'end' the way snprintf() truncates.
  */
+static char *put_char(char *p, char *end, char c)
+{
+    if (p < end) *p++ = c;
+    return p;
+}
 
-char *android_log_formatLogLine (
-    AndroidLogFormat *p_format,
-    char *defaultBuffer,
-    size_t defaultBufferSize,
-    const AndroidLogEntry *entry,
-    size_t *p_outLength)
+static char *put_str(char *p, char *end, const char *s)
+{
+    while (*s && p < end) *p++ = *s++;
+    return p;
+}
+
+/* %-<width>s */
+static char *put_str_left(char *p, char *end, const char *s, size_t width)
+{
+    char *start = p;
+
+    p = put_str(p, end, s);
+    while ((size_t)(p - start) < width && p < end) *p++ = ' ';
+    return p;
+}
+
+/* %<width>ld, or %0<width>ld when pad is '0' */
+static char *put_long(char *p, char *end, long value, int width, char pad)
+{
+    char digits[24];
+    unsigned long v = value < 0 ? -(unsigned long)value : (unsigned long)value;
+    int n = 0, len;
+
+    do {
+        digits[n++] = '0' + v % 10;
+        v /= 10;
+    } while (v);
+
+    len = n + (value < 0);
+    if (pad == '0' && value < 0) p = put_char(p, end, '-');
+    for (; len < width; len++) p = put_char(p, end, pad);
+    if (pad != '0' && value < 0) p = put_char(p, end, '-');
+    while (n) p = put_char(p, end, digits[--n]);
+    return p;
+}
+
+/*
+ * "%m-%d %H:%M:%S" for the entry's second.  localtime_r() and strftime()
+ * only run when the second changes, which for a busy log is once every
+ * few hundred lines.
+ */
+static const char *formatTime(AndroidLogFormat *p_format,
+        const AndroidLogEntry *entry)
 {
 #if defined(HAVE_LOCALTIME_R)
     struct tm tmBuf;
 #endif
     struct tm* ptm;
-    char timeBuf[32];
-    char headerBuf[128];
-    char prefixBuf[128], suffixBuf[128];
-    char priChar;
-    int prefixSuffixIsHeaderFooter = 0;
-    char * ret = NULL;
 
-    priChar = filterPriToChar(entry->priority);
+    if (p_format->time_valid && p_format->time_sec == entry->tv_sec) {
+        return p_format->time_buf;
+    }
 
     /*
      * Get the current date/time in pretty form
@@ -732,7 +1105,48 @@ char *android_log_formatLogLine (
     ptm = localtime(&(entry->tv_sec));
 #endif
     //strftime(timeBuf, sizeof(timeBuf), "%Y-%m-%d %H:%M:%S", ptm);
-    strftime(timeBuf, sizeof(timeBuf), "%m-%d %H:%M:%S", ptm);
+    strftime(p_format->time_buf, sizeof(p_format->time_buf),
+            "%m-%d %H:%M:%S", ptm);
+    p_format->time_sec = entry->tv_sec;
+    p_format->time_valid = 1;
+
+    return p_format->time_buf;
+}
+
+/**
+ * Formats a log message into a buffer
+ *
+ * Uses defaultBuffer if it can, otherwise malloc()'s a new buffer
+ * If return value != defaultBuffer, caller must call free()
+ * Returns NULL on malloc error
+ */
+
+char *android_log_formatLogLine (
+    AndroidLogFormat *p_format,
+    char *defaultBuffer,
+    size_t defaultBufferSize,
+    const AndroidLogEntry *entry,
+    size_t *p_outLength)
+{
+    const char *timeBuf = NULL;
+    char prefixBuf[128], suffixBuf[128];
+    char *pp = prefixBuf, *pend = prefixBuf + sizeof(prefixBuf) - 1;
+    char *sp = suffixBuf, *send = suffixBuf + sizeof(suffixBuf) - 1;
+    char priChar;
+    int prefixSuffixIsHeaderFooter = 0;
+    char * ret = NULL;
+
+    priChar = filterPriToChar(entry->priority);
+
+    switch (p_format->format) {
+        case FORMAT_TIME:
+        case FORMAT_THREADTIME:
+        case FORMAT_LONG:
+            timeBuf = formatTime(p_format, entry);
+            break;
+        default:
+            break;
+    }
 
     /*
      * Construct a buffer containing the log header and log message.
@@ -741,69 +1155,100 @@ char *android_log_formatLogLine (
 
     switch (p_format->format) {
         case FORMAT_TAG:
-            prefixLen = snprintf(prefixBuf, sizeof(prefixBuf),
-                "%c/%-8s: ", priChar, entry->tag);
-            strcpy(suffixBuf, "\n"); suffixLen = 1;
+            /* "%c/%-8s: " */
+            pp = put_char(pp, pend, priChar);
+            pp = put_char(pp, pend, '/');
+            pp = put_str_left(pp, pend, entry->tag, 8);
+            pp = put_str(pp, pend, ": ");
+            sp = put_char(sp, send, '\n');
             break;
         case FORMAT_PROCESS:
-            prefixLen = snprintf(prefixBuf, sizeof(prefixBuf),
-                "%c(%5d) ", priChar, entry->pid);
-            suffixLen = snprintf(suffixBuf, sizeof(suffixBuf),
-                "  (%s)\n", entry->tag);
+            /* "%c(%5d) " and "  (%s)\n" */
+            pp = put_char(pp, pend, priChar);
+            pp = put_char(pp, pend, '(');
+            pp = put_long(pp, pend, entry->pid, 5, ' ');
+            pp = put_str(pp, pend, ") ");
+            sp = put_str(sp, send, "  (");
+            sp = put_str(sp, send, entry->tag);
+            sp = put_str(sp, send, ")\n");
             break;
         case FORMAT_THREAD:
-            prefixLen = snprintf(prefixBuf, sizeof(prefixBuf),
-                "%c(%5d:%5d) ", priChar, entry->pid, entry->tid);
-            strcpy(suffixBuf, "\n");
-            suffixLen = 1;
+            /* "%c(%5d:%5d) " */
+            pp = put_char(pp, pend, priChar);
+            pp = put_char(pp, pend, '(');
+            pp = put_long(pp, pend, entry->pid, 5, ' ');
+            pp = put_char(pp, pend, ':');
+            pp = put_long(pp, pend, entry->tid, 5, ' ');
+            pp = put_str(pp, pend, ") ");
+            sp = put_char(sp, send, '\n');
             break;
         case FORMAT_RAW:
-            prefixBuf[0] = 0;
-            prefixLen = 0;
-            strcpy(suffixBuf, "\n");
-            suffixLen = 1;
+            sp = put_char(sp, send, '\n');
             break;
         case FORMAT_TIME:
-            prefixLen = snprintf(prefixBuf, sizeof(prefixBuf),
-                "%s.%03ld %c/%-8s(%5d): ", timeBuf, entry->tv_nsec / 1000000,
-                priChar, entry->tag, entry->pid);
-            strcpy(suffixBuf, "\n");
-            suffixLen = 1;
+            /* "%s.%03ld %c/%-8s(%5d): " */
+            pp = put_str(pp, pend, timeBuf);
+            pp = put_char(pp, pend, '.');
+            pp = put_long(pp, pend, entry->tv_nsec / 1000000, 3, '0');
+            pp = put_char(pp, pend, ' ');
+            pp = put_char(pp, pend, priChar);
+            pp = put_char(pp, pend, '/');
+            pp = put_str_left(pp, pend, entry->tag, 8);
+            pp = put_char(pp, pend, '(');
+            pp = put_long(pp, pend, entry->pid, 5, ' ');
+            pp = put_str(pp, pend, "): ");
+            sp = put_char(sp, send, '\n');
             break;
         case FORMAT_THREADTIME:
-            prefixLen = snprintf(prefixBuf, sizeof(prefixBuf),
-                "%s.%03ld %5d %5d %c %-8s: ", timeBuf, entry->tv_nsec / 1000000,
-                entry->pid, entry->tid, priChar, entry->tag);
-            strcpy(suffixBuf, "\n");
-            suffixLen = 1;
+            /* "%s.%03ld %5d %5d %c %-8s: " */
+            pp = put_str(pp, pend, timeBuf);
+            pp = put_char(pp, pend, '.');
+            pp = put_long(pp, pend, entry->tv_nsec / 1000000, 3, '0');
+            pp = put_char(pp, pend, ' ');
+            pp = put_long(pp, pend, entry->pid, 5, ' ');
+            pp = put_char(pp, pend, ' ');
+            pp = put_long(pp, pend, entry->tid, 5, ' ');
+            pp = put_char(pp, pend, ' ');
+            pp = put_char(pp, pend, priChar);
+            pp = put_char(pp, pend, ' ');
+            pp = put_str_left(pp, pend, entry->tag, 8);
+            pp = put_str(pp, pend, ": ");
+            sp = put_char(sp, send, '\n');
             break;
         case FORMAT_LONG:
-            prefixLen = snprintf(prefixBuf, sizeof(prefixBuf),
-                "[ %s.%03ld %5d:%5d %c/%-8s ]\n",
-                timeBuf, entry->tv_nsec / 1000000, entry->pid,
-                entry->tid, priChar, entry->tag);
-            strcpy(suffixBuf, "\n\n");
-            suffixLen = 2;
+            /* "[ %s.%03ld %5d:%5d %c/%-8s ]\n" */
+            pp = put_str(pp, pend, "[ ");
+            pp = put_str(pp, pend, timeBuf);
+            pp = put_char(pp, pend, '.');
+            pp = put_long(pp, pend, entry->tv_nsec / 1000000, 3, '0');
+            pp = put_char(pp, pend, ' ');
+            pp = put_long(pp, pend, entry->pid, 5, ' ');
+            pp = put_char(pp, pend, ':');
+            pp = put_long(pp, pend, entry->tid, 5, ' ');
+            pp = put_char(pp, pend, ' ');
+            pp = put_char(pp, pend, priChar);
+            pp = put_char(pp, pend, '/');
+            pp = put_str_left(pp, pend, entry->tag, 8);
+            pp = put_str(pp, pend, " ]\n");
+            sp = put_str(sp, send, "\n\n");
             prefixSuffixIsHeaderFooter = 1;
             break;
         case FORMAT_BRIEF:
         default:
-            prefixLen = snprintf(prefixBuf, sizeof(prefixBuf),
-                "%c/%-8s(%5d): ", priChar, entry->tag, entry->pid);
-            strcpy(suffixBuf, "\n");
-            suffixLen = 1;
+            /* "%c/%-8s(%5d): " */
+            pp = put_char(pp, pend, priChar);
+            pp = put_char(pp, pend, '/');
+            pp = put_str_left(pp, pend, entry->tag, 8);
+            pp = put_char(pp, pend, '(');
+            pp = put_long(pp, pend, entry->pid, 5, ' ');
+            pp = put_str(pp, pend, "): ");
+            sp = put_char(sp, send, '\n');
             break;
     }
-    /* snprintf has a weird return value.   It returns what would have been
-     * written given a large enough buffer.  In the case that the prefix is
-     * longer then our buffer(128), it messes up the calculations below
-     * possibly causing heap corruption.  To avoid this we double check and
-     * set the length at the maximum (size minus null byte)
-     */
-    if(prefixLen >= sizeof(prefixBuf))
-        prefixLen = sizeof(prefixBuf) - 1;
-    if(suffixLen >= sizeof(suffixBuf))
-        suffixLen = sizeof(suffixBuf) - 1;
+    *pp = '\0';
+    *sp = '\0';
+    prefixLen = pp - prefixBuf;
+    suffixLen = sp - suffixBuf;
 
     /* the following code is tragically unreadable */
 
@@ -843,17 +1288,15 @@ char *android_log_formatLogLine (
         }
     }
 
-    ret[0] = '\0';       /* to start strcat off */
-
     p = ret;
     pm = entry->message;
 
     if (prefixSuffixIsHeaderFooter) {
-        strcat(p, prefixBuf);
+        memcpy(p, prefixBuf, prefixLen);
         p += prefixLen;
-        strncat(p, entry->message, entry->messageLen);
+        memcpy(p, entry->message, entry->messageLen);
         p += entry->messageLen;
-        strcat(p, suffixBuf);
+        memcpy(p, suffixBuf, suffixLen);
         p += suffixLen;
     } else {
         while(pm < (entry->message + entry->messageLen)) {
@@ -866,16 +1309,17 @@ char *android_log_formatLogLine (
                     && *pm != '\n') pm++;
             lineLen = pm - lineStart;
 
-            strcat(p, prefixBuf);
+            memcpy(p, prefixBuf, prefixLen);
             p += prefixLen;
-            strncat(p, lineStart, lineLen);
+            memcpy(p, lineStart, lineLen);
             p += lineLen;
-            strcat(p, suffixBuf);
+            memcpy(p, suffixBuf, suffixLen);
             p += suffixLen;
 
             if (*pm == '\n') pm++;
         }
     }
+    *p = '\0';
 
     if (p_outLength != NULL) {
         *p_outLength = p - ret;
@@ -1000,6 +1444,116 @@ void logprint_run_tests()
     err = android_log_addFilterString(p_format, "*:s random:z");
     assert(err < 0);
 
+    // prefix rules: exact beats longest prefix beats global
+    err = android_log_addFilterString(p_format, "*:i Wifi*:w WifiService*:d WifiP2p:e");
+    assert(err == 0);
+    assert(ANDROID_LOG_WARN == filterPriForTag(p_format, "WifiManager"));
+    assert(ANDROID_LOG_DEBUG == filterPriForTag(p_format, "WifiServiceImpl"));
+    assert(ANDROID_LOG_ERROR == filterPriForTag(p_format, "WifiP2p"));
+    assert(ANDROID_LOG_WARN == filterPriForTag(p_format, "WifiP2pService"));
+    assert(ANDROID_LOG_INFO == filterPriForTag(p_format, "Wif"));
+    assert(ANDROID_LOG_DEBUG == filterPriForTag(p_format, "random"));
+
+    // a new rule must not be hidden by a cached answer
+    android_log_addFilterRule(p_format, "WifiManager:v");
+    assert(ANDROID_LOG_VERBOSE == filterPriForTag(p_format, "WifiManager"));
+    android_log_addFilterRule(p_format, "*:e");
+    assert(ANDROID_LOG_ERROR == filterPriForTag(p_format, "Wif"));
+
+    // binary events: build, then read back both ways
+    {
+        union {
+            struct logger_entry entry;
+            char bytes[sizeof(struct logger_entry) + LOGGER_ENTRY_MAX_PAYLOAD];
+        } u;
+        struct android_log_event_builder b;
+        AndroidEventReader reader;
+        AndroidEventValue v;
+        AndroidEventColumns cols;
+        int32_t c_tag[2];
+        uint32_t c_first[2], c_count[2];
+        uint8_t c_type[8], c_depth[8];
+        int64_t c_value[8];
+        const char *c_str[8];
+        const void *payload;
+        size_t len;
+        int32_t tag = 2718;
+
+        __android_log_event_init(&b, tag, u.entry.msg + 4,
+                LOGGER_ENTRY_MAX_PAYLOAD - 4);
+        __android_log_event_append_int(&b, -5);
+        __android_log_event_begin_list(&b);
+        __android_log_event_append_long(&b, 1LL << 40);
+        __android_log_event_append_string(&b, "hi");
+        __android_log_event_end_list(&b);
+        payload = __android_log_event_payload(&b, &len);
+        assert(payload == u.entry.msg + 4);
+        memcpy(u.entry.msg, &tag, 4);
+        u.entry.len = len + 4;
+        u.entry.sec = 7;
+
+        assert(android_log_eventReaderInit(&reader, &u.entry) == 0);
+        assert(reader.tag == tag);
+        assert(android_log_eventReaderNext(&reader, &v) == 1);
+        assert(v.type == EVENT_TYPE_LIST && v.depth == 0 && v.value == 2);
+        assert(android_log_eventReaderNext(&reader, &v) == 1);
+        assert(v.type == EVENT_TYPE_INT && v.depth == 1 && v.value == -5);
+        assert(android_log_eventReaderNext(&reader, &v) == 1);
+        assert(v.type == EVENT_TYPE_LIST && v.depth == 1 && v.value == 2);
+        assert(android_log_eventReaderNext(&reader, &v) == 1);
+        assert(v.type == EVENT_TYPE_LONG && v.depth == 2 && v.value == 1LL << 40);
+        assert(android_log_eventReaderNext(&reader, &v) == 1);
+        assert(v.type == EVENT_TYPE_STRING && v.value == 2);
+        assert(memcmp(v.str, "hi", 2) == 0);
+        assert(android_log_eventReaderNext(&reader, &v) == 0);
+
+        memset(&cols, 0, sizeof(cols));
+        cols.maxEvents = 2;
+        cols.tag = c_tag;
+        cols.firstValue = c_first;
+        cols.valueCount = c_count;
+        cols.maxValues = 8;
+        cols.type = c_type;
+        cols.depth = c_depth;
+        cols.value = c_value;
+        cols.str = c_str;
+        assert(android_log_decodeEventColumns(&cols, &u.entry) == 0);
+        assert(android_log_decodeEventColumns(&cols, &u.entry) == 1);
+        assert(cols.numEvents == 1 && cols.numValues == 5);
+        assert(c_tag[0] == tag && c_count[0] == 5);
+        assert(c_depth[3] == 2 && c_value[3] == 1LL << 40);
+        assert(c_str[4] == v.str);
+
+        // a single value goes out bare
+        __android_log_event_init(&b, tag, u.entry.msg + 4, 16);
+        __android_log_event_append_int(&b, 42);
+        payload = __android_log_event_payload(&b, &len);
+        assert(len == 5 && *(const char *) payload == EVENT_TYPE_INT);
+
+        // overflow and bad nesting are sticky
+        __android_log_event_init(&b, tag, u.entry.msg + 4, 16);
+        assert(__android_log_event_append_long(&b, 1) == 0);
+        assert(__android_log_event_append_string(&b, "too long") < 0);
+        assert(__android_log_event_append_int(&b, 1) < 0);
+        assert(__android_log_event_payload(&b, &len) == NULL);
+        assert(b.error == -ENOSPC);
+        __android_log_event_init(&b, tag, u.entry.msg + 4, 16);
+        __android_log_event_begin_list(&b);
+        assert(__android_log_event_payload(&b, &len) == NULL);
+        assert(b.error == -EINVAL);
+
+        // truncated
+        __android_log_event_init(&b, tag, u.entry.msg + 4, 32);
+        __android_log_event_append_int(&b, 1);
+        __android_log_event_append_long(&b, 2);
+        __android_log_event_payload(&b, &len);
+        u.entry.len = 4 + len - 1;
+        assert(android_log_eventReaderInit(&reader, &u.entry) == 0);
+        while ((err = android_log_eventReaderNext(&reader, &v)) > 0)
+            ;
+        assert(err == -1);
+    }
+
 
 #if 0
     char *ret;
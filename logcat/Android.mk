@@ -3,9 +3,11 @@
 LOCAL_PATH:= $(call my-dir)
 include $(CLEAR_VARS)
 
-LOCAL_SRC_FILES:= logcat.cpp event.logtags
+LOCAL_SRC_FILES:= logcat.cpp archive.cpp event.logtags
 
-LOCAL_SHARED_LIBRARIES := liblog
+LOCAL_C_INCLUDES += external/zlib
+
+LOCAL_SHARED_LIBRARIES := liblog libz
 
 LOCAL_MODULE:= logcat
 
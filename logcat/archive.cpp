@@ -0,0 +1,287 @@
+// Copyright 2013 The Android Open Source Project
+
+#define __STDC_LIMIT_MACROS
+#include "archive.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <zlib.h>
+
+#define NS_PER_SEC 1000000000LL
+
+static int64_t entryTime(int32_t sec, int32_t nsec)
+{
+    return (int64_t) sec * NS_PER_SEC + nsec;
+}
+
+static uint32_t tagHash(const char* tag, size_t len)
+{
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char) tag[i]) * 16777619u;
+    }
+    return h;
+}
+
+/* the two bits of the pid bloom filter a pid sets */
+static void archivePidBits(int32_t pid, int* a, int* b)
+{
+    uint32_t h = (uint32_t) pid * 2654435761u;
+    *a = h >> 24;
+    *b = (h >> 16) & 0xff;
+}
+
+static bool pidBitsSet(const uint8_t* pids, int32_t pid)
+{
+    int a, b;
+    archivePidBits(pid, &a, &b);
+    return (pids[a >> 3] & (1 << (a & 7))) && (pids[b >> 3] & (1 << (b & 7)));
+}
+
+void archive_block_t::reset()
+{
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = ARCHIVE_BLOCK_MAGIC;
+    memset(tagSlots, 0, sizeof(tagSlots));
+}
+
+void archive_block_t::addTag(const char* tag, size_t len, int priority)
+{
+    const size_t nslots = sizeof(tagSlots) / sizeof(tagSlots[0]);
+    size_t slot = tagHash(tag, len) & (nslots - 1);
+
+    while (tagSlots[slot] != 0) {
+        char* known = tags + tagSlots[slot] - 1;
+        if (strlen(known + 1) == len && memcmp(known + 1, tag, len) == 0) {
+            if (priority > *known) {
+                *known = priority;
+            }
+            return;
+        }
+        slot = (slot + 1) & (nslots - 1);
+    }
+
+    if (hdr.tagCount == ARCHIVE_MAX_TAGS
+            || hdr.tagBytes + len + 2 > ARCHIVE_TAG_BYTES) {
+        hdr.flags |= ARCHIVE_BLOCK_ALL_TAGS;
+        return;
+    }
+    char* p = tags + hdr.tagBytes;
+    p[0] = priority;
+    memcpy(p + 1, tag, len);
+    p[len + 1] = '\0';
+    tagSlots[slot] = hdr.tagBytes + 1;
+    hdr.tagBytes += len + 2;
+    hdr.tagCount++;
+}
+
+bool archive_block_t::add(const struct logger_entry* entry, bool binary)
+{
+    size_t size = ARCHIVE_ENTRY_SIZE(entry);
+
+    if (hdr.rawLen + size > ARCHIVE_BLOCK_SIZE) {
+        return false;
+    }
+
+    struct logger_entry* copy = (struct logger_entry*) (data + hdr.rawLen);
+    memcpy(copy, entry, sizeof(struct logger_entry) + entry->len);
+    memset(copy->msg + entry->len, 0, size - sizeof(struct logger_entry) - entry->len);
+    copy->__pad = binary ? ARCHIVE_ENTRY_BINARY : 0;
+    hdr.rawLen += size;
+
+    int64_t t = entryTime(entry->sec, entry->nsec);
+    if (hdr.entries == 0 || t < entryTime(hdr.minSec, hdr.minNsec)) {
+        hdr.minSec = entry->sec;
+        hdr.minNsec = entry->nsec;
+    }
+    if (hdr.entries == 0 || t > entryTime(hdr.maxSec, hdr.maxNsec)) {
+        hdr.maxSec = entry->sec;
+        hdr.maxNsec = entry->nsec;
+    }
+    hdr.entries++;
+
+    int a, b;
+    archivePidBits(entry->pid, &a, &b);
+    hdr.pids[a >> 3] |= 1 << (a & 7);
+    hdr.pids[b >> 3] |= 1 << (b & 7);
+
+    /* the tag of a binary entry is only a number until it is looked up */
+    const char* tag = entry->msg + 1;
+    const char* end = entry->msg + entry->len;
+    const char* nul = entry->len > 1 ? (const char*) memchr(tag, '\0', end - tag) : NULL;
+    if (binary || nul == NULL) {
+        hdr.flags |= ARCHIVE_BLOCK_ALL_TAGS;
+    } else {
+        addTag(tag, nul - tag, entry->msg[0]);
+    }
+    return true;
+}
+
+size_t archive_block_t::finish(bool compress, const unsigned char** outp)
+{
+    archive_block_header_t h = hdr;
+    unsigned char* p = out + sizeof(h);
+
+    memcpy(p, tags, h.tagBytes);
+    p += h.tagBytes;
+
+    uLongf stored = ARCHIVE_DEFLATE_ROOM;
+    if (compress
+            && compress2(p, &stored, data, h.rawLen, Z_DEFAULT_COMPRESSION) == Z_OK
+            && stored < h.rawLen) {
+        h.flags |= ARCHIVE_BLOCK_DEFLATE;
+        h.storedLen = stored;
+    } else {
+        memcpy(p, data, h.rawLen);
+        h.storedLen = h.rawLen;
+    }
+    memcpy(out, &h, sizeof(h));
+
+    *outp = out;
+    return sizeof(h) + h.tagBytes + h.storedLen;
+}
+
+void archiveQueryInit(archive_query_t* query)
+{
+    query->begin = INT64_MIN;
+    query->end = INT64_MAX;
+    query->hasPid = false;
+    query->pid = 0;
+    query->format = NULL;
+}
+
+int archiveWriteFileHeader(int fd)
+{
+    archive_file_header_t h;
+    h.magic = ARCHIVE_MAGIC;
+    h.version = ARCHIVE_VERSION;
+
+    ssize_t ret;
+    do {
+        ret = write(fd, &h, sizeof(h));
+    } while (ret < 0 && errno == EINTR);
+    return ret == (ssize_t) sizeof(h) ? 0 : -1;
+}
+
+/* reads exactly len bytes; returns 0 if the file ends first */
+static int readFully(int fd, void* buf, size_t len)
+{
+    unsigned char* p = (unsigned char*) buf;
+
+    while (len > 0) {
+        ssize_t ret = read(fd, p, len);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (ret == 0) {
+            return 0;
+        }
+        p += ret;
+        len -= ret;
+    }
+    return 1;
+}
+
+int archiveReadFileHeader(int fd)
+{
+    archive_file_header_t h;
+
+    if (readFully(fd, &h, sizeof(h)) <= 0
+            || h.magic != ARCHIVE_MAGIC || h.version != ARCHIVE_VERSION) {
+        return -1;
+    }
+    return 0;
+}
+
+static bool matchBlock(const archive_query_t* query,
+        const archive_block_header_t* h, const char* tags)
+{
+    if (entryTime(h->maxSec, h->maxNsec) < query->begin
+            || entryTime(h->minSec, h->minNsec) > query->end) {
+        return false;
+    }
+    if (query->hasPid && !pidBitsSet(h->pids, query->pid)) {
+        return false;
+    }
+    if (query->format == NULL || (h->flags & ARCHIVE_BLOCK_ALL_TAGS)) {
+        return true;
+    }
+    for (const char* p = tags; p < tags + h->tagBytes; p += strlen(p + 1) + 2) {
+        if (android_log_shouldPrintLine(query->format, p + 1,
+                (android_LogPriority) p[0])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int archiveReadBlock(int fd, const archive_query_t* query,
+        unsigned char* out, size_t* outLen)
+{
+    static unsigned char stored[ARCHIVE_DEFLATE_ROOM];
+    archive_block_header_t h;
+    char tags[ARCHIVE_TAG_BYTES + 1];
+    int ret;
+
+    for (;;) {
+        ret = readFully(fd, &h, sizeof(h));
+        if (ret <= 0) {
+            return ret;
+        }
+        if (h.magic != ARCHIVE_BLOCK_MAGIC || h.rawLen > ARCHIVE_BLOCK_SIZE
+                || h.storedLen > ARCHIVE_DEFLATE_ROOM
+                || h.tagBytes > ARCHIVE_TAG_BYTES) {
+            return -1;
+        }
+        ret = readFully(fd, tags, h.tagBytes);
+        if (ret <= 0) {
+            return ret;
+        }
+        tags[h.tagBytes] = '\0';
+
+        if (!matchBlock(query, &h, tags)) {
+            if (lseek(fd, h.storedLen, SEEK_CUR) < 0) {
+                return -1;
+            }
+            continue;
+        }
+
+        if (h.flags & ARCHIVE_BLOCK_DEFLATE) {
+            ret = readFully(fd, stored, h.storedLen);
+            if (ret <= 0) {
+                return ret;
+            }
+            uLongf len = ARCHIVE_BLOCK_SIZE;
+            if (uncompress(out, &len, stored, h.storedLen) != Z_OK
+                    || len != h.rawLen) {
+                return -1;
+            }
+        } else {
+            if (h.storedLen != h.rawLen) {
+                return -1;
+            }
+            ret = readFully(fd, out, h.rawLen);
+            if (ret <= 0) {
+                return ret;
+            }
+        }
+        *outLen = h.rawLen;
+        return 1;
+    }
+}
+
+bool archiveMatchEntry(const archive_query_t* query,
+        const struct logger_entry* entry)
+{
+    int64_t t = entryTime(entry->sec, entry->nsec);
+
+    if (t < query->begin || t > query->end) {
+        return false;
+    }
+    return !query->hasPid || entry->pid == query->pid;
+}
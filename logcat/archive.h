@@ -0,0 +1,111 @@
+// Copyright 2013 The Android Open Source Project
+
+#ifndef _LOGCAT_ARCHIVE_H
+#define _LOGCAT_ARCHIVE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <log/logger.h>
+#include <log/logprint.h>
+
+/*
+ * The archive written by logcat -A: a file header followed by blocks.
+ * Each block starts with an index of what it holds (time range, a pid
+ * bloom filter and the tags with the highest priority each was logged
+ * at), then the raw logger_entry records back to back, each padded to 4
+ * bytes, deflated when ARCHIVE_BLOCK_DEFLATE is set.  A reader can decide from the index
+ * alone whether a block can hold anything it wants and seek past it
+ * otherwise.  Blocks are self-contained so a file cut short by a crash
+ * is readable up to its last whole block.
+ *
+ * Everything is in host byte order, as logger_entry itself is.  An
+ * entry's __pad carries ARCHIVE_ENTRY_BINARY if it came from a binary
+ * log such as events.
+ */
+#define ARCHIVE_MAGIC           0x3141434c  /* "LCA1" */
+#define ARCHIVE_BLOCK_MAGIC     0x4b4c4243  /* "CBLK" */
+#define ARCHIVE_VERSION         1
+
+#define ARCHIVE_BLOCK_SIZE      (64 * 1024) /* raw entry bytes per block */
+#define ARCHIVE_MAX_TAGS        128
+#define ARCHIVE_TAG_BYTES       4096
+#define ARCHIVE_DEFLATE_ROOM    (ARCHIVE_BLOCK_SIZE + ARCHIVE_BLOCK_SIZE / 1024 + 64)
+
+#define ARCHIVE_BLOCK_DEFLATE   0x1
+#define ARCHIVE_BLOCK_ALL_TAGS  0x2     /* tag index incomplete, don't skip on tags */
+
+#define ARCHIVE_ENTRY_BINARY    0x1
+#define ARCHIVE_ENTRY_SIZE(e)   ((sizeof(struct logger_entry) + (e)->len + 3) & ~3)
+
+struct archive_file_header_t {
+    uint32_t magic;
+    uint32_t version;
+};
+
+struct archive_block_header_t {
+    uint32_t magic;
+    uint32_t flags;
+    uint32_t rawLen;        /* entry bytes once inflated */
+    uint32_t storedLen;     /* entry bytes as stored, after the tags */
+    uint32_t entries;
+    int32_t minSec, minNsec;
+    int32_t maxSec, maxNsec;
+    uint8_t pids[32];       /* bloom filter, see archivePidBits() */
+    uint16_t tagCount;
+    uint16_t tagBytes;      /* tagCount of (priority byte, tag, NUL) */
+};
+
+/* A block being filled, and how it is written out. */
+struct archive_block_t {
+    archive_block_header_t hdr;
+    char tags[ARCHIVE_TAG_BYTES];
+    uint16_t tagSlots[ARCHIVE_MAX_TAGS * 2];    /* offset + 1 into tags */
+    unsigned char data[ARCHIVE_BLOCK_SIZE] __attribute__((aligned(4)));
+
+    void reset();
+
+    /* false if the entry does not fit; the block is left unchanged */
+    bool add(const struct logger_entry* entry, bool binary);
+
+    /* header, tags and (maybe deflated) entries, ready to be written;
+     * *out points into a buffer owned by the block */
+    size_t finish(bool compress, const unsigned char** out);
+
+private:
+    void addTag(const char* tag, size_t len, int priority);
+
+    unsigned char out[sizeof(archive_block_header_t) + ARCHIVE_TAG_BYTES
+            + ARCHIVE_DEFLATE_ROOM];
+};
+
+/* What logcat -R is looking for. */
+struct archive_query_t {
+    int64_t begin;          /* ns since Epoch, inclusive */
+    int64_t end;            /* ns since Epoch, inclusive */
+    bool hasPid;
+    int32_t pid;
+    AndroidLogFormat* format;   /* tag filter, or NULL */
+};
+
+void archiveQueryInit(archive_query_t* query);
+
+/* returns 0, or -1 with errno set */
+int archiveWriteFileHeader(int fd);
+
+/* returns 0 if fd is at the start of an archive, -1 if it is not */
+int archiveReadFileHeader(int fd);
+
+/*
+ * Reads up to the next block that may hold entries matching the query,
+ * seeking past the others, and inflates its entries into out, which has
+ * room for ARCHIVE_BLOCK_SIZE bytes.  Returns 1 with the entry bytes in
+ * *outLen, 0 at the end of the file (including a last block cut short),
+ * or -1 on a corrupt block.
+ */
+int archiveReadBlock(int fd, const archive_query_t* query,
+        unsigned char* out, size_t* outLen);
+
+bool archiveMatchEntry(const archive_query_t* query,
+        const struct logger_entry* entry);
+
+#endif /* _LOGCAT_ARCHIVE_H */
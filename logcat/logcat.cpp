@@ -18,8 +18,11 @@
 #include <ctype.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
 
+#include "archive.h"
+
 #define DEFAULT_LOG_ROTATE_SIZE_KBYTES 16
 #define DEFAULT_MAX_ROTATED_LOGS 4
 
@@ -32,24 +35,47 @@ static int g_tail_lines = 0;
 
 #define LOG_FILE_DIR    "/dev/log/"
 
-struct queued_entry_t {
-    union {
-        unsigned char buf[LOGGER_ENTRY_MAX_LEN + 1] __attribute__((aligned(4)));
-        struct logger_entry entry __attribute__((aligned(4)));
-    };
-    queued_entry_t* next;
+/* Entries are read straight into per-device arenas of fixed-size chunks
+ * and consumed in the order they were read, so queueing a line costs
+ * neither an allocation nor a sorted insert.  Devices are merged by the
+ * timestamp of their oldest entry through a small binary heap.
+ */
+#define ENTRY_CHUNK_SIZE (256 * 1024)
+#define ENTRY_ALIGN(n) (((n) + 3) & ~3)
+#define ENTRY_SPACE(e) ENTRY_ALIGN(sizeof(struct logger_entry) + (e)->len + 1)
+
+struct entry_chunk_t {
+    unsigned char buf[ENTRY_CHUNK_SIZE] __attribute__((aligned(4)));
+    size_t head;    /* first byte not yet consumed */
+    size_t tail;    /* first free byte */
+    entry_chunk_t* next;
+};
 
-    queued_entry_t() {
-        next = NULL;
+static entry_chunk_t* g_freeChunks = NULL;
+
+static entry_chunk_t* allocChunk() {
+    entry_chunk_t* chunk = g_freeChunks;
+    if (chunk != NULL) {
+        g_freeChunks = chunk->next;
+    } else {
+        chunk = new entry_chunk_t;
     }
-};
+    chunk->head = chunk->tail = 0;
+    chunk->next = NULL;
+    return chunk;
+}
 
-static int cmp(queued_entry_t* a, queued_entry_t* b) {
-    int n = a->entry.sec - b->entry.sec;
+static void freeChunk(entry_chunk_t* chunk) {
+    chunk->next = g_freeChunks;
+    g_freeChunks = chunk;
+}
+
+static int cmp(struct logger_entry* a, struct logger_entry* b) {
+    int n = a->sec - b->sec;
     if (n != 0) {
         return n;
     }
-    return a->entry.nsec - b->entry.nsec;
+    return a->nsec - b->nsec;
 }
 
 struct log_device_t {
@@ -58,29 +84,118 @@ struct log_device_t {
     int fd;
     bool printed;
     char label;
+    bool archive;   /* an archive file given to -R rather than a log device */
+    int index;  /* order on the command line, breaks timestamp ties */
 
-    queued_entry_t* queue;
+    entry_chunk_t* head;    /* oldest chunk, entries are consumed here */
+    entry_chunk_t* tail;    /* newest chunk, entries are read into it */
+    int count;
     log_device_t* next;
 
     log_device_t(char* d, bool b, char l) {
         device = d;
         binary = b;
         label = l;
-        queue = NULL;
+        archive = false;
+        index = 0;
+        head = NULL;
+        tail = NULL;
+        count = 0;
         next = NULL;
         printed = false;
     }
 
-    void enqueue(queued_entry_t* entry) {
-        if (this->queue == NULL) {
-            this->queue = entry;
-        } else {
-            queued_entry_t** e = &this->queue;
-            while (*e && cmp(entry, *e) >= 0) {
-                e = &((*e)->next);
+    /* room for one more entry of up to LOGGER_ENTRY_MAX_LEN bytes */
+    struct logger_entry* reserve() {
+        if (tail == NULL
+                || tail->tail + ENTRY_ALIGN(LOGGER_ENTRY_MAX_LEN + 1) > ENTRY_CHUNK_SIZE) {
+            entry_chunk_t* chunk = allocChunk();
+            if (tail == NULL) {
+                head = chunk;
+            } else {
+                tail->next = chunk;
+            }
+            tail = chunk;
+        }
+        return (struct logger_entry*) (tail->buf + tail->tail);
+    }
+
+    /* queue the entry last returned by reserve() */
+    void enqueue(struct logger_entry* entry) {
+        tail->tail += ENTRY_SPACE(entry);
+        count++;
+    }
+
+    struct logger_entry* front() {
+        return (struct logger_entry*) (head->buf + head->head);
+    }
+
+    void dequeue() {
+        head->head += ENTRY_SPACE(front());
+        count--;
+        if (head->head == head->tail) {
+            if (head == tail) {
+                head->head = head->tail = 0;
+            } else {
+                entry_chunk_t* chunk = head;
+                head = chunk->next;
+                freeChunk(chunk);
             }
-            entry->next = *e;
-            *e = entry;
+        }
+    }
+};
+
+/* The devices that have entries queued, as a min-heap on front(). */
+struct device_heap_t {
+    log_device_t** devs;
+    int size;
+
+    device_heap_t(int n) {
+        devs = new log_device_t*[n];
+        size = 0;
+    }
+
+    static bool before(log_device_t* a, log_device_t* b) {
+        int n = cmp(a->front(), b->front());
+        return n < 0 || (n == 0 && a->index < b->index);
+    }
+
+    log_device_t* top() {
+        return size ? devs[0] : NULL;
+    }
+
+    void push(log_device_t* dev) {
+        int i = size++;
+        while (i > 0 && before(dev, devs[(i - 1) / 2])) {
+            devs[i] = devs[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+        devs[i] = dev;
+    }
+
+    /* the top device's front() changed or it ran out of entries */
+    void update() {
+        log_device_t* dev = devs[0];
+        if (dev->count == 0) {
+            dev = devs[--size];
+        }
+        int i = 0;
+        for (;;) {
+            int c = 2 * i + 1;
+            if (c >= size) {
+                break;
+            }
+            if (c + 1 < size && before(devs[c + 1], devs[c])) {
+                c++;
+            }
+            if (!before(devs[c], dev)) {
+                break;
+            }
+            devs[i] = devs[c];
+            i = c;
+        }
+        if (i < size) {
+            devs[i] = dev;
         }
     }
 };
@@ -96,9 +211,112 @@ static int g_outFD = -1;
 static off_t g_outByteCount = 0;
 static int g_printBinary = 0;
 static int g_devCount = 0;
+static bool g_benchmark = false;
 
 static EventTagMap* g_eventTagMap = NULL;
 
+/* Output is collected in g_outBuf and written out a batch at a time: when
+ * the buffer fills up, before logcat waits for more log data, and no later
+ * than OUTPUT_FLUSH_MS after the oldest line in it was formatted.
+ */
+#define OUTPUT_BUFFER_SIZE (128 * 1024)
+#define OUTPUT_LINE_ROOM   (8 * 1024)   /* kept free for the next line */
+#define OUTPUT_FLUSH_MS    100
+
+static char g_outBuf[OUTPUT_BUFFER_SIZE];
+static size_t g_outLen = 0;
+static int64_t g_outSince = 0;
+
+/* -A gathers raw entries into archive blocks (see archive.h), which are
+ * written out when full, once the log has been quiet for ARCHIVE_FLUSH_MS
+ * and before exiting.  -R reads archives back.
+ */
+#define ARCHIVE_FLUSH_MS 1000
+
+static bool g_archive = false;
+static bool g_archiveCompress = false;
+static archive_block_t g_archiveBlock;
+static int64_t g_archiveSince = 0;
+static archive_query_t g_archiveQuery;
+static unsigned char g_archiveIn[ARCHIVE_BLOCK_SIZE] __attribute__((aligned(4)));
+
+static int64_t uptimeMillis()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* writes out the buffer, followed by extra if there is one */
+static void flushOutput(const char* extra = NULL, size_t extraLen = 0)
+{
+    struct iovec iov[2];
+    int count = 0;
+    ssize_t ret;
+
+    if (g_outLen) {
+        iov[count].iov_base = g_outBuf;
+        iov[count].iov_len = g_outLen;
+        count++;
+    }
+    if (extraLen) {
+        iov[count].iov_base = (void*) extra;
+        iov[count].iov_len = extraLen;
+        count++;
+    }
+
+    while (count > 0) {
+        ret = writev(g_outFD, iov, count);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("output error");
+            exit(-1);
+        }
+        while (count > 0 && (size_t) ret >= iov[0].iov_len) {
+            ret -= iov[0].iov_len;
+            iov[0] = iov[1];
+            count--;
+        }
+        if (count > 0) {
+            iov[0].iov_base = (char*) iov[0].iov_base + ret;
+            iov[0].iov_len -= ret;
+        }
+    }
+
+    g_outLen = 0;
+}
+
+static void maybeFlushOutput()
+{
+    if (g_outLen && uptimeMillis() - g_outSince >= OUTPUT_FLUSH_MS) {
+        flushOutput();
+    }
+}
+
+/* makes sure a line of up to OUTPUT_LINE_ROOM bytes fits */
+static void reserveOutput()
+{
+    if (sizeof(g_outBuf) - g_outLen < OUTPUT_LINE_ROOM) {
+        flushOutput();
+    }
+    if (g_outLen == 0) {
+        g_outSince = uptimeMillis();
+    }
+}
+
+static void writeOutput(const void* data, size_t len)
+{
+    reserveOutput();
+    if (len > sizeof(g_outBuf) - g_outLen) {
+        flushOutput((const char*) data, len);
+        return;
+    }
+    memcpy(g_outBuf + g_outLen, data, len);
+    g_outLen += len;
+}
+
 static int openLogFile (const char *pathname)
 {
     return open(pathname, O_WRONLY | O_APPEND | O_CREAT, S_IRUSR | S_IWUSR);
@@ -113,6 +331,7 @@ static void rotateLogs()
         return;
     }
 
+    flushOutput();
     close(g_outFD);
 
     for (int i = g_maxRotatedLogs ; i > 0 ; i--) {
@@ -145,16 +364,109 @@ static void rotateLogs()
 
     g_outByteCount = 0;
 
+    if (g_archive) {
+        if (archiveWriteFileHeader(g_outFD) < 0) {
+            perror("couldn't write archive header");
+            exit(-1);
+        }
+        g_outByteCount = sizeof(archive_file_header_t);
+    }
 }
 
 void printBinary(struct logger_entry *buf)
 {
-    size_t size = sizeof(logger_entry) + buf->len;
+    writeOutput(buf, sizeof(logger_entry) + buf->len);
+}
+
+/* entries read back from an archive remember which kind of log they were in */
+static bool isBinary(log_device_t* dev, struct logger_entry *buf)
+{
+    return dev->binary || (dev->archive && (buf->__pad & ARCHIVE_ENTRY_BINARY));
+}
+
+static void flushArchive()
+{
+    const unsigned char* data;
+    size_t len;
+
+    if (g_archiveBlock.hdr.entries == 0) {
+        return;
+    }
+
+    len = g_archiveBlock.finish(g_archiveCompress, &data);
+    flushOutput((const char*) data, len);
+    g_archiveBlock.reset();
+
+    g_outByteCount += len;
+    if (g_logRotateSizeKBytes > 0
+        && (g_outByteCount / 1024) >= g_logRotateSizeKBytes
+    ) {
+        rotateLogs();
+    }
+}
+
+/* milliseconds until the pending block is due, or -1 if there is none */
+static int archiveFlushDelay()
+{
+    if (g_archiveBlock.hdr.entries == 0) {
+        return -1;
+    }
+    int64_t age = uptimeMillis() - g_archiveSince;
+    return age >= ARCHIVE_FLUSH_MS ? 0 : ARCHIVE_FLUSH_MS - age;
+}
+
+static void archiveEntry(log_device_t* dev, struct logger_entry *buf)
+{
+    bool binary = isBinary(dev, buf);
+
+    if (g_archiveBlock.hdr.entries == 0) {
+        g_archiveSince = uptimeMillis();
+    }
+    if (!g_archiveBlock.add(buf, binary)) {
+        flushArchive();
+        g_archiveSince = uptimeMillis();
+        g_archiveBlock.add(buf, binary);
+    }
+}
+
+/* Queues the entries of the next archive block that has any the query
+ * wants; closes the archive at its end.
+ */
+static void readArchiveBlock(log_device_t* dev)
+{
+    size_t len;
     int ret;
-    
-    do {
-        ret = write(g_outFD, buf, size);
-    } while (ret < 0 && errno == EINTR);
+
+    while (dev->count == 0 && dev->fd >= 0) {
+        ret = archiveReadBlock(dev->fd, &g_archiveQuery, g_archiveIn, &len);
+        if (ret <= 0) {
+            if (ret < 0) {
+                fprintf(stderr, "%s: corrupt archive block, skipping the rest\n",
+                        dev->device);
+            }
+            close(dev->fd);
+            dev->fd = -1;
+            break;
+        }
+
+        size_t off = 0;
+        while (off + sizeof(struct logger_entry) <= len) {
+            struct logger_entry* in = (struct logger_entry*) (g_archiveIn + off);
+            if (in->len > LOGGER_ENTRY_MAX_PAYLOAD
+                    || off + ARCHIVE_ENTRY_SIZE(in) > len) {
+                fprintf(stderr, "%s: corrupt archive entry\n", dev->device);
+                break;
+            }
+            off += ARCHIVE_ENTRY_SIZE(in);
+            if (!archiveMatchEntry(&g_archiveQuery, in)) {
+                continue;
+            }
+            struct logger_entry* entry = dev->reserve();
+            memcpy(entry, in, sizeof(struct logger_entry) + in->len);
+            entry->msg[entry->len] = '\0';
+            dev->enqueue(entry);
+        }
+    }
 }
 
 static void processBuffer(log_device_t* dev, struct logger_entry *buf)
@@ -163,8 +475,10 @@ static void processBuffer(log_device_t* dev, struct logger_entry *buf)
     int err;
     AndroidLogEntry entry;
     char binaryMsgBuf[1024];
+    char* line;
+    size_t lineLen;
 
-    if (dev->binary) {
+    if (isBinary(dev, buf)) {
         err = android_log_processBinaryLogBuffer(buf, &entry, g_eventTagMap,
                 binaryMsgBuf, sizeof(binaryMsgBuf));
         //printf(">>> pri=%d len=%d msg='%s'\n",
@@ -180,19 +494,24 @@ static void processBuffer(log_device_t* dev, struct logger_entry *buf)
         if (false && g_devCount > 1) {
             binaryMsgBuf[0] = dev->label;
             binaryMsgBuf[1] = ' ';
-            bytesWritten = write(g_outFD, binaryMsgBuf, 2);
-            if (bytesWritten < 0) {
-                perror("output error");
-                exit(-1);
-            }
+            writeOutput(binaryMsgBuf, 2);
         }
 
-        bytesWritten = android_log_printLogLine(g_logformat, g_outFD, &entry);
-
-        if (bytesWritten < 0) {
+        /* format straight into the output buffer when the line fits */
+        reserveOutput();
+        line = android_log_formatLogLine(g_logformat, g_outBuf + g_outLen,
+                sizeof(g_outBuf) - g_outLen, &entry, &lineLen);
+        if (line == NULL) {
             perror("output error");
             exit(-1);
         }
+        if (line == g_outBuf + g_outLen) {
+            g_outLen += lineLen;
+        } else {
+            flushOutput(line, lineLen);
+            free(line);
+        }
+        bytesWritten = lineLen;
     }
 
     g_outByteCount += bytesWritten;
@@ -208,43 +527,67 @@ error:
     return;
 }
 
-static void chooseFirst(log_device_t* dev, log_device_t** firstdev) {
-    for (*firstdev = NULL; dev != NULL; dev = dev->next) {
-        if (dev->queue != NULL && (*firstdev == NULL || cmp(dev->queue, (*firstdev)->queue) < 0)) {
-            *firstdev = dev;
-        }
-    }
-}
-
 static void maybePrintStart(log_device_t* dev) {
     if (!dev->printed) {
         dev->printed = true;
-        if (g_devCount > 1 && !g_printBinary) {
+        if (g_devCount > 1 && !g_printBinary && !g_archive && !dev->archive) {
             char buf[1024];
             snprintf(buf, sizeof(buf), "--------- beginning of %s\n", dev->device);
-            if (write(g_outFD, buf, strlen(buf)) < 0) {
-                perror("output error");
-                exit(-1);
-            }
+            writeOutput(buf, strlen(buf));
         }
     }
 }
 
-static void skipNextEntry(log_device_t* dev) {
+static void skipNextEntry(device_heap_t* heap) {
+    log_device_t* dev = heap->top();
     maybePrintStart(dev);
-    queued_entry_t* entry = dev->queue;
-    dev->queue = entry->next;
-    delete entry;
+    dev->dequeue();
+    if (dev->archive && dev->count == 0) {
+        readArchiveBlock(dev);
+    }
+    heap->update();
+}
+
+/* --benchmark keeps a copy of every entry logcat would have printed */
+struct bench_entry_t {
+    log_device_t* dev;
+    struct logger_entry* entry;
+};
+
+static bench_entry_t* g_benchEntries = NULL;
+static size_t g_benchCount = 0;
+static size_t g_benchAlloc = 0;
+
+static void saveBenchEntry(log_device_t* dev, struct logger_entry* entry) {
+    if (g_benchCount == g_benchAlloc) {
+        g_benchAlloc = g_benchAlloc ? g_benchAlloc * 2 : 4096;
+        g_benchEntries = (bench_entry_t*) realloc(g_benchEntries,
+                g_benchAlloc * sizeof(bench_entry_t));
+        if (g_benchEntries == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    size_t size = sizeof(struct logger_entry) + entry->len + 1;
+    g_benchEntries[g_benchCount].dev = dev;
+    g_benchEntries[g_benchCount].entry = (struct logger_entry*) malloc(size);
+    memcpy(g_benchEntries[g_benchCount].entry, entry, size);
+    g_benchCount++;
 }
 
-static void printNextEntry(log_device_t* dev) {
+static void printNextEntry(device_heap_t* heap) {
+    log_device_t* dev = heap->top();
     maybePrintStart(dev);
-    if (g_printBinary) {
-        printBinary(&dev->queue->entry);
+    if (g_benchmark) {
+        saveBenchEntry(dev, dev->front());
+    } else if (g_archive) {
+        archiveEntry(dev, dev->front());
+    } else if (g_printBinary) {
+        printBinary(dev->front());
     } else {
-        processBuffer(dev, &dev->queue->entry);
+        processBuffer(dev, dev->front());
     }
-    skipNextEntry(dev);
+    skipNextEntry(heap);
 }
 
 static void readLogLines(log_device_t* devices)
@@ -257,6 +600,7 @@ static void readLogLines(log_device_t* devices)
 
     int result;
     fd_set readset;
+    device_heap_t heap(g_devCount);
 
     for (dev=devices; dev; dev = dev->next) {
         if (dev->fd > max) {
@@ -267,26 +611,35 @@ static void readLogLines(log_device_t* devices)
     while (1) {
         do {
             timeval timeout = { 0, 5000 /* 5ms */ }; // If we oversleep it's ok, i.e. ignore EINTR.
+            timeval* wait = &timeout;
+            if (sleep) {
+                // only wake up to write out a pending archive block
+                int delay = archiveFlushDelay();
+                if (delay < 0) {
+                    wait = NULL;
+                } else {
+                    timeout.tv_sec = delay / 1000;
+                    timeout.tv_usec = (delay % 1000) * 1000;
+                }
+            }
             FD_ZERO(&readset);
             for (dev=devices; dev; dev = dev->next) {
                 FD_SET(dev->fd, &readset);
             }
-            result = select(max + 1, &readset, NULL, NULL, sleep ? NULL : &timeout);
+            result = select(max + 1, &readset, NULL, NULL, wait);
         } while (result == -1 && errno == EINTR);
 
         if (result >= 0) {
             for (dev=devices; dev; dev = dev->next) {
                 if (FD_ISSET(dev->fd, &readset)) {
-                    queued_entry_t* entry = new queued_entry_t();
+                    struct logger_entry* entry = dev->reserve();
                     /* NOTE: driver guarantees we read exactly one full entry */
-                    ret = read(dev->fd, entry->buf, LOGGER_ENTRY_MAX_LEN);
+                    ret = read(dev->fd, entry, LOGGER_ENTRY_MAX_LEN);
                     if (ret < 0) {
                         if (errno == EINTR) {
-                            delete entry;
                             goto next;
                         }
                         if (errno == EAGAIN) {
-                            delete entry;
                             break;
                         }
                         perror("logcat read");
@@ -296,15 +649,18 @@ static void readLogLines(log_device_t* devices)
                         fprintf(stderr, "read: Unexpected EOF!\n");
                         exit(EXIT_FAILURE);
                     }
-                    else if (entry->entry.len != ret - sizeof(struct logger_entry)) {
+                    else if (entry->len != ret - sizeof(struct logger_entry)) {
                         fprintf(stderr, "read: unexpected length. Expected %d, got %d\n",
-                                entry->entry.len, ret - sizeof(struct logger_entry));
+                                entry->len, ret - sizeof(struct logger_entry));
                         exit(EXIT_FAILURE);
                     }
 
-                    entry->entry.msg[entry->entry.len] = '\0';
+                    entry->msg[entry->len] = '\0';
 
                     dev->enqueue(entry);
+                    if (dev->count == 1) {
+                        heap.push(dev);
+                    }
                     ++queued_lines;
                 }
             }
@@ -313,18 +669,18 @@ static void readLogLines(log_device_t* devices)
                 // we did our short timeout trick and there's nothing new
                 // print everything we have and wait for more data
                 sleep = true;
-                while (true) {
-                    chooseFirst(devices, &dev);
-                    if (dev == NULL) {
-                        break;
-                    }
+                while (heap.top() != NULL) {
                     if (g_tail_lines == 0 || queued_lines <= g_tail_lines) {
-                        printNextEntry(dev);
+                        printNextEntry(&heap);
                     } else {
-                        skipNextEntry(dev);
+                        skipNextEntry(&heap);
                     }
                     --queued_lines;
                 }
+                flushOutput();
+                if (g_nonblock || archiveFlushDelay() == 0) {
+                    flushArchive();
+                }
 
                 // the caller requested to just dump the log and exit
                 if (g_nonblock) {
@@ -334,17 +690,18 @@ static void readLogLines(log_device_t* devices)
                 // print all that aren't the last in their list
                 sleep = false;
                 while (g_tail_lines == 0 || queued_lines > g_tail_lines) {
-                    chooseFirst(devices, &dev);
-                    if (dev == NULL || dev->queue->next == NULL) {
+                    dev = heap.top();
+                    if (dev == NULL || dev->count == 1) {
                         break;
                     }
                     if (g_tail_lines == 0) {
-                        printNextEntry(dev);
+                        printNextEntry(&heap);
                     } else {
-                        skipNextEntry(dev);
+                        skipNextEntry(&heap);
                     }
                     --queued_lines;
                 }
+                maybeFlushOutput();
             }
         }
 next:
@@ -352,6 +709,65 @@ next:
     }
 }
 
+/* -R: each archive file is a device fed by readArchiveBlock(), merged on
+ * time through the same heap as live logs.
+ */
+static void readArchives(log_device_t* archives)
+{
+    log_device_t* dev;
+    device_heap_t heap(g_devCount);
+
+    for (dev = archives; dev; dev = dev->next) {
+        readArchiveBlock(dev);
+        if (dev->count > 0) {
+            heap.push(dev);
+        }
+    }
+
+    while (heap.top() != NULL) {
+        printNextEntry(&heap);
+    }
+    flushOutput();
+    flushArchive();
+}
+
+/* Formats everything saved by saveBenchEntry() in each -v format, into
+ * /dev/null through the usual output path, and reports the rates.
+ */
+static void runBenchmark()
+{
+    static const char* formats[] = {
+        "brief", "process", "tag", "thread", "raw", "time", "threadtime", "long"
+    };
+
+    printf("%u entries\n", (unsigned) g_benchCount);
+    if (g_benchCount == 0) {
+        return;
+    }
+
+    for (size_t f = 0; f < sizeof(formats) / sizeof(formats[0]); f++) {
+        android_log_setPrintFormat(g_logformat,
+                android_log_formatFromString(formats[f]));
+
+        size_t lines = 0;
+        g_outByteCount = 0;
+        int64_t start = uptimeMillis();
+        int64_t elapsed;
+        do {
+            for (size_t i = 0; i < g_benchCount; i++) {
+                processBuffer(g_benchEntries[i].dev, g_benchEntries[i].entry);
+            }
+            flushOutput();
+            lines += g_benchCount;
+            elapsed = uptimeMillis() - start;
+        } while (elapsed < 1000);
+
+        printf("%-10s %10.0f lines/s %8.1f MB/s\n", formats[f],
+                lines * 1000.0 / elapsed,
+                g_outByteCount * 1000.0 / elapsed / (1024 * 1024));
+    }
+}
+
 static int clearLog(int logfd)
 {
     return ioctl(logfd, LOGGER_FLUSH_LOG);
@@ -389,6 +805,126 @@ static void setupOutput()
 
         g_outByteCount = statbuf.st_size;
     }
+
+    if (g_archive) {
+        g_archiveBlock.reset();
+
+        if (g_outByteCount > 0) {
+            // appending: it has to be an archive already
+            int fd = open(g_outputFileName, O_RDONLY);
+            if (fd < 0 || archiveReadFileHeader(fd) < 0) {
+                fprintf(stderr, "%s is not a logcat archive\n", g_outputFileName);
+                exit(-1);
+            }
+            close(fd);
+        } else if (archiveWriteFileHeader(g_outFD) < 0) {
+            perror("couldn't write archive header");
+            exit(-1);
+        } else {
+            g_outByteCount = sizeof(archive_file_header_t);
+        }
+    }
+}
+
+/* Parses a time for -S/-E: "[YYYY-]MM-DD hh:mm:ss[.frac]" in local time,
+ * as -v time prints it (the current year if none is given), or seconds
+ * since the Epoch.  Returns 0, or -1 if it is neither.
+ */
+static int parseTime(const char* s, int64_t* ns)
+{
+    struct tm tm;
+    time_t now = time(NULL);
+    int64_t sec;
+    int n = 0;
+
+    localtime_r(&now, &tm);
+    if (sscanf(s, "%d-%d-%d %d:%d:%d%n", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+               &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &n) == 6) {
+        tm.tm_year -= 1900;
+    } else if (sscanf(s, "%d-%d %d:%d:%d%n", &tm.tm_mon, &tm.tm_mday,
+               &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &n) != 5) {
+        n = 0;
+    }
+
+    if (n > 0) {
+        tm.tm_mon -= 1;
+        tm.tm_isdst = -1;
+        sec = mktime(&tm);
+    } else {
+        char* end;
+        sec = strtoll(s, &end, 10);
+        if (end == s) {
+            return -1;
+        }
+        n = end - s;
+    }
+
+    int64_t frac = 0;
+    int digits = 0;
+    if (s[n] == '.') {
+        for (n++; isdigit(s[n]); n++) {
+            if (digits++ < 9) {
+                frac = frac * 10 + (s[n] - '0');
+            }
+        }
+        for (; digits < 9; digits++) {
+            frac *= 10;
+        }
+    }
+    if (s[n] != '\0') {
+        return -1;
+    }
+
+    *ns = sec * 1000000000LL + frac;
+    return 0;
+}
+
+/* adds an archive file given to -R to the list, with the files it was
+ * rotated into, oldest first
+ */
+static void addArchive(log_device_t** archives, const char* name)
+{
+    int rotated = 0;
+    char* path;
+
+    for (;;) {
+        asprintf(&path, "%s.%d", name, rotated + 1);
+        bool exists = access(path, F_OK) == 0;
+        free(path);
+        if (!exists) {
+            break;
+        }
+        rotated++;
+    }
+
+    for (int i = rotated; i >= 0; i--) {
+        if (i > 0) {
+            asprintf(&path, "%s.%d", name, i);
+        } else {
+            path = strdup(name);
+        }
+
+        log_device_t* dev = new log_device_t(path, false, 'A');
+        dev->archive = true;
+        dev->printed = true;
+        dev->fd = open(path, O_RDONLY);
+        if (dev->fd < 0) {
+            fprintf(stderr, "Unable to open archive '%s': %s\n",
+                path, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        if (archiveReadFileHeader(dev->fd) < 0) {
+            fprintf(stderr, "%s is not a logcat archive\n", path);
+            exit(EXIT_FAILURE);
+        }
+        dev->index = g_devCount++;
+
+        log_device_t** tail = archives;
+        while (*tail) {
+            tail = &(*tail)->next;
+        }
+        *tail = dev;
+    }
 }
 
 static void show_help(const char *cmd)
@@ -410,7 +946,18 @@ static void show_help(const char *cmd)
                     "  -b <buffer>     Request alternate ring buffer, 'main', 'system', 'radio'\n"
                     "                  or 'events'. Multiple -b parameters are allowed and the\n"
                     "                  results are interleaved. The default is -b main -b system.\n"
-                    "  -B              output the log in binary");
+                    "  -B              output the log in binary\n"
+                    "  -A              output an indexed binary archive instead of text.\n"
+                    "                  Requires -f; rotates like text with -r and -n\n"
+                    "  -z              deflate the blocks of an archive written with -A\n"
+                    "  -R <file>       read back an archive written with -A, along with the\n"
+                    "                  files it was rotated into. Multiple -R are merged\n"
+                    "  -S <time>       with -R, only entries at or after <time>, given as\n"
+                    "                  '[YYYY-]MM-DD hh:mm:ss[.mmm]' or seconds since the Epoch\n"
+                    "  -E <time>       with -R, only entries at or before <time>\n"
+                    "  -p <pid>        with -R, only entries from process <pid>\n"
+                    "  --benchmark     Read the log like -d, then report how fast it is\n"
+                    "                  formatted in each -v format. Must come first.");
 
 
     fprintf(stderr,"\nfilterspecs are a series of \n"
@@ -424,6 +971,8 @@ static void show_help(const char *cmd)
                    "  F    Fatal\n"
                    "  S    Silent (supress all output)\n"
                    "\n'*' means '*:d' and <tag> by itself means <tag>:v\n"
+                   "<tag>* (e.g. Wifi*) applies to every tag with that prefix; a rule for\n"
+                   "the exact tag wins over a prefix, and a longer prefix over a shorter one\n"
                    "\nIf not specified on the commandline, filterspec is set from ANDROID_LOG_TAGS.\n"
                    "If no filterspec is found, filter defaults to '*:I'\n"
                    "\nIf not specified with -v, format is set from ANDROID_PRINTF_LOG\n"
@@ -463,10 +1012,12 @@ int main(int argc, char **argv)
     int mode = O_RDONLY;
     const char *forceFilters = NULL;
     log_device_t* devices = NULL;
+    log_device_t* archives = NULL;
     log_device_t* dev;
     bool needBinary = false;
 
     g_logformat = android_log_format_new();
+    archiveQueryInit(&android::g_archiveQuery);
 
     if (argc == 2 && 0 == strcmp(argv[1], "--test")) {
         logprint_run_tests();
@@ -478,10 +1029,18 @@ int main(int argc, char **argv)
         exit(0);
     }
 
+    if (argc >= 2 && 0 == strcmp(argv[1], "--benchmark")) {
+        android::g_benchmark = true;
+        g_nonblock = true;
+        argv[1] = argv[0];
+        argv++;
+        argc--;
+    }
+
     for (;;) {
         int ret;
 
-        ret = getopt(argc, argv, "cdt:gsQf:r::n:v:b:B");
+        ret = getopt(argc, argv, "cdt:gsQf:r::n:v:b:BAzR:S:E:p:");
 
         if (ret < 0) {
             break;
@@ -527,10 +1086,11 @@ int main(int argc, char **argv)
                         dev = dev->next;
                     }
                     dev->next = new log_device_t(buf, binary, optarg[0]);
+                    dev = dev->next;
                 } else {
-                    devices = new log_device_t(buf, binary, optarg[0]);
+                    devices = dev = new log_device_t(buf, binary, optarg[0]);
                 }
-                android::g_devCount++;
+                dev->index = android::g_devCount++;
             }
             break;
 
@@ -538,6 +1098,39 @@ int main(int argc, char **argv)
                 android::g_printBinary = 1;
             break;
 
+            case 'A':
+                android::g_archive = true;
+            break;
+
+            case 'z':
+                android::g_archiveCompress = true;
+            break;
+
+            case 'R':
+                android::addArchive(&archives, optarg);
+            break;
+
+            case 'S':
+            case 'E':
+                if (android::parseTime(optarg, ret == 'S'
+                        ? &android::g_archiveQuery.begin
+                        : &android::g_archiveQuery.end) < 0) {
+                    fprintf(stderr, "Invalid time for -%c\n", ret);
+                    android::show_help(argv[0]);
+                    exit(-1);
+                }
+            break;
+
+            case 'p':
+                if (!isdigit(optarg[0])) {
+                    fprintf(stderr,"Invalid parameter to -p\n");
+                    android::show_help(argv[0]);
+                    exit(-1);
+                }
+                android::g_archiveQuery.hasPid = true;
+                android::g_archiveQuery.pid = atoi(optarg);
+            break;
+
             case 'f':
                 // redirect output to a file
 
@@ -658,7 +1251,13 @@ int main(int argc, char **argv)
         }
     }
 
-    if (!devices) {
+    if (archives && (devices || clearLog || getLogSize)) {
+        fprintf(stderr,"-R cannot be combined with -b, -c or -g\n");
+        android::show_help(argv[0]);
+        exit(-1);
+    }
+
+    if (!devices && !archives) {
         devices = new log_device_t(strdup("/dev/"LOGGER_LOG_MAIN), false, 'm');
         android::g_devCount = 1;
         int accessmode =
@@ -667,7 +1266,7 @@ int main(int argc, char **argv)
         // only add this if it's available
         if (0 == access("/dev/"LOGGER_LOG_SYSTEM, accessmode)) {
             devices->next = new log_device_t(strdup("/dev/"LOGGER_LOG_SYSTEM), false, 's');
-            android::g_devCount++;
+            devices->next->index = android::g_devCount++;
         }
     }
 
@@ -679,7 +1278,18 @@ int main(int argc, char **argv)
         exit(-1);
     }
 
-    android::setupOutput();
+    if (android::g_archive && android::g_outputFileName == NULL) {
+        fprintf(stderr,"-A requires -f as well\n");
+        android::show_help(argv[0]);
+        exit(-1);
+    }
+
+    if (android::g_benchmark) {
+        android::g_logRotateSizeKBytes = 0;
+        android::g_outFD = open("/dev/null", O_WRONLY);
+    } else {
+        android::setupOutput();
+    }
 
     if (hasSetLogFormat == 0) {
         const char* logFormat = getenv("ANDROID_PRINTF_LOG");
@@ -727,6 +1337,13 @@ int main(int argc, char **argv)
         }
     }
 
+    if (archives) {
+        android::g_archiveQuery.format = g_logformat;
+        android::g_eventTagMap = android_openEventTagMap(EVENT_TAG_MAP_FILE);
+        android::readArchives(archives);
+        return 0;
+    }
+
     dev = devices;
     while (dev) {
         dev->fd = open(dev->device, mode);
@@ -785,5 +1402,9 @@ int main(int argc, char **argv)
 
     android::readLogLines(devices);
 
+    if (android::g_benchmark) {
+        android::runBenchmark();
+    }
+
     return 0;
 }
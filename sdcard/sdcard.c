@@ -28,9 +28,12 @@
 #include <limits.h>
 #include <ctype.h>
 #include <pthread.h>
+#include <signal.h>
+#include <time.h>
 #include <sys/time.h>
 #include <sys/resource.h>
 #include <sys/inotify.h>
+#include <sys/ioctl.h>
 
 #include <cutils/fs.h>
 #include <cutils/hashmap.h>
@@ -57,7 +60,8 @@
  * Things I believe to be true:
  *
  * - ops that return a fuse_entry (LOOKUP, MKNOD, MKDIR, LINK, SYMLINK,
- * CREAT) must bump that node's refcount
+ * CREAT, and each entry of READDIRPLUS with a nodeid) must bump that node's
+ * refcount
  * - don't forget that FORGET can forget multiple references (req->nlookup)
  * - if an op that returns a fuse_entry fails writing the reply to the
  * kernel, you must rollback the refcount to reflect the reference the
@@ -103,8 +107,10 @@
 /* Maximum number of bytes to write in one request. */
 #define MAX_WRITE (256 * 1024)
 
-/* Maximum number of bytes to read in one request. */
-#define MAX_READ (128 * 1024)
+/* Maximum number of bytes to read in one request.  The read buffer shares
+ * storage with the request buffer, so this costs no extra memory as long as
+ * it stays at or below MAX_WRITE. */
+#define MAX_READ (256 * 1024)
 
 /* Largest possible request.
  * The request size is bounded by the maximum size of a FUSE_WRITE request because it has
@@ -114,6 +120,24 @@
 /* Default number of threads. */
 #define DEFAULT_NUM_THREADS 2
 
+/* Default time in seconds the kernel may cache entries and attributes. */
+#define DEFAULT_ENTRY_TIMEOUT 10
+#define DEFAULT_ATTR_TIMEOUT 10
+
+/* Number of striped locks guarding directory child lists. */
+#define CHILD_LOCK_STRIPES 64
+
+/* Number of children after which a directory gets a hashed child index. */
+#define CHILD_HASH_THRESHOLD 32
+
+/* Capacity requested for the per-handler splice pipes; large enough to hold
+ * the biggest request or read reply. */
+#define SPLICE_PIPE_SIZE (MAX_REQUEST_SIZE + 4096)
+
+#ifndef F_SETPIPE_SZ
+#define F_SETPIPE_SZ 1031
+#endif
+
 /* Pseudo-error constant used to indicate that no fuse status is needed
  * or that a reply has already been written. */
 #define NO_STATUS 1
@@ -153,10 +177,16 @@ typedef enum {
 
 struct handle {
     int fd;
+    struct node *node;          /* kept alive by the kernel while open */
 };
 
 struct dirhandle {
     DIR *d;
+
+    /* Offset of the next entry to return, and that entry if it was already
+     * read from 'd' but did not fit in the previous reply. */
+    __u64 next_off;
+    struct dirent *pending;
 };
 
 struct node {
@@ -175,6 +205,15 @@ struct node {
     struct node *child;         /* first contained file by this dir */
     struct node *parent;        /* containing directory */
 
+    /* Hashed index of children, built lazily once the directory holds
+     * CHILD_HASH_THRESHOLD children.  Buckets are keyed by a case-folded
+     * hash of the name so that case-insensitive probes work too. */
+    size_t child_count;
+    size_t child_hash_size;     /* number of buckets, power of two */
+    struct node **child_hash;
+    struct node *hash_next;     /* per-dir hash bucket chain */
+    __u32 namehash;             /* case-folded hash of name */
+
     size_t namelen;
     char *name;
     /* If non-null, this is the real name of the file in the underlying storage.
@@ -188,6 +227,11 @@ struct node {
      * position. Used to support things like OBB. */
     char* graft_path;
     size_t graft_pathlen;
+
+    /* Daemon-side attribute cache, valid until 'attr_expire' (monotonic
+     * nanoseconds, 0 when invalid).  Guarded by the node's attr lock. */
+    struct fuse_attr attr;
+    __u64 attr_expire;
 };
 
 static int str_hash(void *key) {
@@ -207,9 +251,29 @@ static bool int_equals(void *keyA, void *keyB) {
     return keyA == keyB;
 }
 
+/* Immutable view of packages.list.  Readers use fuse->packages while holding
+ * the tree lock shared and need no other lock; a reload swaps in a new
+ * snapshot and frees the old one once no reader can still see it. */
+struct package_list {
+    Hashmap* package_to_appid;
+    Hashmap* appid_with_rw;
+};
+
 /* Global data structure shared by all fuse handlers. */
 struct fuse {
-    pthread_mutex_t lock;
+    /* Protects the shape of the node tree: parent links, names, and node
+     * lifetime.  Handlers hold it shared while building paths and looking
+     * up children, so they run concurrently; renames and the destruction
+     * of nodes hold it exclusively. */
+    pthread_rwlock_t lock;
+
+    /* Serializes lookup-or-create of children within a directory while
+     * the tree lock is only held shared.  Striped by parent node. */
+    pthread_mutex_t child_locks[CHILD_LOCK_STRIPES];
+
+    /* Guards the cached attributes of nodes.  Striped by node, and separate
+     * from child_locks since both may be held at once. */
+    pthread_mutex_t attr_locks[CHILD_LOCK_STRIPES];
 
     __u64 next_generation;
     int fd;
@@ -219,8 +283,24 @@ struct fuse {
     struct node root;
     char obbpath[PATH_MAX];
 
-    Hashmap* package_to_appid;
-    Hashmap* appid_with_rw;
+    /* Zero-copy I/O requested on the command line, and what the kernel
+     * offered for it in INIT. */
+    bool use_splice;
+    bool splice_read;
+    bool splice_write;
+    unsigned int splice_flags;
+
+    /* Validity in seconds of entries and attributes cached by the kernel,
+     * and of attributes cached by this daemon (0 disables the latter). */
+    __u64 entry_timeout;
+    __u64 attr_timeout;
+    __u64 attr_cache_timeout;
+
+    /* Daemon-side attribute cache statistics. */
+    unsigned long attr_cache_hits;
+    unsigned long attr_cache_misses;
+
+    struct package_list* packages;
 };
 
 /* Private data used by a single fuse handler. */
@@ -228,6 +308,21 @@ struct fuse_handler {
     struct fuse* fuse;
     int token;
 
+    /* Fuse device this handler reads requests from and replies on; a clone
+     * of fuse->fd when the kernel supports it. */
+    int fd;
+
+    /* Pipes used to splice file data to and from the fuse device, created
+     * the first time they are needed.  'data_pipe' carries file data and
+     * requests read from the device; 'reply_pipe' assembles a reply header
+     * in front of spliced data so the reply reaches the kernel in one piece. */
+    int data_pipe[2];
+    int reply_pipe[2];
+    int pipes_state;            /* 0 = not yet created, 1 = ready, -1 = unusable */
+
+    /* Number of WRITE payload bytes left in data_pipe by the current request. */
+    size_t spliced_len;
+
     /* To save memory, we never use the contents of the request buffer and the read
      * buffer at the same time.  This allows us to share the underlying storage. */
     union {
@@ -246,20 +341,28 @@ static inline __u64 ptr_to_id(void *ptr)
     return (__u64) (uintptr_t) ptr;
 }
 
+static pthread_mutex_t* get_child_lock(struct fuse* fuse, struct node* parent)
+{
+    return &fuse->child_locks[(ptr_to_id(parent) >> 4) % CHILD_LOCK_STRIPES];
+}
+
+/* Caller must hold the tree lock (shared is enough) or already own a
+ * reference to the node. */
 static void acquire_node_locked(struct node* node)
 {
-    node->refcount++;
+    __sync_add_and_fetch(&node->refcount, 1);
     TRACE("ACQUIRE %p (%s) rc=%d\n", node, node->name, node->refcount);
 }
 
 static void remove_node_from_parent_locked(struct node* node);
 
+/* Caller must hold the tree lock exclusively, since the node may be
+ * destroyed and unlinked from its parent. */
 static void release_node_locked(struct node* node)
 {
     TRACE("RELEASE %p (%s) rc=%d\n", node, node->name, node->refcount);
     if (node->refcount > 0) {
-        node->refcount--;
-        if (!node->refcount) {
+        if (!__sync_sub_and_fetch(&node->refcount, 1)) {
             TRACE("DESTROY %p (%s)\n", node, node->name);
             remove_node_from_parent_locked(node);
 
@@ -267,6 +370,7 @@ static void release_node_locked(struct node* node)
             memset(node->name, 0xef, node->namelen);
             free(node->name);
             free(node->actual_name);
+            free(node->child_hash);
             memset(node, 0xfc, sizeof(*node));
             free(node);
         }
@@ -275,16 +379,95 @@ static void release_node_locked(struct node* node)
     }
 }
 
+/* Drops 'count' references owned by the caller.  References that cannot
+ * bring the node to zero are dropped without touching the tree lock; only
+ * the final release takes it exclusively to destroy the node. */
+static void release_node(struct fuse* fuse, struct node* node, __u64 count)
+{
+    __u32 old = node->refcount;
+    while (old > count) {
+        __u32 cur = __sync_val_compare_and_swap(&node->refcount, old, old - count);
+        if (cur == old) {
+            TRACE("RELEASE %p (%s) rc=%d\n", node, node->name, old - count);
+            return;
+        }
+        old = cur;
+    }
+
+    pthread_rwlock_wrlock(&fuse->lock);
+    while (count--) {
+        release_node_locked(node);
+    }
+    pthread_rwlock_unlock(&fuse->lock);
+}
+
+static __u32 hash_name_icase(const char* name)
+{
+    __u32 hash = 2166136261u;
+    while (*name) {
+        hash = (hash ^ (unsigned char) tolower(*name++)) * 16777619u;
+    }
+    return hash;
+}
+
+static void insert_child_hash_locked(struct node* parent, struct node* node)
+{
+    struct node** bucket = &parent->child_hash[node->namehash & (parent->child_hash_size - 1)];
+    node->hash_next = *bucket;
+    *bucket = node;
+}
+
+/* (Re)builds the child index of a directory with 'size' buckets.
+ * On allocation failure the old index, if any, is kept. */
+static bool rebuild_child_hash_locked(struct node* parent, size_t size)
+{
+    struct node** child_hash = calloc(size, sizeof(struct node*));
+    struct node* node;
+
+    if (!child_hash) {
+        return false;
+    }
+    free(parent->child_hash);
+    parent->child_hash = child_hash;
+    parent->child_hash_size = size;
+    for (node = parent->child; node; node = node->next) {
+        insert_child_hash_locked(parent, node);
+    }
+    return true;
+}
+
 static void add_node_to_parent_locked(struct node *node, struct node *parent) {
     node->parent = parent;
     node->next = parent->child;
+    node->namehash = hash_name_icase(node->name);
     parent->child = node;
+    parent->child_count++;
+    if (parent->child_hash && parent->child_count <= parent->child_hash_size) {
+        insert_child_hash_locked(parent, node);
+    } else if (parent->child_count >= CHILD_HASH_THRESHOLD
+            && rebuild_child_hash_locked(parent, parent->child_hash
+                    ? parent->child_hash_size * 2 : CHILD_HASH_THRESHOLD * 2)) {
+        /* new index already includes the node */
+    } else if (parent->child_hash) {
+        /* could not grow the index; chains just get longer */
+        insert_child_hash_locked(parent, node);
+    }
     acquire_node_locked(parent);
 }
 
 static void remove_node_from_parent_locked(struct node* node)
 {
     if (node->parent) {
+        if (node->parent->child_hash) {
+            struct node** bucket = &node->parent->child_hash[
+                    node->namehash & (node->parent->child_hash_size - 1)];
+            while (*bucket != node) {
+                bucket = &(*bucket)->hash_next;
+            }
+            *bucket = node->hash_next;
+            node->hash_next = NULL;
+        }
+        node->parent->child_count--;
         if (node->parent->child == node) {
             node->parent->child = node->parent->child->next;
         } else {
@@ -300,7 +483,31 @@ static void remove_node_from_parent_locked(struct node* node)
     }
 }
 
+/* Finds a child whose name matches ignoring case, for resolving names that
+ * do not exist on disk with the requested case.  Same locking rules as
+ * lookup_child_by_name_locked(). */
+static struct node *lookup_child_by_name_icase_locked(struct node *node, const char *name)
+{
+    if (node->child_hash) {
+        __u32 hash = hash_name_icase(name);
+        for (node = node->child_hash[hash & (node->child_hash_size - 1)]; node;
+                node = node->hash_next) {
+            if (node->namehash == hash && !strcasecmp(name, node->name)) {
+                return node;
+            }
+        }
+        return 0;
+    }
+    for (node = node->child; node; node = node->next) {
+        if (!strcasecmp(name, node->name)) {
+            return node;
+        }
+    }
+    return 0;
+}
+
 /* Gets the absolute path to a node into the provided buffer.
+ * Only reads the tree, so the tree lock may be held shared.
  *
  * Populates 'buf' with the path and returns the length of the path on success,
  * or returns -1 if the path is too long for the provided buffer.
@@ -340,12 +547,13 @@ static ssize_t get_node_path_locked(struct node* node, char* buf, size_t bufsize
  * Performs a case-insensitive search for the file and sets the buffer to the path
  * of the first matching file.  If 'search' is zero or if no match is found, sets
  * the buffer to the path that the file would have, assuming the name were case-sensitive.
+ * Children already known under 'parent' are probed before scanning the directory.
  *
  * Populates 'buf' with the path and returns the actual name (within 'buf') on success,
  * or returns NULL if the path is too long for the provided buffer.
  */
-static char* find_file_within(const char* path, const char* name,
-        char* buf, size_t bufsize, int search)
+static char* find_file_within(struct fuse* fuse, struct node* parent,
+        const char* path, const char* name, char* buf, size_t bufsize, int search)
 {
     size_t pathlen = strlen(path);
     size_t namelen = strlen(name);
@@ -363,6 +571,27 @@ static char* find_file_within(const char* path, const char* name,
 
     if (search && access(buf, F_OK)) {
         struct dirent* entry;
+        struct node* known;
+        bool found = false;
+
+        pthread_rwlock_rdlock(&fuse->lock);
+        pthread_mutex_lock(get_child_lock(fuse, parent));
+        known = lookup_child_by_name_icase_locked(parent, name);
+        if (known) {
+            memcpy(actual, known->actual_name ? known->actual_name : known->name, namelen);
+        }
+        pthread_mutex_unlock(get_child_lock(fuse, parent));
+        pthread_rwlock_unlock(&fuse->lock);
+        if (known) {
+            found = !access(buf, F_OK);
+            if (!found) {
+                memcpy(actual, name, namelen);
+            }
+        }
+        if (found) {
+            return actual;
+        }
+
         DIR* dir = opendir(path);
         if (!dir) {
             ERROR("opendir %s failed: %s\n", path, strerror(errno));
@@ -404,6 +633,58 @@ static void attr_from_stat(struct fuse_attr *attr, const struct stat *s, const s
     attr->mode = (attr->mode & S_IFMT) | filtered_mode;
 }
 
+static __u64 now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (__u64) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static pthread_mutex_t* get_attr_lock(struct fuse* fuse, struct node* node)
+{
+    return &fuse->attr_locks[(ptr_to_id(node) >> 4) % CHILD_LOCK_STRIPES];
+}
+
+/* Copies the cached attributes of a node into 'attr' if they are fresh. */
+static bool get_cached_attr(struct fuse* fuse, struct node* node, struct fuse_attr* attr)
+{
+    bool hit = false;
+
+    if (!fuse->attr_cache_timeout) {
+        return false;
+    }
+    pthread_mutex_lock(get_attr_lock(fuse, node));
+    if (node->attr_expire && node->attr_expire > now_ns()) {
+        *attr = node->attr;
+        hit = true;
+    }
+    pthread_mutex_unlock(get_attr_lock(fuse, node));
+    __sync_fetch_and_add(hit ? &fuse->attr_cache_hits : &fuse->attr_cache_misses, 1);
+    return hit;
+}
+
+static void put_cached_attr(struct fuse* fuse, struct node* node, const struct fuse_attr* attr)
+{
+    if (!fuse->attr_cache_timeout) {
+        return;
+    }
+    pthread_mutex_lock(get_attr_lock(fuse, node));
+    node->attr = *attr;
+    node->attr_expire = now_ns() + fuse->attr_cache_timeout * 1000000000ULL;
+    pthread_mutex_unlock(get_attr_lock(fuse, node));
+}
+
+/* Drops the cached attributes of a node after a local mutation. */
+static void invalidate_attr(struct fuse* fuse, struct node* node)
+{
+    if (!fuse->attr_cache_timeout || !node) {
+        return;
+    }
+    pthread_mutex_lock(get_attr_lock(fuse, node));
+    node->attr_expire = 0;
+    pthread_mutex_unlock(get_attr_lock(fuse, node));
+}
+
 static int touch(char* path, mode_t mode) {
     int fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW, mode);
     if (fd == -1) {
@@ -487,7 +768,7 @@ static void derive_permissions_locked(struct fuse* fuse, struct node *parent,
         break;
     case PERM_ANDROID_DATA:
     case PERM_ANDROID_OBB:
-        appid = (appid_t) hashmapGet(fuse->package_to_appid, node->name);
+        appid = (appid_t) hashmapGet(fuse->packages->package_to_appid, node->name);
         if (appid != 0) {
             node->uid = multiuser_get_uid(parent->userid, appid);
         }
@@ -511,7 +792,7 @@ static bool get_caller_has_rw_locked(struct fuse* fuse, const struct fuse_in_hea
     }
 
     appid_t appid = multiuser_get_app_id(hdr->uid);
-    return hashmapContainsKey(fuse->appid_with_rw, (void*) appid);
+    return hashmapContainsKey(fuse->packages->appid_with_rw, (void*) appid);
 }
 
 /* Kernel has already enforced everything we returned through
@@ -586,7 +867,7 @@ struct node *create_node_locked(struct fuse* fuse,
     }
     node->namelen = namelen;
     node->nid = ptr_to_id(node);
-    node->gen = fuse->next_generation++;
+    node->gen = __sync_fetch_and_add(&fuse->next_generation, 1);
 
     derive_permissions_locked(fuse, parent, node);
     acquire_node_locked(node);
@@ -635,6 +916,8 @@ static int rename_node_locked(struct node *node, const char *name,
     return 0;
 }
 
+/* Node ids are the node addresses themselves, so resolving one needs no
+ * lock; the kernel's outstanding reference keeps the node alive. */
 static struct node *lookup_node_by_id_locked(struct fuse *fuse, __u64 nid)
 {
     if (nid == FUSE_ROOT_ID) {
@@ -654,8 +937,20 @@ static struct node* lookup_node_and_path_by_id_locked(struct fuse* fuse, __u64 n
     return node;
 }
 
+/* Caller must hold the tree lock exclusively, or shared together with
+ * the child lock of the directory. */
 static struct node *lookup_child_by_name_locked(struct node *node, const char *name)
 {
+    if (node->child_hash) {
+        __u32 hash = hash_name_icase(name);
+        for (node = node->child_hash[hash & (node->child_hash_size - 1)]; node;
+                node = node->hash_next) {
+            if (node->namehash == hash && !strcmp(name, node->name)) {
+                return node;
+            }
+        }
+        return 0;
+    }
     for (node = node->child; node; node = node->next) {
         /* use exact string comparison, nodes that differ by case
          * must be considered distinct even if they refer to the same
@@ -668,28 +963,85 @@ static struct node *lookup_child_by_name_locked(struct node *node, const char *n
     return 0;
 }
 
+/* Drops the cached attributes of a named child, if it is known. */
+static void invalidate_child_attr(struct fuse* fuse, struct node* parent, const char* name)
+{
+    struct node* child;
+
+    if (!fuse->attr_cache_timeout) {
+        return;
+    }
+    pthread_rwlock_rdlock(&fuse->lock);
+    pthread_mutex_lock(get_child_lock(fuse, parent));
+    child = lookup_child_by_name_locked(parent, name);
+    invalidate_attr(fuse, child);
+    pthread_mutex_unlock(get_child_lock(fuse, parent));
+    pthread_rwlock_unlock(&fuse->lock);
+}
+
 static struct node* acquire_or_create_child_locked(
         struct fuse* fuse, struct node* parent,
         const char* name, const char* actual_name)
 {
+    pthread_mutex_t* child_lock = get_child_lock(fuse, parent);
+    pthread_mutex_lock(child_lock);
     struct node* child = lookup_child_by_name_locked(parent, name);
     if (child) {
         acquire_node_locked(child);
     } else {
         child = create_node_locked(fuse, parent, name, actual_name);
     }
+    pthread_mutex_unlock(child_lock);
     return child;
 }
 
+static struct package_list* create_package_list(void)
+{
+    struct package_list* packages = calloc(1, sizeof(struct package_list));
+    if (!packages) {
+        return NULL;
+    }
+    packages->package_to_appid = hashmapCreate(256, str_hash, str_icase_equals);
+    packages->appid_with_rw = hashmapCreate(128, int_hash, int_equals);
+    if (!packages->package_to_appid || !packages->appid_with_rw) {
+        if (packages->package_to_appid) {
+            hashmapFree(packages->package_to_appid);
+        }
+        if (packages->appid_with_rw) {
+            hashmapFree(packages->appid_with_rw);
+        }
+        free(packages);
+        return NULL;
+    }
+    return packages;
+}
+
 static void fuse_init(struct fuse *fuse, int fd, const char *source_path,
-        gid_t write_gid, derive_t derive, bool split_perms) {
-    pthread_mutex_init(&fuse->lock, NULL);
+        gid_t write_gid, derive_t derive, bool split_perms, bool use_splice,
+        __u64 entry_timeout, __u64 attr_timeout, __u64 attr_cache_timeout) {
+    int i;
+
+    pthread_rwlock_init(&fuse->lock, NULL);
+    for (i = 0; i < CHILD_LOCK_STRIPES; i++) {
+        pthread_mutex_init(&fuse->child_locks[i], NULL);
+        pthread_mutex_init(&fuse->attr_locks[i], NULL);
+    }
 
     fuse->fd = fd;
     fuse->next_generation = 0;
     fuse->derive = derive;
     fuse->split_perms = split_perms;
     fuse->write_gid = write_gid;
+    fuse->packages = NULL;
+    fuse->use_splice = use_splice;
+    fuse->splice_read = false;
+    fuse->splice_write = false;
+    fuse->splice_flags = 0;
+    fuse->entry_timeout = entry_timeout;
+    fuse->attr_timeout = attr_timeout;
+    fuse->attr_cache_timeout = attr_cache_timeout;
+    fuse->attr_cache_hits = 0;
+    fuse->attr_cache_misses = 0;
 
     memset(&fuse->root, 0, sizeof(fuse->root));
     fuse->root.nid = FUSE_ROOT_ID; /* 1 */
@@ -715,8 +1067,7 @@ static void fuse_init(struct fuse *fuse, int fd, const char *source_path,
         fuse->root.perm = PERM_LEGACY_PRE_ROOT;
         fuse->root.mode = 0771;
         fuse->root.gid = AID_SDCARD_R;
-        fuse->package_to_appid = hashmapCreate(256, str_hash, str_icase_equals);
-        fuse->appid_with_rw = hashmapCreate(128, int_hash, int_equals);
+        fuse->packages = create_package_list();
         snprintf(fuse->obbpath, sizeof(fuse->obbpath), "%s/obb", source_path);
         fs_prepare_dir(fuse->obbpath, 0775, getuid(), getgid());
         break;
@@ -726,23 +1077,22 @@ static void fuse_init(struct fuse *fuse, int fd, const char *source_path,
         fuse->root.perm = PERM_ROOT;
         fuse->root.mode = 0771;
         fuse->root.gid = AID_SDCARD_R;
-        fuse->package_to_appid = hashmapCreate(256, str_hash, str_icase_equals);
-        fuse->appid_with_rw = hashmapCreate(128, int_hash, int_equals);
+        fuse->packages = create_package_list();
         snprintf(fuse->obbpath, sizeof(fuse->obbpath), "%s/Android/obb", source_path);
         break;
     }
 }
 
-static void fuse_status(struct fuse *fuse, __u64 unique, int err)
+static void fuse_status(struct fuse_handler* handler, __u64 unique, int err)
 {
     struct fuse_out_header hdr;
     hdr.len = sizeof(hdr);
     hdr.error = err;
     hdr.unique = unique;
-    write(fuse->fd, &hdr, sizeof(hdr));
+    write(handler->fd, &hdr, sizeof(hdr));
 }
 
-static void fuse_reply(struct fuse *fuse, __u64 unique, void *data, int len)
+static void fuse_reply(struct fuse_handler* handler, __u64 unique, void *data, int len)
 {
     struct fuse_out_header hdr;
     struct iovec vec[2];
@@ -757,54 +1107,86 @@ static void fuse_reply(struct fuse *fuse, __u64 unique, void *data, int len)
     vec[1].iov_base = data;
     vec[1].iov_len = len;
 
-    res = writev(fuse->fd, vec, 2);
+    res = writev(handler->fd, vec, 2);
     if (res < 0) {
         ERROR("*** REPLY FAILED *** %d\n", errno);
     }
 }
 
-static int fuse_reply_entry(struct fuse* fuse, __u64 unique,
-        struct node* parent, const char* name, const char* actual_name,
-        const char* path)
+/* Fills in an entry for the named child of 'parent', acquiring a reference
+ * to its node on behalf of the kernel. */
+static int fill_entry_out(struct fuse* fuse, struct node* parent,
+        const char* name, const char* actual_name, const char* path,
+        struct fuse_entry_out* out)
 {
     struct node* node;
-    struct fuse_entry_out out;
     struct stat s;
+    bool cached;
+
+    /* Known children with fresh cached attributes need no lstat(). */
+    memset(out, 0, sizeof(*out));
+    pthread_rwlock_rdlock(&fuse->lock);
+    pthread_mutex_lock(get_child_lock(fuse, parent));
+    node = lookup_child_by_name_locked(parent, name);
+    cached = node && get_cached_attr(fuse, node, &out->attr);
+    if (cached) {
+        acquire_node_locked(node);
+    }
+    pthread_mutex_unlock(get_child_lock(fuse, parent));
+
+    if (!cached) {
+        pthread_rwlock_unlock(&fuse->lock);
+        if (lstat(path, &s) < 0) {
+            return -errno;
+        }
 
-    if (lstat(path, &s) < 0) {
-        return -errno;
-    }
+        pthread_rwlock_rdlock(&fuse->lock);
+        node = acquire_or_create_child_locked(fuse, parent, name, actual_name);
+        if (!node) {
+            pthread_rwlock_unlock(&fuse->lock);
+            return -ENOMEM;
+        }
+        attr_from_stat(&out->attr, &s, node);
+        put_cached_attr(fuse, node, &out->attr);
+    }
+    out->attr_valid = fuse->attr_timeout;
+    out->entry_valid = fuse->entry_timeout;
+    out->nodeid = node->nid;
+    out->generation = node->gen;
+    pthread_rwlock_unlock(&fuse->lock);
+    return 0;
+}
 
-    pthread_mutex_lock(&fuse->lock);
-    node = acquire_or_create_child_locked(fuse, parent, name, actual_name);
-    if (!node) {
-        pthread_mutex_unlock(&fuse->lock);
-        return -ENOMEM;
+static int fuse_reply_entry(struct fuse* fuse, struct fuse_handler* handler,
+        __u64 unique, struct node* parent, const char* name, const char* actual_name,
+        const char* path)
+{
+    struct fuse_entry_out out;
+    int res = fill_entry_out(fuse, parent, name, actual_name, path, &out);
+
+    if (res < 0) {
+        return res;
     }
-    memset(&out, 0, sizeof(out));
-    attr_from_stat(&out.attr, &s, node);
-    out.attr_valid = 10;
-    out.entry_valid = 10;
-    out.nodeid = node->nid;
-    out.generation = node->gen;
-    pthread_mutex_unlock(&fuse->lock);
-    fuse_reply(fuse, unique, &out, sizeof(out));
+    fuse_reply(handler, unique, &out, sizeof(out));
     return NO_STATUS;
 }
 
-static int fuse_reply_attr(struct fuse* fuse, __u64 unique, const struct node* node,
-        const char* path)
+static int fuse_reply_attr(struct fuse* fuse, struct fuse_handler* handler, __u64 unique,
+        struct node* node, const char* path)
 {
     struct fuse_attr_out out;
     struct stat s;
 
-    if (lstat(path, &s) < 0) {
-        return -errno;
-    }
     memset(&out, 0, sizeof(out));
-    attr_from_stat(&out.attr, &s, node);
-    out.attr_valid = 10;
-    fuse_reply(fuse, unique, &out, sizeof(out));
+    if (!get_cached_attr(fuse, node, &out.attr)) {
+        if (lstat(path, &s) < 0) {
+            return -errno;
+        }
+        attr_from_stat(&out.attr, &s, node);
+        put_cached_attr(fuse, node, &out.attr);
+    }
+    out.attr_valid = fuse->attr_timeout;
+    fuse_reply(handler, unique, &out, sizeof(out));
     return NO_STATUS;
 }
 
@@ -816,14 +1198,14 @@ static int handle_lookup(struct fuse* fuse, struct fuse_handler* handler,
     char child_path[PATH_MAX];
     const char* actual_name;
 
-    pthread_mutex_lock(&fuse->lock);
+    pthread_rwlock_rdlock(&fuse->lock);
     parent_node = lookup_node_and_path_by_id_locked(fuse, hdr->nodeid,
             parent_path, sizeof(parent_path));
     TRACE("[%d] LOOKUP %s @ %llx (%s)\n", handler->token, name, hdr->nodeid,
         parent_node ? parent_node->name : "?");
-    pthread_mutex_unlock(&fuse->lock);
+    pthread_rwlock_unlock(&fuse->lock);
 
-    if (!parent_node || !(actual_name = find_file_within(parent_path, name,
+    if (!parent_node || !(actual_name = find_file_within(fuse, parent_node, parent_path, name,
             child_path, sizeof(child_path), 1))) {
         return -ENOENT;
     }
@@ -831,7 +1213,7 @@ static int handle_lookup(struct fuse* fuse, struct fuse_handler* handler,
         return -EACCES;
     }
 
-    return fuse_reply_entry(fuse, hdr->unique, parent_node, name, actual_name, child_path);
+    return fuse_reply_entry(fuse, handler, hdr->unique, parent_node, name, actual_name, child_path);
 }
 
 static int handle_forget(struct fuse* fuse, struct fuse_handler* handler,
@@ -839,17 +1221,43 @@ static int handle_forget(struct fuse* fuse, struct fuse_handler* handler,
 {
     struct node* node;
 
-    pthread_mutex_lock(&fuse->lock);
     node = lookup_node_by_id_locked(fuse, hdr->nodeid);
     TRACE("[%d] FORGET #%lld @ %llx (%s)\n", handler->token, req->nlookup,
             hdr->nodeid, node ? node->name : "?");
-    if (node) {
-        __u64 n = req->nlookup;
-        while (n--) {
-            release_node_locked(node);
+    if (node && req->nlookup) {
+        release_node(fuse, node, req->nlookup);
+    }
+    return NO_STATUS; /* no reply */
+}
+
+static int handle_batch_forget(struct fuse* fuse, struct fuse_handler* handler,
+        const struct fuse_in_header *hdr, const struct fuse_batch_forget_in *req,
+        size_t data_len)
+{
+    const struct fuse_forget_one *items = (const void*) (req + 1);
+    size_t max_count;
+    __u32 count;
+    __u32 i;
+
+    if (data_len < sizeof(*req)) {
+        ERROR("[%d] BATCH_FORGET too short: len=%zu\n", handler->token, data_len);
+        return NO_STATUS; /* no reply, even to a malformed forget */
+    }
+    max_count = (data_len - sizeof(*req)) / sizeof(*items);
+    count = req->count;
+
+    TRACE("[%d] BATCH_FORGET count=%u\n", handler->token, count);
+    if (count > max_count) {
+        ERROR("[%d] BATCH_FORGET truncated: count=%u len=%zu\n",
+                handler->token, count, data_len);
+        count = max_count;
+    }
+    for (i = 0; i < count; i++) {
+        struct node* node = lookup_node_by_id_locked(fuse, items[i].nodeid);
+        if (node && items[i].nlookup) {
+            release_node(fuse, node, items[i].nlookup);
         }
     }
-    pthread_mutex_unlock(&fuse->lock);
     return NO_STATUS; /* no reply */
 }
 
@@ -859,11 +1267,11 @@ static int handle_getattr(struct fuse* fuse, struct fuse_handler* handler,
     struct node* node;
     char path[PATH_MAX];
 
-    pthread_mutex_lock(&fuse->lock);
+    pthread_rwlock_rdlock(&fuse->lock);
     node = lookup_node_and_path_by_id_locked(fuse, hdr->nodeid, path, sizeof(path));
     TRACE("[%d] GETATTR flags=%x fh=%llx @ %llx (%s)\n", handler->token,
             req->getattr_flags, req->fh, hdr->nodeid, node ? node->name : "?");
-    pthread_mutex_unlock(&fuse->lock);
+    pthread_rwlock_unlock(&fuse->lock);
 
     if (!node) {
         return -ENOENT;
@@ -872,7 +1280,7 @@ static int handle_getattr(struct fuse* fuse, struct fuse_handler* handler,
         return -EACCES;
     }
 
-    return fuse_reply_attr(fuse, hdr->unique, node, path);
+    return fuse_reply_attr(fuse, handler, hdr->unique, node, path);
 }
 
 static int handle_setattr(struct fuse* fuse, struct fuse_handler* handler,
@@ -883,12 +1291,12 @@ static int handle_setattr(struct fuse* fuse, struct fuse_handler* handler,
     char path[PATH_MAX];
     struct timespec times[2];
 
-    pthread_mutex_lock(&fuse->lock);
+    pthread_rwlock_rdlock(&fuse->lock);
     has_rw = get_caller_has_rw_locked(fuse, hdr);
     node = lookup_node_and_path_by_id_locked(fuse, hdr->nodeid, path, sizeof(path));
     TRACE("[%d] SETATTR fh=%llx valid=%x @ %llx (%s)\n", handler->token,
             req->fh, req->valid, hdr->nodeid, node ? node->name : "?");
-    pthread_mutex_unlock(&fuse->lock);
+    pthread_rwlock_unlock(&fuse->lock);
 
     if (!node) {
         return -ENOENT;
@@ -900,8 +1308,11 @@ static int handle_setattr(struct fuse* fuse, struct fuse_handler* handler,
     /* XXX: incomplete implementation on purpose.
      * chmod/chown should NEVER be implemented.*/
 
-    if ((req->valid & FATTR_SIZE) && truncate(path, req->size) < 0) {
-        return -errno;
+    if (req->valid & FATTR_SIZE) {
+        if (truncate(path, req->size) < 0) {
+            return -errno;
+        }
+        invalidate_attr(fuse, node);
     }
 
     /* Handle changing atime and mtime.  If FATTR_ATIME_and FATTR_ATIME_NOW
@@ -934,8 +1345,9 @@ static int handle_setattr(struct fuse* fuse, struct fuse_handler* handler,
         if (utimensat(-1, path, times, 0) < 0) {
             return -errno;
         }
+        invalidate_attr(fuse, node);
     }
-    return fuse_reply_attr(fuse, hdr->unique, node, path);
+    return fuse_reply_attr(fuse, handler, hdr->unique, node, path);
 }
 
 static int handle_mknod(struct fuse* fuse, struct fuse_handler* handler,
@@ -947,15 +1359,15 @@ static int handle_mknod(struct fuse* fuse, struct fuse_handler* handler,
     char child_path[PATH_MAX];
     const char* actual_name;
 
-    pthread_mutex_lock(&fuse->lock);
+    pthread_rwlock_rdlock(&fuse->lock);
     has_rw = get_caller_has_rw_locked(fuse, hdr);
     parent_node = lookup_node_and_path_by_id_locked(fuse, hdr->nodeid,
             parent_path, sizeof(parent_path));
     TRACE("[%d] MKNOD %s 0%o @ %llx (%s)\n", handler->token,
             name, req->mode, hdr->nodeid, parent_node ? parent_node->name : "?");
-    pthread_mutex_unlock(&fuse->lock);
+    pthread_rwlock_unlock(&fuse->lock);
 
-    if (!parent_node || !(actual_name = find_file_within(parent_path, name,
+    if (!parent_node || !(actual_name = find_file_within(fuse, parent_node, parent_path, name,
             child_path, sizeof(child_path), 1))) {
         return -ENOENT;
     }
@@ -966,7 +1378,8 @@ static int handle_mknod(struct fuse* fuse, struct fuse_handler* handler,
     if (mknod(child_path, mode, req->rdev) < 0) {
         return -errno;
     }
-    return fuse_reply_entry(fuse, hdr->unique, parent_node, name, actual_name, child_path);
+    invalidate_attr(fuse, parent_node);
+    return fuse_reply_entry(fuse, handler, hdr->unique, parent_node, name, actual_name, child_path);
 }
 
 static int handle_mkdir(struct fuse* fuse, struct fuse_handler* handler,
@@ -978,15 +1391,15 @@ static int handle_mkdir(struct fuse* fuse, struct fuse_handler* handler,
     char child_path[PATH_MAX];
     const char* actual_name;
 
-    pthread_mutex_lock(&fuse->lock);
+    pthread_rwlock_rdlock(&fuse->lock);
     has_rw = get_caller_has_rw_locked(fuse, hdr);
     parent_node = lookup_node_and_path_by_id_locked(fuse, hdr->nodeid,
             parent_path, sizeof(parent_path));
     TRACE("[%d] MKDIR %s 0%o @ %llx (%s)\n", handler->token,
             name, req->mode, hdr->nodeid, parent_node ? parent_node->name : "?");
-    pthread_mutex_unlock(&fuse->lock);
+    pthread_rwlock_unlock(&fuse->lock);
 
-    if (!parent_node || !(actual_name = find_file_within(parent_path, name,
+    if (!parent_node || !(actual_name = find_file_within(fuse, parent_node, parent_path, name,
             child_path, sizeof(child_path), 1))) {
         return -ENOENT;
     }
@@ -997,6 +1410,7 @@ static int handle_mkdir(struct fuse* fuse, struct fuse_handler* handler,
     if (mkdir(child_path, mode) < 0) {
         return -errno;
     }
+    invalidate_attr(fuse, parent_node);
 
     /* When creating /Android/data and /Android/obb, mark them as .nomedia */
     if (parent_node->perm == PERM_ANDROID && !strcasecmp(name, "data")) {
@@ -1016,7 +1430,7 @@ static int handle_mkdir(struct fuse* fuse, struct fuse_handler* handler,
         }
     }
 
-    return fuse_reply_entry(fuse, hdr->unique, parent_node, name, actual_name, child_path);
+    return fuse_reply_entry(fuse, handler, hdr->unique, parent_node, name, actual_name, child_path);
 }
 
 static int handle_unlink(struct fuse* fuse, struct fuse_handler* handler,
@@ -1027,15 +1441,15 @@ static int handle_unlink(struct fuse* fuse, struct fuse_handler* handler,
     char parent_path[PATH_MAX];
     char child_path[PATH_MAX];
 
-    pthread_mutex_lock(&fuse->lock);
+    pthread_rwlock_rdlock(&fuse->lock);
     has_rw = get_caller_has_rw_locked(fuse, hdr);
     parent_node = lookup_node_and_path_by_id_locked(fuse, hdr->nodeid,
             parent_path, sizeof(parent_path));
     TRACE("[%d] UNLINK %s @ %llx (%s)\n", handler->token,
             name, hdr->nodeid, parent_node ? parent_node->name : "?");
-    pthread_mutex_unlock(&fuse->lock);
+    pthread_rwlock_unlock(&fuse->lock);
 
-    if (!parent_node || !find_file_within(parent_path, name,
+    if (!parent_node || !find_file_within(fuse, parent_node, parent_path, name,
             child_path, sizeof(child_path), 1)) {
         return -ENOENT;
     }
@@ -1045,6 +1459,8 @@ static int handle_unlink(struct fuse* fuse, struct fuse_handler* handler,
     if (unlink(child_path) < 0) {
         return -errno;
     }
+    invalidate_attr(fuse, parent_node);
+    invalidate_child_attr(fuse, parent_node, name);
     return 0;
 }
 
@@ -1056,15 +1472,15 @@ static int handle_rmdir(struct fuse* fuse, struct fuse_handler* handler,
     char parent_path[PATH_MAX];
     char child_path[PATH_MAX];
 
-    pthread_mutex_lock(&fuse->lock);
+    pthread_rwlock_rdlock(&fuse->lock);
     has_rw = get_caller_has_rw_locked(fuse, hdr);
     parent_node = lookup_node_and_path_by_id_locked(fuse, hdr->nodeid,
             parent_path, sizeof(parent_path));
     TRACE("[%d] RMDIR %s @ %llx (%s)\n", handler->token,
             name, hdr->nodeid, parent_node ? parent_node->name : "?");
-    pthread_mutex_unlock(&fuse->lock);
+    pthread_rwlock_unlock(&fuse->lock);
 
-    if (!parent_node || !find_file_within(parent_path, name,
+    if (!parent_node || !find_file_within(fuse, parent_node, parent_path, name,
             child_path, sizeof(child_path), 1)) {
         return -ENOENT;
     }
@@ -1074,6 +1490,8 @@ static int handle_rmdir(struct fuse* fuse, struct fuse_handler* handler,
     if (rmdir(child_path) < 0) {
         return -errno;
     }
+    invalidate_attr(fuse, parent_node);
+    invalidate_child_attr(fuse, parent_node, name);
     return 0;
 }
 
@@ -1092,7 +1510,7 @@ static int handle_rename(struct fuse* fuse, struct fuse_handler* handler,
     const char* new_actual_name;
     int res;
 
-    pthread_mutex_lock(&fuse->lock);
+    pthread_rwlock_rdlock(&fuse->lock);
     has_rw = get_caller_has_rw_locked(fuse, hdr);
     old_parent_node = lookup_node_and_path_by_id_locked(fuse, hdr->nodeid,
             old_parent_path, sizeof(old_parent_path));
@@ -1114,14 +1532,22 @@ static int handle_rename(struct fuse* fuse, struct fuse_handler* handler,
         res = -EACCES;
         goto lookup_error;
     }
+    pthread_mutex_lock(get_child_lock(fuse, old_parent_node));
     child_node = lookup_child_by_name_locked(old_parent_node, old_name);
-    if (!child_node || get_node_path_locked(child_node,
-            old_child_path, sizeof(old_child_path)) < 0) {
+    if (child_node) {
+        acquire_node_locked(child_node);
+    }
+    pthread_mutex_unlock(get_child_lock(fuse, old_parent_node));
+    if (!child_node) {
         res = -ENOENT;
         goto lookup_error;
     }
-    acquire_node_locked(child_node);
-    pthread_mutex_unlock(&fuse->lock);
+    if (get_node_path_locked(child_node, old_child_path, sizeof(old_child_path)) < 0) {
+        res = -ENOENT;
+        pthread_rwlock_unlock(&fuse->lock);
+        goto io_error;
+    }
+    pthread_rwlock_unlock(&fuse->lock);
 
     /* Special case for renaming a file where destination is same path
      * differing only by case.  In this case we don't want to look for a case
@@ -1129,7 +1555,7 @@ static int handle_rename(struct fuse* fuse, struct fuse_handler* handler,
      */
     int search = old_parent_node != new_parent_node
             || strcasecmp(old_name, new_name);
-    if (!(new_actual_name = find_file_within(new_parent_path, new_name,
+    if (!(new_actual_name = find_file_within(fuse, new_parent_node, new_parent_path, new_name,
             new_child_path, sizeof(new_child_path), search))) {
         res = -ENOENT;
         goto io_error;
@@ -1141,8 +1567,12 @@ static int handle_rename(struct fuse* fuse, struct fuse_handler* handler,
         res = -errno;
         goto io_error;
     }
+    invalidate_attr(fuse, old_parent_node);
+    invalidate_attr(fuse, new_parent_node);
+    invalidate_attr(fuse, child_node);
+    invalidate_child_attr(fuse, new_parent_node, new_name);
 
-    pthread_mutex_lock(&fuse->lock);
+    pthread_rwlock_wrlock(&fuse->lock);
     res = rename_node_locked(child_node, new_name, new_actual_name);
     if (!res) {
         remove_node_from_parent_locked(child_node);
@@ -1151,11 +1581,11 @@ static int handle_rename(struct fuse* fuse, struct fuse_handler* handler,
     goto done;
 
 io_error:
-    pthread_mutex_lock(&fuse->lock);
+    pthread_rwlock_wrlock(&fuse->lock);
 done:
     release_node_locked(child_node);
 lookup_error:
-    pthread_mutex_unlock(&fuse->lock);
+    pthread_rwlock_unlock(&fuse->lock);
     return res;
 }
 
@@ -1179,12 +1609,12 @@ static int handle_open(struct fuse* fuse, struct fuse_handler* handler,
     struct fuse_open_out out;
     struct handle *h;
 
-    pthread_mutex_lock(&fuse->lock);
+    pthread_rwlock_rdlock(&fuse->lock);
     has_rw = get_caller_has_rw_locked(fuse, hdr);
     node = lookup_node_and_path_by_id_locked(fuse, hdr->nodeid, path, sizeof(path));
     TRACE("[%d] OPEN 0%o @ %llx (%s)\n", handler->token,
             req->flags, hdr->nodeid, node ? node->name : "?");
-    pthread_mutex_unlock(&fuse->lock);
+    pthread_rwlock_unlock(&fuse->lock);
 
     if (!node) {
         return -ENOENT;
@@ -1203,13 +1633,190 @@ static int handle_open(struct fuse* fuse, struct fuse_handler* handler,
         free(h);
         return -errno;
     }
+    h->node = node;
+    if (req->flags & O_TRUNC) {
+        invalidate_attr(fuse, node);
+    }
     out.fh = ptr_to_id(h);
     out.open_flags = 0;
     out.padding = 0;
-    fuse_reply(fuse, hdr->unique, &out, sizeof(out));
+    fuse_reply(handler, hdr->unique, &out, sizeof(out));
+    return NO_STATUS;
+}
+
+/* Grows a pipe to SPLICE_PIPE_SIZE; false if the kernel refused or gave less. */
+static bool size_splice_pipe(int fd)
+{
+    int size = fcntl(fd, F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+    if (size < 0) {
+        return false;
+    }
+    return size >= (int) SPLICE_PIPE_SIZE;
+}
+
+/* Creates the handler's splice pipes on first use.  Returns false if they
+ * cannot be made big enough, in which case data is copied as usual. */
+static bool prepare_splice_pipes(struct fuse_handler* handler)
+{
+    if (handler->pipes_state == 0) {
+        handler->pipes_state = -1;
+        if (pipe(handler->data_pipe) == 0) {
+            if (pipe(handler->reply_pipe) == 0) {
+                if (size_splice_pipe(handler->data_pipe[1])
+                        && size_splice_pipe(handler->reply_pipe[1])) {
+                    handler->pipes_state = 1;
+                } else {
+                    close(handler->reply_pipe[0]);
+                    close(handler->reply_pipe[1]);
+                }
+            }
+            if (handler->pipes_state < 0) {
+                close(handler->data_pipe[0]);
+                close(handler->data_pipe[1]);
+            }
+        }
+        if (handler->pipes_state < 0) {
+            ERROR("[%d] cannot set up splice pipes, copying data: %s\n",
+                    handler->token, strerror(errno));
+        }
+    }
+    return handler->pipes_state > 0;
+}
+
+/* Stops splicing for good once the pipe contents are no longer known. */
+static void abandon_splice_pipes(struct fuse_handler* handler)
+{
+    if (handler->pipes_state > 0) {
+        close(handler->data_pipe[0]);
+        close(handler->data_pipe[1]);
+        close(handler->reply_pipe[0]);
+        close(handler->reply_pipe[1]);
+    }
+    handler->pipes_state = -1;
+}
+
+/* Reads exactly 'len' bytes out of one of the handler's pipes.  If that
+ * fails the pipe contents are no longer known, so splicing is given up. */
+static int read_pipe_fully(struct fuse_handler* handler, int fd, void* buf, size_t len)
+{
+    while (len) {
+        ssize_t res = read(fd, buf, len);
+        if (res < 0 && errno == EINTR) {
+            continue;
+        }
+        if (res <= 0) {
+            ERROR("[%d] splice pipe read failed: %s\n", handler->token,
+                    res < 0 ? strerror(errno) : "eof");
+            abandon_splice_pipes(handler);
+            return -1;
+        }
+        buf = (__u8*) buf + res;
+        len -= res;
+    }
+    return 0;
+}
+
+/* Discards 'len' bytes left in one of the handler's pipes. */
+static void drain_pipe(struct fuse_handler* handler, int fd, size_t len)
+{
+    while (len && handler->pipes_state > 0) {
+        size_t chunk = len < sizeof(handler->read_buffer) ? len : sizeof(handler->read_buffer);
+        if (read_pipe_fully(handler, fd, handler->read_buffer, chunk) == 0) {
+            len -= chunk;
+        }
+    }
+}
+
+/* Replies to a READ by splicing file data through the handler's pipes into
+ * the fuse device, so it never passes through user space.  Returns -EINVAL
+ * without replying when the backing file does not support splice. */
+static int handle_read_spliced(struct fuse* fuse, struct fuse_handler* handler,
+        __u64 unique, struct handle* h, __u32 size, __u64 offset)
+{
+    struct fuse_out_header out;
+    loff_t off = offset;
+    size_t len = 0;
+    size_t moved = 0;
+    ssize_t res;
+
+    while (len < size) {
+        res = splice(h->fd, &off, handler->data_pipe[1], NULL, size - len,
+                fuse->splice_flags);
+        if (res < 0 && errno == EINTR) {
+            continue;
+        }
+        if (res < 0 && !len) {
+            return -errno;
+        }
+        if (res <= 0) {
+            break;
+        }
+        len += res;
+    }
+
+    /* The reply must reach the kernel in one piece with its header in front,
+     * which is only known once the data length is, so assemble it in the
+     * second pipe. */
+    out.len = sizeof(out) + len;
+    out.error = 0;
+    out.unique = unique;
+    if (write(handler->reply_pipe[1], &out, sizeof(out)) != sizeof(out)) {
+        ERROR("[%d] splice header write failed: %s\n", handler->token, strerror(errno));
+        abandon_splice_pipes(handler);
+        return -EIO;
+    }
+    while (moved < len) {
+        res = splice(handler->data_pipe[0], NULL, handler->reply_pipe[1], NULL,
+                len - moved, fuse->splice_flags);
+        if (res <= 0) {
+            ERROR("[%d] splice between pipes failed: %s\n", handler->token, strerror(errno));
+            drain_pipe(handler, handler->data_pipe[0], len - moved);
+            drain_pipe(handler, handler->reply_pipe[0], sizeof(out) + moved);
+            return -EIO;
+        }
+        moved += res;
+    }
+    res = splice(handler->reply_pipe[0], NULL, handler->fd, NULL, out.len, fuse->splice_flags);
+    if (res != (ssize_t) out.len) {
+        ERROR("*** REPLY FAILED *** %d\n", errno);
+        drain_pipe(handler, handler->reply_pipe[0], res > 0 ? out.len - res : out.len);
+    }
     return NO_STATUS;
 }
 
+/* Writes the WRITE payload left in the data pipe by read_request() into
+ * the backing file.  If the file does not accept spliced data, the rest of
+ * the payload is copied out of the pipe and written normally. */
+static ssize_t handle_write_spliced(struct fuse* fuse, struct fuse_handler* handler,
+        struct handle* h, __u64 offset)
+{
+    loff_t off = offset;
+    size_t done = 0;
+    size_t len = handler->spliced_len;
+    ssize_t res;
+
+    handler->spliced_len = 0;
+    while (done < len) {
+        res = splice(handler->data_pipe[0], NULL, h->fd, &off, len - done,
+                fuse->splice_flags);
+        if (res < 0 && errno == EINTR) {
+            continue;
+        }
+        if (res <= 0) {
+            size_t left = len - done;
+            if (read_pipe_fully(handler, handler->data_pipe[0], handler->read_buffer, left)) {
+                return done ? (ssize_t) done : -EIO;
+            }
+            res = pwrite64(h->fd, handler->read_buffer, left, off);
+            if (res < 0) {
+                return done ? (ssize_t) done : -errno;
+            }
+        }
+        done += res;
+    }
+    return done;
+}
+
 static int handle_read(struct fuse* fuse, struct fuse_handler* handler,
         const struct fuse_in_header* hdr, const struct fuse_read_in* req)
 {
@@ -1228,11 +1835,18 @@ static int handle_read(struct fuse* fuse, struct fuse_handler* handler,
     if (size > sizeof(handler->read_buffer)) {
         return -EINVAL;
     }
+    if (fuse->splice_write && prepare_splice_pipes(handler)) {
+        res = handle_read_spliced(fuse, handler, unique, h, size, offset);
+        if (res != -EINVAL) {
+            return res;
+        }
+        /* backing file cannot be spliced from; copy instead */
+    }
     res = pread64(h->fd, handler->read_buffer, size, offset);
     if (res < 0) {
         return -errno;
     }
-    fuse_reply(fuse, unique, handler->read_buffer, res);
+    fuse_reply(handler, unique, handler->read_buffer, res);
     return NO_STATUS;
 }
 
@@ -1242,16 +1856,28 @@ static int handle_write(struct fuse* fuse, struct fuse_handler* handler,
 {
     struct fuse_write_out out;
     struct handle *h = id_to_ptr(req->fh);
+    __u64 unique = hdr->unique;
     int res;
 
     TRACE("[%d] WRITE %p(%d) %u@%llu\n", handler->token,
             h, h->fd, req->size, req->offset);
-    res = pwrite64(h->fd, buffer, req->size, req->offset);
+    if (handler->spliced_len) {
+        /* The payload is still in the data pipe; draining it may reuse the
+         * request buffer, so hdr and req are not touched after this. */
+        res = handle_write_spliced(fuse, handler, h, req->offset);
+    } else {
+        res = pwrite64(h->fd, buffer, req->size, req->offset);
+        if (res < 0) {
+            res = -errno;
+        }
+    }
     if (res < 0) {
-        return -errno;
+        return res;
     }
+    invalidate_attr(fuse, h->node);
     out.size = res;
-    fuse_reply(fuse, hdr->unique, &out, sizeof(out));
+    out.padding = 0;
+    fuse_reply(handler, unique, &out, sizeof(out));
     return NO_STATUS;
 }
 
@@ -1263,10 +1889,10 @@ static int handle_statfs(struct fuse* fuse, struct fuse_handler* handler,
     struct fuse_statfs_out out;
     int res;
 
-    pthread_mutex_lock(&fuse->lock);
+    pthread_rwlock_rdlock(&fuse->lock);
     TRACE("[%d] STATFS\n", handler->token);
     res = get_node_path_locked(&fuse->root, path, sizeof(path));
-    pthread_mutex_unlock(&fuse->lock);
+    pthread_rwlock_unlock(&fuse->lock);
     if (res < 0) {
         return -ENOENT;
     }
@@ -1282,7 +1908,7 @@ static int handle_statfs(struct fuse* fuse, struct fuse_handler* handler,
     out.st.bsize = stat.f_bsize;
     out.st.namelen = stat.f_namelen;
     out.st.frsize = stat.f_frsize;
-    fuse_reply(fuse, hdr->unique, &out, sizeof(out));
+    fuse_reply(handler, hdr->unique, &out, sizeof(out));
     return NO_STATUS;
 }
 
@@ -1328,11 +1954,11 @@ static int handle_opendir(struct fuse* fuse, struct fuse_handler* handler,
     struct fuse_open_out out;
     struct dirhandle *h;
 
-    pthread_mutex_lock(&fuse->lock);
+    pthread_rwlock_rdlock(&fuse->lock);
     node = lookup_node_and_path_by_id_locked(fuse, hdr->nodeid, path, sizeof(path));
     TRACE("[%d] OPENDIR @ %llx (%s)\n", handler->token,
             hdr->nodeid, node ? node->name : "?");
-    pthread_mutex_unlock(&fuse->lock);
+    pthread_rwlock_unlock(&fuse->lock);
 
     if (!node) {
         return -ENOENT;
@@ -1350,39 +1976,120 @@ static int handle_opendir(struct fuse* fuse, struct fuse_handler* handler,
         free(h);
         return -errno;
     }
+    h->next_off = 0;
+    h->pending = NULL;
     out.fh = ptr_to_id(h);
     out.open_flags = 0;
     out.padding = 0;
-    fuse_reply(fuse, hdr->unique, &out, sizeof(out));
+    fuse_reply(handler, hdr->unique, &out, sizeof(out));
     return NO_STATUS;
 }
 
+/* Positions the directory stream so that the next entry read is the one at
+ * 'offset'.  Offsets are entry indexes plus one, so the common case of
+ * continuing where the previous reply stopped needs no work at all. */
+static void seek_dirhandle(struct dirhandle* h, __u64 offset)
+{
+    if (offset == h->next_off) {
+        return;
+    }
+    /* rewinddir() might have been called above us, or the kernel consumed
+     * only part of the previous reply; rewind and skip forward. */
+    rewinddir(h->d);
+    h->pending = NULL;
+    h->next_off = 0;
+    while (h->next_off < offset && readdir(h->d)) {
+        h->next_off++;
+    }
+}
+
 static int handle_readdir(struct fuse* fuse, struct fuse_handler* handler,
-        const struct fuse_in_header* hdr, const struct fuse_read_in* req)
+        const struct fuse_in_header* hdr, const struct fuse_read_in* req, bool plus)
 {
-    char buffer[8192];
-    struct fuse_dirent *fde = (struct fuse_dirent*) buffer;
-    struct dirent *de;
     struct dirhandle *h = id_to_ptr(req->fh);
+    const struct fuse_in_header in_hdr = *hdr;
+    __u32 size = req->size;
+    __u64 offset = req->offset;
+    struct node* node = NULL;
+    char path[PATH_MAX];
+    char child_path[PATH_MAX];
+    size_t pathlen = 0;
+    size_t pos = 0;
+    struct dirent *de;
 
-    TRACE("[%d] READDIR %p\n", handler->token, h);
-    if (req->offset == 0) {
-        /* rewinddir() might have been called above us, so rewind here too */
-        TRACE("[%d] calling rewinddir()\n", handler->token);
-        rewinddir(h->d);
+    /* Don't access hdr or req beyond this point, the entries are assembled in
+     * the read buffer which overlaps the request buffer. */
+
+    TRACE("[%d] READDIR%s %p size=%u off=%llu\n", handler->token, plus ? "PLUS" : "",
+            h, size, offset);
+    if (size > sizeof(handler->read_buffer)) {
+        size = sizeof(handler->read_buffer);
     }
-    de = readdir(h->d);
-    if (!de) {
-        return 0;
+    if (plus) {
+        pthread_rwlock_rdlock(&fuse->lock);
+        node = lookup_node_and_path_by_id_locked(fuse, in_hdr.nodeid, path, sizeof(path));
+        pthread_rwlock_unlock(&fuse->lock);
+        if (!node) {
+            return -ENOENT;
+        }
+        pathlen = strlen(path);
+    }
+
+    seek_dirhandle(h, offset);
+    while ((de = h->pending ? h->pending : readdir(h->d))) {
+        size_t namelen = strlen(de->d_name);
+        size_t entlen = plus
+                ? FUSE_DIRENT_ALIGN(FUSE_NAME_OFFSET_DIRENTPLUS + namelen)
+                : FUSE_DIRENT_ALIGN(FUSE_NAME_OFFSET + namelen);
+        __u8 *entry = handler->read_buffer + pos;
+        struct fuse_dirent *fde;
+
+        if (pos + entlen > size) {
+            /* keep it for the next request */
+            h->pending = de;
+            break;
+        }
+        h->pending = NULL;
+        h->next_off++;
+
+        if (plus) {
+            struct fuse_direntplus *fdp = (void*) entry;
+            fde = &fdp->dirent;
+            memset(&fdp->entry_out, 0, sizeof(fdp->entry_out));
+            fde->ino = FUSE_UNKNOWN_INO;
+            /* "." and "..", names the caller may not see and names that fail
+             * to resolve are returned without a node; the kernel then falls
+             * back to LOOKUP for them. */
+            if (strcmp(de->d_name, ".") && strcmp(de->d_name, "..")
+                    && pathlen + namelen + 2 <= sizeof(child_path)
+                    && check_caller_access_to_name(fuse, &in_hdr, node, de->d_name,
+                            R_OK, false)) {
+                memcpy(child_path, path, pathlen);
+                child_path[pathlen] = '/';
+                memcpy(child_path + pathlen + 1, de->d_name, namelen + 1);
+                if (!fill_entry_out(fuse, node, de->d_name, de->d_name, child_path,
+                        &fdp->entry_out)) {
+                    fde->ino = fdp->entry_out.attr.ino;
+                }
+            }
+        } else {
+            fde = (void*) entry;
+            fde->ino = FUSE_UNKNOWN_INO;
+        }
+        /* offsets start at 1 so we can detect when rewinddir() seeks back to the beginning */
+        fde->off = h->next_off;
+        fde->type = de->d_type;
+        fde->namelen = namelen;
+        memcpy(fde->name, de->d_name, namelen);
+        /* zero the alignment padding */
+        memset(fde->name + namelen, 0, entry + entlen - (__u8*) (fde->name + namelen));
+        pos += entlen;
+    }
+    if (!pos && h->pending) {
+        /* the very first entry did not fit */
+        return -EINVAL;
     }
-    fde->ino = FUSE_UNKNOWN_INO;
-    /* increment the offset so we can detect when rewinddir() seeks back to the beginning */
-    fde->off = req->offset + 1;
-    fde->type = de->d_type;
-    fde->namelen = strlen(de->d_name);
-    memcpy(fde->name, de->d_name, fde->namelen + 1);
-    fuse_reply(fuse, hdr->unique, fde,
-            FUSE_DIRENT_ALIGN(sizeof(struct fuse_dirent) + fde->namelen));
+    fuse_reply(handler, in_hdr.unique, handler->read_buffer, pos);
     return NO_STATUS;
 }
 
@@ -1408,10 +2115,20 @@ static int handle_init(struct fuse* fuse, struct fuse_handler* handler,
     out.minor = FUSE_KERNEL_MINOR_VERSION;
     out.max_readahead = req->max_readahead;
     out.flags = FUSE_ATOMIC_O_TRUNC | FUSE_BIG_WRITES;
+    /* The fuse device supports splice from protocol 7.14 on; the kernel does
+     * not advertise it through the INIT flags. */
+    if (fuse->use_splice && req->minor >= 14) {
+        fuse->splice_read = true;
+        fuse->splice_write = true;
+        fuse->splice_flags = SPLICE_F_MOVE;
+    }
+    if (req->flags & FUSE_DO_READDIRPLUS) {
+        out.flags |= FUSE_DO_READDIRPLUS | (req->flags & FUSE_READDIRPLUS_AUTO);
+    }
     out.max_background = 32;
     out.congestion_threshold = 32;
     out.max_write = MAX_WRITE;
-    fuse_reply(fuse, hdr->unique, &out, sizeof(out));
+    fuse_reply(handler, hdr->unique, &out, sizeof(out));
     return NO_STATUS;
 }
 
@@ -1429,6 +2146,11 @@ static int handle_fuse_request(struct fuse *fuse, struct fuse_handler* handler,
         return handle_forget(fuse, handler, hdr, req);
     }
 
+    case FUSE_BATCH_FORGET: { /* batch_forget_in, forget_one[] -> */
+        const struct fuse_batch_forget_in *req = data;
+        return handle_batch_forget(fuse, handler, hdr, req, data_len);
+    }
+
     case FUSE_GETATTR: { /* getattr_in -> attr_out */
         const struct fuse_getattr_in *req = data;
         return handle_getattr(fuse, handler, hdr, req);
@@ -1514,9 +2236,14 @@ static int handle_fuse_request(struct fuse *fuse, struct fuse_handler* handler,
         return handle_opendir(fuse, handler, hdr, req);
     }
 
-    case FUSE_READDIR: {
+    case FUSE_READDIR: { /* read_in -> dirent[] */
         const struct fuse_read_in *req = data;
-        return handle_readdir(fuse, handler, hdr, req);
+        return handle_readdir(fuse, handler, hdr, req, false);
+    }
+
+    case FUSE_READDIRPLUS: { /* read_in -> direntplus[] */
+        const struct fuse_read_in *req = data;
+        return handle_readdir(fuse, handler, hdr, req, true);
     }
 
     case FUSE_RELEASEDIR: { /* release_in -> */
@@ -1538,12 +2265,54 @@ static int handle_fuse_request(struct fuse *fuse, struct fuse_handler* handler,
     }
 }
 
+/* Reads the next request from the fuse device into the request buffer.
+ * When splicing, a well-formed WRITE only has its headers copied; its
+ * payload stays in the data pipe and handler->spliced_len says how much. */
+static ssize_t read_request(struct fuse_handler* handler)
+{
+    struct fuse* fuse = handler->fuse;
+    const struct fuse_in_header *hdr = (void*)handler->request_buffer;
+    size_t copy_len;
+    ssize_t len;
+
+    handler->spliced_len = 0;
+    if (!fuse->splice_read || !prepare_splice_pipes(handler)) {
+        return read(handler->fd, handler->request_buffer, sizeof(handler->request_buffer));
+    }
+
+    len = splice(handler->fd, NULL, handler->data_pipe[1], NULL,
+            sizeof(handler->request_buffer), 0);
+    if (len < (ssize_t) sizeof(struct fuse_in_header)) {
+        if (len > 0) {
+            read_pipe_fully(handler, handler->data_pipe[0], handler->request_buffer, len);
+        }
+        return len;
+    }
+    if (read_pipe_fully(handler, handler->data_pipe[0], handler->request_buffer,
+            sizeof(struct fuse_in_header))) {
+        errno = EIO;
+        return -1;
+    }
+    copy_len = len - sizeof(struct fuse_in_header);
+    if (hdr->opcode == FUSE_WRITE && hdr->len == (size_t) len
+            && copy_len > sizeof(struct fuse_write_in)) {
+        handler->spliced_len = copy_len - sizeof(struct fuse_write_in);
+        copy_len = sizeof(struct fuse_write_in);
+    }
+    if (read_pipe_fully(handler, handler->data_pipe[0],
+            handler->request_buffer + sizeof(struct fuse_in_header), copy_len)) {
+        handler->spliced_len = 0;
+        errno = EIO;
+        return -1;
+    }
+    return len;
+}
+
 static void handle_fuse_requests(struct fuse_handler* handler)
 {
     struct fuse* fuse = handler->fuse;
     for (;;) {
-        ssize_t len = read(fuse->fd,
-                handler->request_buffer, sizeof(handler->request_buffer));
+        ssize_t len = read_request(handler);
         if (len < 0) {
             if (errno != EINTR) {
                 ERROR("[%d] handle_fuse_requests: errno=%d\n", handler->token, errno);
@@ -1567,6 +2336,11 @@ static void handle_fuse_requests(struct fuse_handler* handler)
         size_t data_len = len - sizeof(struct fuse_in_header);
         __u64 unique = hdr->unique;
         int res = handle_fuse_request(fuse, handler, hdr, data, data_len);
+        if (handler->spliced_len) {
+            /* the request did not consume its spliced payload */
+            drain_pipe(handler, handler->data_pipe[0], handler->spliced_len);
+            handler->spliced_len = 0;
+        }
 
         /* We do not access the request again after this point because the underlying
          * buffer storage may have been reused while processing the request. */
@@ -1575,7 +2349,7 @@ static void handle_fuse_requests(struct fuse_handler* handler)
             if (res) {
                 TRACE("[%d] ERROR %d\n", handler->token, res);
             }
-            fuse_status(fuse, unique, res);
+            fuse_status(handler, unique, res);
         }
     }
 }
@@ -1600,16 +2374,57 @@ static bool remove_int_to_null(void *key, void *value, void *context) {
     return true;
 }
 
-static int read_package_list(struct fuse *fuse) {
-    pthread_mutex_lock(&fuse->lock);
+static void free_package_list(struct package_list* packages) {
+    hashmapForEach(packages->package_to_appid, remove_str_to_int, packages->package_to_appid);
+    hashmapForEach(packages->appid_with_rw, remove_int_to_null, packages->appid_with_rw);
+    hashmapFree(packages->package_to_appid);
+    hashmapFree(packages->appid_with_rw);
+    free(packages);
+}
 
-    hashmapForEach(fuse->package_to_appid, remove_str_to_int, fuse->package_to_appid);
-    hashmapForEach(fuse->appid_with_rw, remove_int_to_null, fuse->appid_with_rw);
+struct package_diff {
+    Hashmap* other;
+    int count;
+};
+
+/* Counts entries missing from, or mapped differently in, the other map. */
+static bool count_differences(void *key, void *value, void *context) {
+    struct package_diff* diff = context;
+    if (!hashmapContainsKey(diff->other, key) || hashmapGet(diff->other, key) != value) {
+        diff->count++;
+    }
+    return true;
+}
+
+static int diff_maps(Hashmap* a, Hashmap* b) {
+    struct package_diff diff;
+    diff.count = 0;
+    diff.other = b;
+    hashmapForEach(a, count_differences, &diff);
+    diff.other = a;
+    hashmapForEach(b, count_differences, &diff);
+    return diff.count;
+}
+
+/* Parses packages.list into a new snapshot without holding any lock, and
+ * swaps it in only if it differs from the current one.  Readers never block
+ * on a reload; the tree lock is only taken exclusively, and briefly, to
+ * wait for readers of the old snapshot to finish before freeing it. */
+static int read_package_list(struct fuse *fuse) {
+    struct package_list* packages;
+    struct package_list* old_packages = fuse->packages;
+    int differences;
 
     FILE* file = fopen(kPackagesListFile, "r");
     if (!file) {
         ERROR("failed to open package list: %s\n", strerror(errno));
-        pthread_mutex_unlock(&fuse->lock);
+        return -1;
+    }
+
+    packages = create_package_list();
+    if (!packages) {
+        ERROR("failed to allocate package list\n");
+        fclose(file);
         return -1;
     }
 
@@ -1621,24 +2436,36 @@ static int read_package_list(struct fuse *fuse) {
 
         if (sscanf(buf, "%s %d %*d %*s %*s %s", package_name, &appid, gids) == 3) {
             char* package_name_dup = strdup(package_name);
-            hashmapPut(fuse->package_to_appid, package_name_dup, (void*) appid);
+            hashmapPut(packages->package_to_appid, package_name_dup, (void*) appid);
 
             char* token = strtok(gids, ",");
             while (token != NULL) {
                 if (strtoul(token, NULL, 10) == fuse->write_gid) {
-                    hashmapPut(fuse->appid_with_rw, (void*) appid, (void*) 1);
+                    hashmapPut(packages->appid_with_rw, (void*) appid, (void*) 1);
                     break;
                 }
                 token = strtok(NULL, ",");
             }
         }
     }
-
-    TRACE("read_package_list: found %d packages, %d with write_gid\n",
-            hashmapSize(fuse->package_to_appid),
-            hashmapSize(fuse->appid_with_rw));
     fclose(file);
-    pthread_mutex_unlock(&fuse->lock);
+
+    differences = diff_maps(old_packages->package_to_appid, packages->package_to_appid)
+            + diff_maps(old_packages->appid_with_rw, packages->appid_with_rw);
+    TRACE("read_package_list: found %d packages, %d with write_gid, %d differences\n",
+            hashmapSize(packages->package_to_appid),
+            hashmapSize(packages->appid_with_rw), differences);
+    if (!differences) {
+        free_package_list(packages);
+        return 0;
+    }
+
+    /* Publish the fully built snapshot, then wait out readers of the old one. */
+    __sync_synchronize();
+    fuse->packages = packages;
+    pthread_rwlock_wrlock(&fuse->lock);
+    pthread_rwlock_unlock(&fuse->lock);
+    free_package_list(old_packages);
     return 0;
 }
 
@@ -1704,9 +2531,80 @@ static void watch_package_list(struct fuse* fuse) {
     }
 }
 
-static int ignite_fuse(struct fuse* fuse, int num_threads)
+static void dump_stats(struct fuse* fuse)
+{
+    unsigned long hits = fuse->attr_cache_hits;
+    unsigned long misses = fuse->attr_cache_misses;
+    unsigned long total = hits + misses;
+
+    ERROR("attr cache: timeout=%llus hits=%lu misses=%lu hit rate=%lu%%\n",
+            fuse->attr_cache_timeout, hits, misses, total ? hits * 100 / total : 0);
+}
+
+/* Dumps statistics whenever SIGUSR1 is received.  The signal is blocked in
+ * every other thread so that it is always delivered here. */
+static void* start_stats_dumper(void* data)
+{
+    struct fuse* fuse = data;
+    sigset_t set;
+    int sig;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    for (;;) {
+        if (!sigwait(&set, &sig)) {
+            dump_stats(fuse);
+        }
+    }
+    return NULL;
+}
+
+/* Gives each handler thread its own clone of the fuse device when the kernel
+ * supports it, so threads dequeue requests and match replies on private
+ * queues instead of all contending on one.  Handlers share 'fd' otherwise.
+ * Must be called after mounting and before dropping privileges. */
+static int* clone_fuse_fds(int fd, int num_threads)
+{
+    int* fds;
+    __u32 master = fd;
+    int i;
+
+    fds = malloc(num_threads * sizeof(int));
+    if (!fds) {
+        return NULL;
+    }
+    for (i = 0; i < num_threads; i++) {
+        fds[i] = fd;
+    }
+    for (i = 1; i < num_threads; i++) {
+        int clone_fd = open("/dev/fuse", O_RDWR);
+        if (clone_fd < 0) {
+            break;
+        }
+        if (ioctl(clone_fd, FUSE_DEV_IOC_CLONE, &master) < 0) {
+            TRACE("FUSE_DEV_IOC_CLONE unsupported: %s\n", strerror(errno));
+            close(clone_fd);
+            break;
+        }
+        fds[i] = clone_fd;
+    }
+    return fds;
+}
+
+/* Default handler thread count: one per online CPU, plus the thread that
+ * watches packages.list when deriving permissions. */
+static int get_default_num_threads(derive_t derive)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int num_threads = (cpus > 0 ? cpus : 1) + (derive == DERIVE_NONE ? 0 : 1);
+    return num_threads < DEFAULT_NUM_THREADS ? DEFAULT_NUM_THREADS : num_threads;
+}
+
+static int ignite_fuse(struct fuse* fuse, int num_threads, const int* fds)
 {
     struct fuse_handler* handlers;
+    pthread_t stats_thread;
+    sigset_t set;
     int i;
 
     handlers = malloc(num_threads * sizeof(struct fuse_handler));
@@ -1718,6 +2616,16 @@ static int ignite_fuse(struct fuse* fuse, int num_threads)
     for (i = 0; i < num_threads; i++) {
         handlers[i].fuse = fuse;
         handlers[i].token = i;
+        handlers[i].fd = fds ? fds[i] : fuse->fd;
+        handlers[i].pipes_state = 0;
+        handlers[i].spliced_len = 0;
+    }
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    if (pthread_create(&stats_thread, NULL, start_stats_dumper, fuse)) {
+        ERROR("failed to start stats thread\n");
     }
 
     /* When deriving permissions, this thread is used to process inotify events,
@@ -1752,18 +2660,25 @@ static int usage()
             "    -u: specify UID to run as\n"
             "    -g: specify GID to run as\n"
             "    -w: specify GID required to write (default sdcard_rw, requires -d or -l)\n"
-            "    -t: specify number of threads to use (default %d)\n"
+            "    -t: specify number of threads to use (default 0: one per CPU, at least %d)\n"
             "    -d: derive file permissions based on path\n"
             "    -l: derive file permissions based on legacy internal layout\n"
             "    -s: split derived permissions for pics, av\n"
-            "\n", DEFAULT_NUM_THREADS);
+            "    -z: splice file data to and from the kernel (zero-copy I/O)\n"
+            "    -E: seconds the kernel may cache entries (default %d)\n"
+            "    -A: seconds the kernel may cache attributes (default %d)\n"
+            "    -C: seconds sdcard may cache attributes itself (default 0, off)\n"
+            "        send SIGUSR1 to dump cache statistics\n"
+            "\n", DEFAULT_NUM_THREADS, DEFAULT_ENTRY_TIMEOUT, DEFAULT_ATTR_TIMEOUT);
     return 1;
 }
 
 static int run(const char* source_path, const char* dest_path, uid_t uid,
         gid_t gid, gid_t write_gid, int num_threads, derive_t derive,
-        bool split_perms) {
+        bool split_perms, bool use_splice, __u64 entry_timeout, __u64 attr_timeout,
+        __u64 attr_cache_timeout) {
     int fd;
+    int* handler_fds = NULL;
     char opts[256];
     int res;
     struct fuse fuse;
@@ -1787,6 +2702,8 @@ static int run(const char* source_path, const char* dest_path, uid_t uid,
         goto error;
     }
 
+    handler_fds = clone_fuse_fds(fd, num_threads);
+
     res = setgroups(sizeof(kGroups) / sizeof(kGroups[0]), kGroups);
     if (res < 0) {
         ERROR("cannot setgroups: %s\n", strerror(errno));
@@ -1805,10 +2722,11 @@ static int run(const char* source_path, const char* dest_path, uid_t uid,
         goto error;
     }
 
-    fuse_init(&fuse, fd, source_path, write_gid, derive, split_perms);
+    fuse_init(&fuse, fd, source_path, write_gid, derive, split_perms, use_splice,
+            entry_timeout, attr_timeout, attr_cache_timeout);
 
     umask(0);
-    res = ignite_fuse(&fuse, num_threads);
+    res = ignite_fuse(&fuse, num_threads, handler_fds);
 
     /* we do not attempt to umount the file system here because we are no longer
      * running as the root user */
@@ -1826,14 +2744,18 @@ int main(int argc, char **argv)
     uid_t uid = 0;
     gid_t gid = 0;
     gid_t write_gid = AID_SDCARD_RW;
-    int num_threads = DEFAULT_NUM_THREADS;
+    int num_threads = 0;
     derive_t derive = DERIVE_NONE;
     bool split_perms = false;
+    bool use_splice = false;
+    __u64 entry_timeout = DEFAULT_ENTRY_TIMEOUT;
+    __u64 attr_timeout = DEFAULT_ATTR_TIMEOUT;
+    __u64 attr_cache_timeout = 0;
     int i;
     struct rlimit rlim;
 
     int opt;
-    while ((opt = getopt(argc, argv, "u:g:w:t:dls")) != -1) {
+    while ((opt = getopt(argc, argv, "u:g:w:t:dlszE:A:C:")) != -1) {
         switch (opt) {
             case 'u':
                 uid = strtoul(optarg, NULL, 10);
@@ -1856,6 +2778,18 @@ int main(int argc, char **argv)
             case 's':
                 split_perms = true;
                 break;
+            case 'z':
+                use_splice = true;
+                break;
+            case 'E':
+                entry_timeout = strtoull(optarg, NULL, 10);
+                break;
+            case 'A':
+                attr_timeout = strtoull(optarg, NULL, 10);
+                break;
+            case 'C':
+                attr_cache_timeout = strtoull(optarg, NULL, 10);
+                break;
             case '?':
             default:
                 return usage();
@@ -1890,6 +2824,9 @@ int main(int argc, char **argv)
         ERROR("uid and gid must be nonzero\n");
         return usage();
     }
+    if (!num_threads) {
+        num_threads = get_default_num_threads(derive);
+    }
     if (num_threads < 1) {
         ERROR("number of threads must be at least 1\n");
         return usage();
@@ -1905,6 +2842,7 @@ int main(int argc, char **argv)
         ERROR("Error setting RLIMIT_NOFILE, errno = %d\n", errno);
     }
 
-    res = run(source_path, dest_path, uid, gid, write_gid, num_threads, derive, split_perms);
+    res = run(source_path, dest_path, uid, gid, write_gid, num_threads, derive, split_perms,
+            use_splice, entry_timeout, attr_timeout, attr_cache_timeout);
     return res < 0 ? 1 : 0;
 }